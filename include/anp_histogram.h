@@ -0,0 +1,113 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#ifndef ANP_HISTOGRAM_H_
+#define ANP_HISTOGRAM_H_
+
+#include <cstdint>
+
+// Log-linear latency histogram.
+//
+// Values below 2^precision get a bucket each. Above that, every power of two
+// is split into 2^precision equal buckets, so a bucket is never wider than
+// 1/2^precision of the values it holds, from a few ns up to
+// 2^ANP_HISTOGRAM_RANGE_LOG2 ns. Larger values land in the last bucket.
+// Recording is a count leading zeros and an increment, and histograms of the
+// same precision merge by adding bucket counts.
+//
+
+#define ANP_HISTOGRAM_MAX_PRECISION 3
+#define ANP_HISTOGRAM_RANGE_LOG2    36 // ~69 s
+#define ANP_HISTOGRAM_BUCKETS \
+    ((ANP_HISTOGRAM_RANGE_LOG2 - ANP_HISTOGRAM_MAX_PRECISION + 1) << ANP_HISTOGRAM_MAX_PRECISION)
+
+typedef uint64_t counter_t;
+
+class anp_latency_histogram {
+public:
+    explicit anp_latency_histogram(uint32_t precision = ANP_HISTOGRAM_MAX_PRECISION)
+        : precision(precision > ANP_HISTOGRAM_MAX_PRECISION ? ANP_HISTOGRAM_MAX_PRECISION : precision) {}
+
+    uint32_t num_buckets() const {
+        return (ANP_HISTOGRAM_RANGE_LOG2 - precision + 1) << precision;
+    }
+
+    uint32_t index(uint64_t value) const {
+        if (value < (1ULL << precision)) {
+            return value;
+        }
+        uint32_t exp = 63 - __builtin_clzll(value);
+        if (exp >= ANP_HISTOGRAM_RANGE_LOG2) {
+            return num_buckets() - 1;
+        }
+        uint32_t sub = (value >> (exp - precision)) & ((1U << precision) - 1);
+        return ((exp - precision + 1) << precision) | sub;
+    }
+
+    // smallest value counted in bucket
+    uint64_t lower(uint32_t bucket) const {
+        if (bucket < (1U << precision)) {
+            return bucket;
+        }
+        uint32_t group = bucket >> precision;
+        uint64_t sub = bucket & ((1U << precision) - 1);
+        return ((1ULL << precision) + sub) << (group - 1);
+    }
+
+    // largest value counted in bucket, the last one is open ended
+    uint64_t upper(uint32_t bucket) const {
+        return (bucket + 1 < num_buckets()) ? lower(bucket + 1) - 1 : UINT64_MAX;
+    }
+
+    static void merge(counter_t* into, const counter_t* from) {
+        for (int i = 0; i < ANP_HISTOGRAM_BUCKETS; i++) {
+            into[i] += from[i];
+        }
+    }
+
+    // value below which a fraction q of the recorded values fall, reported as
+    // the upper bound of its bucket and capped by the largest value seen
+    uint64_t percentile(const counter_t* buckets, double q, uint64_t max_value) const {
+        counter_t total = 0;
+        for (uint32_t i = 0; i < num_buckets(); i++) {
+            total += buckets[i];
+        }
+        if (!total) {
+            return 0;
+        }
+        counter_t rank = (counter_t)(q * total);
+        if (rank < total && (double)rank < q * total) {
+            rank++;
+        }
+        if (!rank) {
+            rank = 1;
+        }
+        counter_t seen = 0;
+        for (uint32_t i = 0; i < num_buckets(); i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                uint64_t value = upper(i);
+                return (max_value && value > max_value) ? max_value : value;
+            }
+        }
+        return max_value;
+    }
+
+    uint32_t precision;
+};
+
+#endif
@@ -0,0 +1,202 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#ifndef ANP_JSON_WRITER_H_
+#define ANP_JSON_WRITER_H_
+
+#include <charconv>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <unistd.h>
+
+// Streaming JSON writer for the telemetry output.
+//
+// Output goes through a caller provided buffer straight to a file descriptor,
+// so exporting never builds the document in memory. As with
+// boost::property_tree::write_json, which produced these files before, every
+// value is written as a string and nesting is indented by 4 spaces.
+//
+class anp_json_writer {
+public:
+    static constexpr int max_depth = 16;
+
+    anp_json_writer(int fd, char* buffer, size_t size)
+        : fd(fd), buffer(buffer), size(size), len(0), depth(0), failed(false) {
+        first[0] = true;
+    }
+
+    void begin_object(const char* key = nullptr) { open(key, '{'); }
+    void end_object() { close('}'); }
+    void begin_array(const char* key = nullptr) { open(key, '['); }
+    void end_array() { close(']'); }
+
+    void field(const char* key, const char* value) {
+        begin_value(key);
+        put_string(value);
+    }
+
+    void field(const char* key, const std::string& value) {
+        field(key, value.c_str());
+    }
+
+    void field(const char* key, bool value) {
+        begin_value(key);
+        put_raw(value ? "\"true\"" : "\"false\"");
+    }
+
+    void field(const char* key, double value) {
+        char digits[32];
+        int n = snprintf(digits, sizeof(digits), "%.17g", value);
+        begin_value(key);
+        put('"');
+        append(digits, n);
+        put('"');
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value>::type
+    field(const char* key, T value) {
+        char digits[24];
+        auto res = std::to_chars(digits, digits + sizeof(digits), value);
+        begin_value(key);
+        put('"');
+        append(digits, res.ptr - digits);
+        put('"');
+    }
+
+    // writes out what is buffered, returns false if any write failed
+    bool flush() {
+        write_all(buffer, len);
+        len = 0;
+        return !failed;
+    }
+
+private:
+    void open(const char* key, char bracket) {
+        begin_value(key);
+        put(bracket);
+        if (depth + 1 < max_depth) {
+            depth++;
+            first[depth] = true;
+        } else {
+            failed = true;
+        }
+    }
+
+    void close(char bracket) {
+        bool empty = first[depth];
+        depth--;
+        if (!empty) {
+            newline();
+        }
+        put(bracket);
+        if (depth == 0) {
+            put('\n');
+        }
+    }
+
+    // separator, indentation and key of the next member
+    void begin_value(const char* key) {
+        if (depth > 0) {
+            if (!first[depth]) {
+                put(',');
+            }
+            newline();
+        }
+        first[depth] = false;
+        if (key) {
+            put_string(key);
+            put_raw(": ");
+        }
+    }
+
+    void newline() {
+        put('\n');
+        for (int i = 0; i < depth; i++) {
+            put_raw("    ");
+        }
+    }
+
+    void put_string(const char* str) {
+        put('"');
+        for (const char* c = str; *c; c++) {
+            unsigned char ch = *c;
+            if (ch == '"' || ch == '\\') {
+                put('\\');
+                put(ch);
+            } else if (ch < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+                put_raw(escaped);
+            } else {
+                put(ch);
+            }
+        }
+        put('"');
+    }
+
+    void put_raw(const char* str) {
+        append(str, strlen(str));
+    }
+
+    void put(char c) {
+        if (len == size) {
+            flush();
+        }
+        buffer[len++] = c;
+    }
+
+    void append(const char* data, size_t n) {
+        if (len + n > size) {
+            flush();
+        }
+        if (n > size) {
+            // larger than the buffer, written as is
+            write_all(data, n);
+            return;
+        }
+        memcpy(buffer + len, data, n);
+        len += n;
+    }
+
+    void write_all(const char* data, size_t n) {
+        size_t done = 0;
+        while (!failed && done < n) {
+            ssize_t ret = ::write(fd, data + done, n - done);
+            if (ret < 0) {
+                if (errno == EINTR) continue;
+                failed = true;
+                break;
+            }
+            done += ret;
+        }
+    }
+
+    int    fd;
+    char*  buffer;
+    size_t size;
+    size_t len;
+    int    depth;
+    bool   first[max_depth];
+    bool   failed;
+};
+
+#endif
@@ -182,35 +182,4 @@ private:
     std::vector<T> buffer_;
 };
 
-class time_histogram_s {
-public:
-    time_histogram_s(int max_buckets, uint32_t bucket_sz_log2)
-        : max_buckets(max_buckets),
-          bucket_sz_log2(bucket_sz_log2) {}
-
-    void log_time(const uint64_t& time) {
-        // round to nearest bucket
-        // for entries falling beyond max_buckets, add entry in last bucket
-        uint64_t bucket_index = (uint64_t) time >> bucket_sz_log2;
-        bucket_index = (bucket_index < max_buckets) ?
-                            bucket_index : (max_buckets - 1);
-        buckets[bucket_index]++;
-    }
-
-    void print_histogram() {
-        ANP_LOG_VERBOSE("Histogram:");
-        for (const auto& entry : buckets) {
-            ANP_LOG_VERBOSE("[%lu-%lu]: %lu counts",
-                            entry.first << bucket_sz_log2,
-                            (((entry.first + 1) << bucket_sz_log2) - 1),
-                            entry.second);
-        }
-    }
-
-public:
-    uint32_t bucket_sz_log2;
-    int max_buckets;
-    std::unordered_map<uint64_t, size_t> buckets;
-};
-
 #endif
@@ -0,0 +1,47 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#ifndef ANP_MR_NOTIFIER_H_
+#define ANP_MR_NOTIFIER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Memory release notifier used to invalidate cached MRs.
+//
+// munmap() and madvise(MADV_DONTNEED/MADV_REMOVE/MADV_FREE) are interposed by
+// the plugin. Released ranges are pushed into a lock-free ring and consumed
+// later by the MR caches, under their own locks, so the hooks never block and
+// never take plugin locks (munmap may be called while those are held).
+//
+// The hooks only see calls that resolve to the plugin's definitions, which
+// requires the plugin to be loaded ahead of libc (e.g. LD_PRELOAD).
+// anpMrNotifierEnable() verifies this and fails otherwise.
+
+// Returns 0 when the hooks are live and recording, -1 otherwise.
+int anpMrNotifierEnable(void);
+bool anpMrNotifierEnabled(void);
+
+// Current position of the release ring; consumers start from here.
+uint64_t anpMrNotifierHead(void);
+
+// Reports every range released since *cursor through cb and advances *cursor.
+// Returns false if the ring wrapped and ranges were lost, in which case the
+// consumer must treat all of its entries as invalid.
+bool anpMrNotifierDrain(uint64_t* cursor, void (*cb)(uintptr_t addr, size_t len, void* arg), void* arg);
+
+#endif //End include guard
@@ -0,0 +1,216 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#ifndef ANP_SHM_H_
+#define ANP_SHM_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "anp_histogram.h"
+
+// Layout of the live telemetry region.
+//
+// The plugin keeps its telemetry counters in a shared memory file,
+// /dev/shm/anp_telemetry.<pid>, and updates them in place. Monitors map it
+// read-only and never interact with the process, except for the control
+// words which the owner of the process may write to switch telemetry level.
+//
+// The region starts with an anp_shm_header_s, followed at header_size by
+// max_qps qp_shard_s entries of qp_size bytes, then by max_cqs cq_shard_s
+// entries of cq_size bytes. Any change to this layout
+// must bump ANP_SHM_VERSION; readers refuse other versions. The offsets
+// asserted below are relied upon by tools/plugin_top.py.
+//
+// Consistency: every qp_shard_s, cq_shard_s and the header each carry a sequence
+// counter, odd while their writer is updating them. A reader copies the
+// entry and retries if the counter was odd or changed meanwhile.
+//
+
+#define ANP_SHM_MAGIC   0x54504e41u // "ANPT"
+#define ANP_SHM_VERSION 5
+#define ANP_SHM_NAME_FMT "/anp_telemetry.%d"
+
+#define ANP_SHM_MAX_DEVICES 64
+#define ANP_SHM_MAX_QPS     65536
+#define ANP_SHM_MAX_CQS     16384
+#define ANP_SHM_NAME_LEN    64
+#define ANP_SHM_PATH_LEN    256
+
+// bound of the fixed per-QP WQE size table
+#define ANP_MAX_WQE_SIZES 16
+
+// per-QP counters, only counter_t members so a shard can be read word by word
+struct qp_stats_s {
+    counter_t num_wqe_sent;
+    counter_t num_wqe_rcvd;
+    counter_t num_wqe_completed;
+    counter_t num_wqe_errors;
+    counter_t num_slot_miss;
+    counter_t num_cts_sent;
+    counter_t num_cts_sent_unsignalled;
+    counter_t num_cts_sent_signalled;
+    counter_t num_recv_wqe;
+    counter_t num_write_wqe;
+    counter_t num_write_imm_wqe;
+    counter_t num_wqe_size_untracked;
+    uint64_t  wqe_completion_time_min;
+    uint64_t  wqe_completion_time_max;
+};
+
+struct wqe_size_count_s {
+    counter_t key; // wqe size + 1, 0 when unused
+    counter_t count;
+};
+
+#define ANP_SHM_QP_IN_USE  0x1
+#define ANP_SHM_QP_DATA_QP 0x2
+
+// telemetry of one QP. Only the proxy thread driving the QP's comm writes the
+// counters, with plain stores and no locked instruction. Updates touching
+// several counters bump seq around the change so readers on other threads or
+// processes can take a consistent copy. Padded so shards of QPs driven by
+// different threads never share a cache line.
+struct alignas(64) qp_shard_s {
+    std::atomic<uint32_t> seq;
+    uint32_t              flags; // ANP_SHM_QP_*
+    int32_t               qp_id;
+    int32_t               device_id;
+    int32_t               channel_id;
+    uint32_t              reserved;
+    qp_stats_s            stats;
+    counter_t             completion_buckets[ANP_HISTOGRAM_BUCKETS]; // see anp_histogram.h
+    wqe_size_count_s      wqe_sizes[ANP_MAX_WQE_SIZES];
+};
+
+// bound of the per-CQ histogram of completions reaped per poll
+#define ANP_MAX_CQ_POLL_BATCH 32
+
+// per-CQ counters, only counter_t members so a shard can be read word by word
+struct cq_stats_s {
+    counter_t num_completion;
+    counter_t num_poll_interval; // non-empty polls timed along with the previous poll
+    uint64_t  poll_interval_max;
+    // polls by completions reaped, [0] counts the empty polls and the last
+    // entry the polls reaping ANP_MAX_CQ_POLL_BATCH or more
+    counter_t poll_batch[ANP_MAX_CQ_POLL_BATCH + 1];
+    // time since the previous poll, an upper bound of the time the reaped
+    // CQEs waited in the CQ, see anp_histogram.h
+    counter_t poll_interval_buckets[ANP_HISTOGRAM_BUCKETS];
+};
+
+#define ANP_SHM_CQ_IN_USE 0x1
+
+// telemetry of the CQ of one connection to one device, written by the proxy
+// thread polling it, the same way as qp_shard_s
+struct alignas(64) cq_shard_s {
+    std::atomic<uint32_t> seq;
+    uint32_t              flags; // ANP_SHM_CQ_*
+    int32_t               device_id;
+    int32_t               channel_id;
+    uint32_t              max_batch; // completions asked for per poll
+    uint32_t              reserved;
+    cq_stats_s            stats;
+};
+
+struct alignas(64) anp_shm_device_s {
+    int32_t   device_id;
+    uint32_t  in_use;
+    char      roce_device[ANP_SHM_NAME_LEN];
+    char      eth_device[ANP_SHM_NAME_LEN];
+    counter_t qp_pool_hits;
+    counter_t qp_pool_misses;
+};
+
+// how much per-message telemetry the data path records
+enum anp_telemetry_level_e {
+    ANP_TELEMETRY_OFF      = 0, // nothing
+    ANP_TELEMETRY_COUNTERS = 1, // WQE, CTS and CQ poll counters
+    ANP_TELEMETRY_SAMPLED  = 2, // counters, and latencies of 1 in sample_rate WQEs and CQ polls
+    ANP_TELEMETRY_FULL     = 3, // counters, and latencies of every WQE and CQ poll
+};
+
+#define ANP_TELEMETRY_MAX_SAMPLE_RATE (1U << 20)
+
+// Written by monitors to switch telemetry while the job runs, read by the
+// data path on every message. On its own cache line so the data path never
+// misses on it due to other header updates.
+struct alignas(64) anp_shm_control_s {
+    std::atomic<uint32_t> level;       // anp_telemetry_level_e
+    std::atomic<uint32_t> sample_rate; // 1 in sample_rate WQEs timed when sampled
+    std::atomic<uint32_t> epoch;       // bumped on every change, see anp_shm_set_level
+};
+
+// Switches telemetry, sample_rate 0 keeps the current rate. The epoch is
+// bumped first and level published last, so a writer that sees the new
+// level also sees the new epoch and drops the timing state it kept from
+// before the change.
+inline void anp_shm_set_level(anp_shm_control_s& control, uint32_t level, uint32_t sample_rate) {
+    control.epoch.fetch_add(1, std::memory_order_relaxed);
+    if (sample_rate) {
+        control.sample_rate.store(sample_rate, std::memory_order_relaxed);
+    }
+    control.level.store(level, std::memory_order_release);
+}
+
+// seq covers everything below it but control, changed by connection setup only
+struct alignas(64) anp_shm_header_s {
+    std::atomic<uint32_t> magic; // set last, once the region is initialized
+    uint32_t              version;
+    uint32_t              header_size; // offset of the QP table
+    uint32_t              qp_size;
+    uint32_t              max_qps;
+    uint32_t              max_devices;
+    std::atomic<uint32_t> seq;
+    uint32_t              num_qps; // QP table entries ever used
+    uint32_t              num_devices;
+    int32_t               pid;
+    uint32_t              histogram_precision; // of the completion_buckets
+    uint32_t              reserved;
+    uint64_t              start_time; // seconds since epoch
+    char                  host_name[ANP_SHM_NAME_LEN];
+    char                  process_name[ANP_SHM_PATH_LEN];
+    anp_shm_device_s      devices[ANP_SHM_MAX_DEVICES];
+    anp_shm_control_s     control;
+    uint32_t              cq_size;
+    uint32_t              max_cqs;
+    uint32_t              num_cqs; // CQ table entries ever used
+};
+
+#define ANP_SHM_HEADER_SIZE ((sizeof(anp_shm_header_s) + 4095) & ~(size_t)4095)
+#define ANP_SHM_CQ_TABLE_OFFSET (ANP_SHM_HEADER_SIZE + ANP_SHM_MAX_QPS * sizeof(qp_shard_s))
+#define ANP_SHM_SIZE (ANP_SHM_CQ_TABLE_OFFSET + ANP_SHM_MAX_CQS * sizeof(cq_shard_s))
+
+static_assert(sizeof(std::atomic<uint32_t>) == 4 && std::atomic<uint32_t>::is_always_lock_free,
+              "sequence counters must be plain lock-free words");
+static_assert(offsetof(qp_shard_s, flags) == 4 && offsetof(qp_shard_s, qp_id) == 8 &&
+              offsetof(qp_shard_s, stats) == 24 && offsetof(qp_shard_s, completion_buckets) == 136 &&
+              offsetof(qp_shard_s, wqe_sizes) == 2312 && sizeof(qp_shard_s) == 2624,
+              "qp_shard_s layout changed, bump ANP_SHM_VERSION and update readers");
+static_assert(offsetof(cq_shard_s, device_id) == 8 && offsetof(cq_shard_s, max_batch) == 16 &&
+              offsetof(cq_shard_s, stats) == 24 && offsetof(cq_shard_s, stats.poll_batch) == 48 &&
+              offsetof(cq_shard_s, stats.poll_interval_buckets) == 312 && sizeof(cq_shard_s) == 2496,
+              "cq_shard_s layout changed, bump ANP_SHM_VERSION and update readers");
+static_assert(offsetof(anp_shm_header_s, seq) == 24 && offsetof(anp_shm_header_s, start_time) == 48 &&
+              offsetof(anp_shm_header_s, host_name) == 56 && offsetof(anp_shm_header_s, process_name) == 120 &&
+              offsetof(anp_shm_header_s, devices) == 384 && sizeof(anp_shm_device_s) == 192 &&
+              offsetof(anp_shm_header_s, control) == 12672 && offsetof(anp_shm_control_s, epoch) == 8 &&
+              offsetof(anp_shm_header_s, cq_size) == 12736,
+              "anp_shm_header_s layout changed, bump ANP_SHM_VERSION and update readers");
+
+#endif
@@ -5,7 +5,11 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <boost/version.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "anp_metrics.h"
+#include "anp_json_writer.h"
+#include "anp_shm.h"
 
 #ifdef ANP_TELEMETRY_ENABLED
     #define TELEMETRY_STATUS "enabled"
@@ -22,38 +26,68 @@ struct qp_status_s {
     bool data_qp;
 };
 
-typedef uint64_t counter_t;
-
-struct qp_stats_s {
-    counter_t num_wqe_sent;
-    counter_t num_wqe_rcvd;
-    counter_t num_wqe_completed;
-    counter_t num_wqe_errors;
-    counter_t num_slot_miss;
-    counter_t num_cts_sent;
-    counter_t num_cts_sent_unsignalled;
-    counter_t num_cts_sent_signalled;
-    counter_t num_recv_wqe;
-    counter_t num_write_wqe;
-    counter_t num_write_imm_wqe;
-    uint64_t  wqe_completion_time_min;
-    uint64_t  wqe_completion_time_max;
+// wr_ids carry the request slot in their low byte, so a QP never has more
+// than this many WQEs in flight with distinct ids
+#define ANP_MAX_INFLIGHT_WQES 256
+static_assert(IS_POWER_OF_2(ANP_MAX_INFLIGHT_WQES), "in-flight WQE tracker size must be a power of 2");
+
+#define ANP_JSON_BUFFER_SIZE (1 << 20)
+
+// completion latencies merged over several QPs
+typedef std::array<counter_t, ANP_HISTOGRAM_BUCKETS> latency_buckets_t;
+
+// per-QP state private to the writer, so kept out of the shared region
+struct qp_private_s {
+    // post time per request slot, 0 when nothing timed is in flight
+    uint64_t wqe_start_ns[ANP_MAX_INFLIGHT_WQES];
+    uint32_t sample_countdown; // WQEs to skip before the next timed one
+    uint32_t epoch;            // control epoch last seen by the writer
 };
 
-struct qp_info_s {
-    qp_info_s(int max_buckets, uint32_t& bucket_sz_log2)
-        : stats{},
-          completion_metrics(max_buckets, bucket_sz_log2) {}
+// per-CQ state private to the poller
+struct cq_private_s {
+    uint64_t last_poll_ns;     // time of the previous poll if it was timed, else 0
+    uint32_t last_batch;       // completions reaped by the previous poll
+    uint32_t max_batch;        // completions asked for per poll
+    uint32_t sample_countdown; // polls to skip before the next timed pair
+    uint32_t epoch;            // control epoch last seen by the poller
+};
+
+// allocated in chunks that never move, so the data path can index them while
+// connection setup adds queue pairs and completion queues
+#define ANP_QP_PRIVATE_CHUNK 64
+#define ANP_CQ_PRIVATE_CHUNK 64
 
-    qp_stats_s  stats;
+// where a telemetry slot is accounted, only changed under the state lock
+struct qp_info_s {
+    qp_info_s(int qp_id, int device_id, int channel_id)
+        : qp_id(qp_id),
+          device_id(device_id),
+          channel_id(channel_id),
+          in_use(true),
+          status{} {}
+
+    int         qp_id;
+    int         device_id;
+    int         channel_id;
+    bool        in_use;
     qp_status_s status;
-    time_histogram_s completion_metrics;
-    std::unordered_map<uint64_t, uint64_t> wqe_id_tracker;
 };
 
-using qp_info_ptr_t = std::shared_ptr<qp_info_s>;
-// queue-id → queue_pair_info
-using queue_pair_map_t = std::unordered_map<int, qp_info_ptr_t>;
+// where a CQ telemetry slot is accounted, only changed under the state lock
+struct cq_info_s {
+    cq_info_s(int device_id, int channel_id)
+        : device_id(device_id),
+          channel_id(channel_id),
+          in_use(true) {}
+
+    int  device_id;
+    int  channel_id;
+    bool in_use;
+};
+
+// queue-id → telemetry slot
+using queue_pair_map_t = std::unordered_map<int, int>;
 
 struct channel_status_s {
 };
@@ -72,12 +106,47 @@ struct device_status_s {
     std::string   roce_device;
 };
 
+// wqe sizes are summed from the QP shards and cq polls from the CQ shards
+// when exporting
 struct device_stats_s {
     device_stats_s()
-        : cq_poll_count(0) {}
+        : qp_pool_hits(0),
+          qp_pool_misses(0),
+          closed_cqs{} {}
+
+    counter_t                  qp_pool_hits;
+    counter_t                  qp_pool_misses;
+    cq_stats_s                 closed_cqs; // of the CQs removed so far
+};
+
+// NIC async event (port up/down, GID change, QP fatal...)
+struct device_event_s {
+    int         device_id;
+    int         port;
+    std::string event;
+    uint64_t    timestamp_ns; // wall clock, ns since epoch
+};
 
-    std::map<uint32_t, size_t> wqe_size_metrics;
-    counter_t                  cq_poll_count;
+#define ANP_MAX_DEVICE_EVENTS 1024
+
+// shared with snapshots, which only read it under the lock
+struct device_event_log_s {
+    std::mutex                  lock;
+    std::vector<device_event_s> events;
+    counter_t                   dropped = 0;
+};
+
+// result of the init self-test of a port
+struct device_health_s {
+    int         device_id;
+    std::string device;
+    int         port;
+    int         nominal_speed;  // Mbps
+    int         loopback_speed; // Mbps
+    int         reported_speed; // Mbps, after down-weighting
+    counter_t   errors;         // error counter increase during the test
+    std::string status;         // healthy, degraded or excluded
+    std::string reason;
 };
 
 // channel-id → channel_info
@@ -91,327 +160,733 @@ struct device_s {
 // device-id → device_info
 using device_map_t = std::unordered_map<int, device_s>;
 
-static inline size_t power_of_2 (size_t number) {
-    if (number == 0) return 1;
-
-    number--;
-    number |= number >> 1;
-    number |= number >> 2;
-    number |= number >> 4;
-    number |= number >> 8;
-    number |= number >> 16;
-#if SIZE_MAX > 0xFFFFFFFF
-    // for 64-bit system
-    number |= number >> 32;
-#endif
+// What an export needs from the bookkeeping, copied under the state lock.
+// Channels, QPs and CQs of an entry are the [begin, end) range of the next
+// level's vector.
+struct export_qp_s {
+    int  qp_id;
+    int  slot;
+    bool data_qp;
+};
+
+struct export_channel_s {
+    int    channel_id;
+    size_t qps_begin;
+    size_t qps_end;
+};
 
-    return (number + 1);
-}
+struct export_cq_s {
+    int      slot;
+    int      channel_id;
+    uint32_t max_batch;
+};
+
+struct export_device_s {
+    int             device_id;
+    device_status_s status;
+    device_stats_s  stats;
+    size_t          channels_begin;
+    size_t          channels_end;
+    size_t          cqs_begin;
+    size_t          cqs_end;
+};
 
 class anp_state {
 public:
     void set_device_name(int device_id, const char *dev_name, const char *roce_dev_name) {
+        std::lock_guard<std::mutex> guard(state_lock);
         auto device_it = devices.find(device_id);
         if (device_it == devices.end()) {
             devices[device_id].status.eth_device = dev_name;
             devices[device_id].status.roce_device = roce_dev_name;
             this->device_id = device_id;
+            anp_shm_device_s* shm_dev = shm_device(device_id);
+            if (shm_dev) {
+                header_write_begin();
+                snprintf(shm_dev->eth_device, sizeof(shm_dev->eth_device), "%s", dev_name);
+                snprintf(shm_dev->roce_device, sizeof(shm_dev->roce_device), "%s", roce_dev_name);
+                header_write_end();
+            }
         }
     }
 
-    void add_queue_pair(int device_id, int channel_id, int qp_id, bool data_qp) {
-        devices[device_id].channels[channel_id].queue_pairs[qp_id] = std::make_shared<qp_info_s>(max_buckets, bucket_sz_log2);
-        queue_state[qp_id] = std::make_shared<qp_info_s>(max_buckets, bucket_sz_log2);
-        queue_state[qp_id]->status.data_qp = data_qp;
+    static uint64_t qp_key(int device_id, int qp_id) {
+        return ((uint64_t)(uint32_t)device_id << 32) | (uint32_t)qp_id;
     }
 
-    void remove_queue_pair(int device_id, int channel_id, int qp_id) {
-        auto device_it = devices.find(device_id);
+    // returns the dense slot the data path passes to the update functions
+    // returns -1 when the QP can't be tracked
+    int add_queue_pair(int device_id, int channel_id, int qp_id, bool data_qp) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        int slot;
+        auto slot_it = qp_slots.find(qp_key(device_id, qp_id));
+        if (slot_it != qp_slots.end()) {
+            // recycled QP, account it as a new queue pair of its new channel
+            slot = slot_it->second;
+            auto device_it = devices.find(qp_info[slot].device_id);
+            if (device_it != devices.end()) {
+                auto channel_it = device_it->second.channels.find(qp_info[slot].channel_id);
+                if (channel_it != device_it->second.channels.end()) {
+                    channel_it->second.queue_pairs.erase(qp_id);
+                    if (channel_it->second.queue_pairs.empty()) {
+                        device_it->second.channels.erase(channel_it);
+                    }
+                }
+            }
+            reset_shard(slot);
+            qp_info[slot] = qp_info_s(qp_id, device_id, channel_id);
+        } else if (!free_qp_slots.empty()) {
+            slot = free_qp_slots.back();
+            free_qp_slots.pop_back();
+            reset_shard(slot);
+            qp_info[slot] = qp_info_s(qp_id, device_id, channel_id);
+            qp_slots[qp_key(device_id, qp_id)] = slot;
+        } else {
+            slot = num_slots.load(std::memory_order_relaxed);
+            if (!shm || slot >= ANP_SHM_MAX_QPS) {
+                ANP_LOG_ERROR("too many queue pairs, qp_id %d not tracked", qp_id);
+                return -1;
+            }
+            auto& chunk = qp_private_chunks[slot / ANP_QP_PRIVATE_CHUNK];
+            if (!chunk) {
+                if (!back_shm(reinterpret_cast<char*>(&shard(slot)), ANP_QP_PRIVATE_CHUNK * sizeof(qp_shard_s))) {
+                    ANP_LOG_ERROR("no shared memory left, qp_id %d not tracked", qp_id);
+                    return -1;
+                }
+                chunk.reset(new qp_private_s[ANP_QP_PRIVATE_CHUNK]());
+            }
+            qp_info.emplace_back(qp_id, device_id, channel_id);
+            qp_slots[qp_key(device_id, qp_id)] = slot;
+            header_write_begin();
+            shm->num_qps = slot + 1;
+            header_write_end();
+            num_slots.store(slot + 1, std::memory_order_release);
+        }
+        qp_info[slot].status.data_qp = data_qp;
+        qp_shard_s& qp = shard(slot);
+        write_begin(qp);
+        __atomic_store_n(&qp.qp_id, qp_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&qp.device_id, device_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&qp.channel_id, channel_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&qp.flags, ANP_SHM_QP_IN_USE | (data_qp ? ANP_SHM_QP_DATA_QP : 0u), __ATOMIC_RELAXED);
+        write_end(qp);
+        devices[device_id].channels[channel_id].queue_pairs[qp_id] = slot;
+        return slot;
+    }
+
+    // called once the QP is no longer posted to or polled for, when its
+    // connection closes. The slot is reused by the next QP.
+    void remove_queue_pair(int slot) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        if (!valid_slot(slot) || !qp_info[slot].in_use) {
+            return;
+        }
+        const qp_info_s& info = qp_info[slot];
+        auto device_it = devices.find(info.device_id);
         if (device_it != devices.end()) {
-            auto& device = device_it->second;
-            auto channel_it = device.channels.find(channel_id);
-            if (channel_it != device.channels.end()) {
-                channel_it->second.queue_pairs.erase(qp_id);
+            auto channel_it = device_it->second.channels.find(info.channel_id);
+            if (channel_it != device_it->second.channels.end()) {
+                channel_it->second.queue_pairs.erase(info.qp_id);
                 if (channel_it->second.queue_pairs.empty()) {
-                    device.channels.erase(channel_it);
+                    device_it->second.channels.erase(channel_it);
                 }
             }
-            if (device.channels.empty()) {
-                devices.erase(device_it);
+        }
+        qp_slots.erase(qp_key(info.device_id, info.qp_id));
+        qp_shard_s& qp = shard(slot);
+        write_begin(qp);
+        __atomic_store_n(&qp.flags, qp.flags & ~ANP_SHM_QP_IN_USE, __ATOMIC_RELAXED);
+        write_end(qp);
+        qp_info[slot].in_use = false;
+        free_qp_slots.push_back(slot);
+    }
+
+    // returns the slot the poller passes to update_cq_poll_metrics
+    // returns -1 when the CQ can't be tracked
+    int add_completion_queue(int device_id, int channel_id, int max_batch) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        int slot;
+        if (!free_cq_slots.empty()) {
+            slot = free_cq_slots.back();
+            free_cq_slots.pop_back();
+            reset_cq_shard(slot);
+            cq_info[slot] = cq_info_s(device_id, channel_id);
+        } else {
+            slot = num_cq_slots.load(std::memory_order_relaxed);
+            if (!shm || slot >= ANP_SHM_MAX_CQS) {
+                ANP_LOG_ERROR("too many completion queues, cq of device %d channel %d not tracked",
+                              device_id, channel_id);
+                return -1;
             }
+            auto& chunk = cq_private_chunks[slot / ANP_CQ_PRIVATE_CHUNK];
+            if (!chunk) {
+                if (!back_shm(reinterpret_cast<char*>(&cq_shard(slot)), ANP_CQ_PRIVATE_CHUNK * sizeof(cq_shard_s))) {
+                    ANP_LOG_ERROR("no shared memory left, cq of device %d channel %d not tracked",
+                                  device_id, channel_id);
+                    return -1;
+                }
+                chunk.reset(new cq_private_s[ANP_CQ_PRIVATE_CHUNK]());
+            }
+            cq_info.emplace_back(device_id, channel_id);
+            header_write_begin();
+            shm->num_cqs = slot + 1;
+            header_write_end();
+            num_cq_slots.store(slot + 1, std::memory_order_release);
         }
+        cq_private(slot).max_batch = max_batch;
+        cq_shard_s& cq = cq_shard(slot);
+        write_begin(cq);
+        __atomic_store_n(&cq.device_id, device_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&cq.channel_id, channel_id, __ATOMIC_RELAXED);
+        __atomic_store_n(&cq.max_batch, (uint32_t)max_batch, __ATOMIC_RELAXED);
+        __atomic_store_n(&cq.flags, ANP_SHM_CQ_IN_USE, __ATOMIC_RELAXED);
+        write_end(cq);
+        return slot;
     }
 
-    void to_json(boost::property_tree::ptree& root) {
-        boost::property_tree::ptree empty_object;
-        empty_object.put("", "");
-        boost::property_tree::ptree devices_node;
+    // called once the CQ is no longer polled. Its counters move to the device
+    // totals and the slot is reused by the next CQ.
+    void remove_completion_queue(int slot) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        if (!valid_cq_slot(slot) || !cq_info[slot].in_use) {
+            return;
+        }
+        cq_stats_s stats;
+        if (read_cq_shard(slot, stats)) {
+            merge_cq_stats(devices[cq_info[slot].device_id].stats.closed_cqs, stats);
+        } else {
+            ANP_LOG_ERROR("cq slot %d unreadable, its counters are dropped", slot);
+        }
+        cq_shard_s& cq = cq_shard(slot);
+        write_begin(cq);
+        __atomic_store_n(&cq.flags, cq.flags & ~ANP_SHM_CQ_IN_USE, __ATOMIC_RELAXED);
+        write_end(cq);
+        cq_info[slot].in_use = false;
+        free_cq_slots.push_back(slot);
+    }
 
-        for (auto& [device_id, device] : devices) {
-            boost::property_tree::ptree device_entry;
-            boost::property_tree::ptree device_status_node;
-            boost::property_tree::ptree device_stats_node;
+    // Streams the device status document, see anp_json_writer. Only the
+    // bookkeeping is copied under the state lock. The shards are read and the
+    // document written without it, so connection setup never waits on the
+    // file I/O of an export.
+    void to_json(anp_json_writer& out) {
+        copy_export_bookkeeping();
+        if (!json_scratch) {
+            json_scratch.reset(new qp_shard_s());
+        }
+        qp_shard_s* qp = json_scratch.get();
+        std::string start_time_str = time_to_str(start_time);
+        std::string end_time_str = time_to_str(end_time);
+
+        out.begin_object();
+        out.begin_array("devices");
+        for (const export_device_s& device : export_devices) {
+            int device_id = device.device_id;
             counter_t num_wqe_sent_per_device = 0;
             counter_t num_wqe_rcvd_per_device = 0;
             counter_t num_data_qp_per_device = 0;
             counter_t num_cts_qp_per_device = 0;
             counter_t num_cts_sent_per_device = 0;
+            counter_t wqe_size_untracked = 0;
+            std::map<counter_t, counter_t> wqe_size_metrics;
+            latency_buckets_t device_latency = {};
+            uint64_t device_latency_max = 0;
 
-            // populate device status
-            device_status_node.put("host_name", host_name);
-            device_status_node.put("process_name", process_name);
-            device_status_node.put("process_id", process_id);
-            device_status_node.put("start_time", time_to_str(start_time));
-            device_status_node.put("end_time", time_to_str(end_time));
-            device_status_node.put("device_id", device_id);
-            device_status_node.put("eth_device", device.status.eth_device);
-            device_status_node.put("roce_device", device.status.roce_device);
-            device_status_node.put("num_channels", device.channels.size());
-
-            device_entry.add_child("status", device_status_node);
+            out.begin_object();
 
-            boost::property_tree::ptree wqe_size_node;
-            for (const auto& [wqe_size, count] : device.stats.wqe_size_metrics) {
-                boost::property_tree::ptree wqe_size_entry;
-                wqe_size_entry.put("wqe_size", wqe_size);
-                wqe_size_entry.put("num_wqe", count);
-                wqe_size_node.push_back(std::make_pair("", wqe_size_entry));
-            }
-            device_stats_node.add_child("wqe_size_stats", wqe_size_node);
-
-            boost::property_tree::ptree channels_node;
+            // populate device status
+            out.begin_object("status");
+            out.field("host_name", host_name);
+            out.field("process_name", process_name);
+            out.field("process_id", process_id);
+            out.field("start_time", start_time_str);
+            out.field("end_time", end_time_str);
+            out.field("device_id", device_id);
+            out.field("eth_device", device.status.eth_device);
+            out.field("roce_device", device.status.roce_device);
+            out.field("num_channels", device.channels_end - device.channels_begin);
+            out.end_object();
 
             // populate channels
-            for (const auto& [channel_id, channel] : device.channels) {
-                boost::property_tree::ptree channel_entry;
-                boost::property_tree::ptree channel_stats_node;
+            out.begin_array("channels");
+            for (size_t c = device.channels_begin; c < device.channels_end; c++) {
+                const export_channel_s& channel = export_channels[c];
+                int channel_id = channel.channel_id;
                 counter_t num_wqe_sent_per_channel = 0;
                 counter_t num_wqe_rcvd_per_channel = 0;
                 counter_t num_data_qp_per_channel = 0;
                 counter_t num_cts_qp_per_channel = 0;
                 counter_t num_cts_sent_per_channel = 0;
+                latency_buckets_t channel_latency = {};
+                uint64_t channel_latency_max = 0;
 
-                channel_entry.put("id", std::to_string(channel_id));
-                channel_entry.put("num_queue_pairs", channel.queue_pairs.size());
+                out.begin_object();
+                out.field("id", channel_id);
+                out.field("num_queue_pairs", channel.qps_end - channel.qps_begin);
 
                 // populate queue pairs
-                boost::property_tree::ptree queue_pairs_node;
-                for (const auto& [qp_id, qp] : channel.queue_pairs) {
-                    boost::property_tree::ptree queue_pair_entry;
-                    boost::property_tree::ptree qp_status_node;
-                    boost::property_tree::ptree qp_stats_node;
-                    queue_pair_entry.put("id", std::to_string(qp_id));
-                    if (queue_state.find(qp_id) != queue_state.end()) {
-                        qp_status_node.put("data_qp", queue_state[qp_id]->status.data_qp);
-                        if (queue_state[qp_id]->status.data_qp) {
-                            num_data_qp_per_channel++;
-                        } else {
-                            num_cts_qp_per_channel++;
-                            num_cts_sent_per_channel += queue_state[qp_id]->stats.num_wqe_sent;
+                out.begin_array("queue_pairs");
+                for (size_t q = channel.qps_begin; q < channel.qps_end; q++) {
+                    const export_qp_s& entry = export_qps[q];
+                    out.begin_object();
+                    out.field("id", entry.qp_id);
+                    shard_owner_s owner = {};
+                    bool readable = valid_slot(entry.slot) && read_shard(entry.slot, *qp, &owner);
+                    // closed or recycled since the bookkeeping was copied
+                    bool moved = readable && (!(owner.flags & ANP_SHM_QP_IN_USE) || owner.qp_id != entry.qp_id ||
+                                              owner.device_id != device_id || owner.channel_id != channel_id);
+                    if (!valid_slot(entry.slot) || moved) {
+                        out.begin_object("status");
+                        out.end_object();
+                        out.begin_object("stats");
+                        out.end_object();
+                        out.end_object();
+                        continue;
+                    }
+                    if (!readable) {
+                        out.begin_object("status");
+                        out.field("data_qp", entry.data_qp);
+                        out.field("unreadable", true);
+                        out.end_object();
+                        out.begin_object("stats");
+                        out.end_object();
+                        out.end_object();
+                        continue;
+                    }
+                    const qp_stats_s& stats = qp->stats;
+                    out.begin_object("status");
+                    out.field("data_qp", entry.data_qp);
+                    out.end_object();
+                    if (entry.data_qp) {
+                        num_data_qp_per_channel++;
+                    } else {
+                        num_cts_qp_per_channel++;
+                        num_cts_sent_per_channel += stats.num_wqe_sent;
+                    }
+
+                    out.begin_object("stats");
+                    out.field("num_wqe_sent", stats.num_wqe_sent);
+                    out.field("num_wqe_rcvd", stats.num_wqe_rcvd);
+                    out.field("num_wqe_completed", stats.num_wqe_completed);
+                    out.field("num_slot_miss", stats.num_slot_miss);
+                    out.field("num_cts_sent", stats.num_cts_sent);
+                    out.field("num_cts_sent_unsignalled", stats.num_cts_sent_unsignalled);
+                    out.field("num_cts_sent_signalled", stats.num_cts_sent_signalled);
+                    out.field("num_recv_wqe", stats.num_recv_wqe);
+                    out.field("num_write_wqe", stats.num_write_wqe);
+                    out.field("num_wirte_imm_wqe", stats.num_write_imm_wqe);
+                    out.field("wqe_completion_ns_min", stats.wqe_completion_time_min);
+                    out.field("wqe_completion_ns_max", stats.wqe_completion_time_max);
+                    write_latency_percentiles(out, qp->completion_buckets, stats.wqe_completion_time_max);
+                    anp_latency_histogram::merge(channel_latency.data(), qp->completion_buckets);
+                    channel_latency_max = std::max(channel_latency_max, stats.wqe_completion_time_max);
+                    num_wqe_sent_per_channel += stats.num_wqe_sent;
+                    num_wqe_rcvd_per_channel += stats.num_wqe_rcvd;
+                    wqe_size_untracked += stats.num_wqe_size_untracked;
+                    for (const auto& wqe_size : qp->wqe_sizes) {
+                        if (wqe_size.key) {
+                            wqe_size_metrics[wqe_size.key - 1] += wqe_size.count;
                         }
+                    }
 
-                        qp_stats_node.put("num_wqe_sent", queue_state[qp_id]->stats.num_wqe_sent);
-                        qp_stats_node.put("num_wqe_rcvd", queue_state[qp_id]->stats.num_wqe_rcvd);
-                        qp_stats_node.put("num_wqe_completed", queue_state[qp_id]->stats.num_wqe_completed);
-                        qp_stats_node.put("num_slot_miss", queue_state[qp_id]->stats.num_slot_miss);
-                        qp_stats_node.put("num_cts_sent", queue_state[qp_id]->stats.num_cts_sent);
-                        qp_stats_node.put("num_cts_sent_unsignalled",
-                                          queue_state[qp_id]->stats.num_cts_sent_unsignalled);
-                        qp_stats_node.put("num_cts_sent_signalled", queue_state[qp_id]->stats.num_cts_sent_signalled);
-                        qp_stats_node.put("num_recv_wqe", queue_state[qp_id]->stats.num_recv_wqe);
-                        qp_stats_node.put("num_write_wqe", queue_state[qp_id]->stats.num_write_wqe);
-                        qp_stats_node.put("num_wirte_imm_wqe", queue_state[qp_id]->stats.num_write_imm_wqe);
-                        qp_stats_node.put("wqe_completion_ns_min", queue_state[qp_id]->stats.wqe_completion_time_min);
-                        qp_stats_node.put("wqe_completion_ns_max", queue_state[qp_id]->stats.wqe_completion_time_max);
-                        num_wqe_sent_per_channel += queue_state[qp_id]->stats.num_wqe_sent;
-                        num_wqe_rcvd_per_channel += queue_state[qp_id]->stats.num_wqe_rcvd;
-
-                        boost::property_tree::ptree bucketsNode;
-                        uint32_t bucket_sz_log2 = queue_state[qp_id]->completion_metrics.bucket_sz_log2;
-                        std::map<uint64_t, size_t> ordered_buckets(queue_state[qp_id]->completion_metrics.buckets.begin(),
-                                                                   queue_state[qp_id]->completion_metrics.buckets.end());
-                        for (const auto& bucket : ordered_buckets) {
-                            boost::property_tree::ptree bucket_node;
-                            if (bucket.first < (max_buckets - 1)) {
-                                bucket_node.put("latency_in_ns", ((bucket.first + 1) << bucket_sz_log2) - 1);
-                            } else {
-                                bucket_node.put("latency_in_ns", queue_state[qp_id]->stats.wqe_completion_time_max);
-                            }
-                            bucket_node.put("num_wqe", bucket.second);
-                            bucketsNode.push_back(std::make_pair("", bucket_node));
+                    out.begin_array("wqe_completion_metrics");
+                    for (uint32_t bucket = 0; bucket < histogram.num_buckets(); bucket++) {
+                        if (!qp->completion_buckets[bucket]) {
+                            continue;
                         }
-                        qp_stats_node.put_child("wqe_completion_metrics", bucketsNode);
-                        bucketsNode.clear();
+                        out.begin_object();
+                        out.field("latency_in_ns", std::min(histogram.upper(bucket), stats.wqe_completion_time_max));
+                        out.field("num_wqe", qp->completion_buckets[bucket]);
+                        out.end_object();
                     }
-                    queue_pair_entry.put_child("status", qp_status_node);
-                    queue_pair_entry.add_child("stats", qp_stats_node);
-                    queue_pairs_node.push_back(std::make_pair("", queue_pair_entry));
+                    out.end_array();
+                    out.end_object();
+                    out.end_object();
                 }
-                channel_entry.add_child("queue_pairs", queue_pairs_node);
-                channel_entry.add_child("status", empty_object);
+                out.end_array();
+                out.begin_object("status");
+                out.end_object();
+
                 num_wqe_sent_per_device += num_wqe_sent_per_channel;
                 num_wqe_rcvd_per_device += num_wqe_rcvd_per_channel;
                 num_data_qp_per_device += num_data_qp_per_channel;
                 num_cts_qp_per_device += num_cts_qp_per_channel;
                 num_cts_sent_per_device += num_cts_sent_per_channel;
+                anp_latency_histogram::merge(device_latency.data(), channel_latency.data());
+                device_latency_max = std::max(device_latency_max, channel_latency_max);
                 // wqe_sent per channel is inclusive of cts sent per channel, exclude it.
                 num_wqe_sent_per_channel -= num_cts_sent_per_channel;
-                channel_stats_node.put("num_wqe_sent", num_wqe_sent_per_channel);
-                channel_stats_node.put("num_wqe_rcvd", num_wqe_rcvd_per_channel);
-                channel_stats_node.put("num_cts_sent", num_cts_sent_per_channel);
-                channel_stats_node.put("num_data_qp", num_data_qp_per_channel);
-                channel_stats_node.put("num_cts_qp", num_cts_qp_per_channel);
-                channel_entry.add_child("stats", channel_stats_node);
-                channels_node.push_back(std::make_pair("", channel_entry));
+                out.begin_object("stats");
+                out.field("num_wqe_sent", num_wqe_sent_per_channel);
+                out.field("num_wqe_rcvd", num_wqe_rcvd_per_channel);
+                out.field("num_cts_sent", num_cts_sent_per_channel);
+                out.field("num_data_qp", num_data_qp_per_channel);
+                out.field("num_cts_qp", num_cts_qp_per_channel);
+                write_latency_percentiles(out, channel_latency.data(), channel_latency_max);
+                out.end_object();
+                out.end_object();
+            }
+            out.end_array();
+
+            // populate completion queues
+            cq_stats_s device_cq_stats = device.stats.closed_cqs;
+            out.begin_array("completion_queues");
+            for (size_t c = device.cqs_begin; c < device.cqs_end; c++) {
+                const export_cq_s& entry = export_cqs[c];
+                cq_stats_s stats;
+                shard_owner_s owner = {};
+                bool readable = read_cq_shard(entry.slot, stats, &owner);
+                // released since the bookkeeping was copied, counted in closed_cqs next time
+                if (readable && (!(owner.flags & ANP_SHM_CQ_IN_USE) || owner.device_id != device_id ||
+                                 owner.channel_id != entry.channel_id)) {
+                    continue;
+                }
+                out.begin_object();
+                out.field("id", entry.slot);
+                out.field("channel_id", entry.channel_id);
+                out.field("max_batch", entry.max_batch);
+                if (!readable) {
+                    out.field("unreadable", true);
+                }
+                out.begin_object("stats");
+                if (readable) {
+                    merge_cq_stats(device_cq_stats, stats);
+                    write_cq_stats(out, stats);
+                }
+                out.end_object();
+                out.end_object();
             }
+            out.end_array();
+
             // wqe_sent per device is inclusive of cts sent per device, exclude it.
             num_wqe_sent_per_device -= num_cts_sent_per_device;
-            device_entry.add_child("channels", channels_node);
-            device_stats_node.put("num_wqe_sent", num_wqe_sent_per_device);
-            device_stats_node.put("num_wqe_rcvd", num_wqe_rcvd_per_device);
-            device_stats_node.put("num_cts_sent", num_cts_sent_per_device);
-            device_stats_node.put("num_data_qp", num_data_qp_per_device);
-            device_stats_node.put("num_cts_qp", num_cts_qp_per_device);
-            device_stats_node.put("cq_poll_count", device.stats.cq_poll_count);
-            device_entry.add_child("stats", device_stats_node);
-            devices_node.push_back(std::make_pair("", device_entry));
+            out.begin_object("stats");
+            out.begin_array("wqe_size_stats");
+            for (const auto& [wqe_size, count] : wqe_size_metrics) {
+                out.begin_object();
+                out.field("wqe_size", wqe_size);
+                out.field("num_wqe", count);
+                out.end_object();
+            }
+            out.end_array();
+            out.field("wqe_size_untracked", wqe_size_untracked);
+            out.field("num_wqe_sent", num_wqe_sent_per_device);
+            out.field("num_wqe_rcvd", num_wqe_rcvd_per_device);
+            out.field("num_cts_sent", num_cts_sent_per_device);
+            out.field("num_data_qp", num_data_qp_per_device);
+            out.field("num_cts_qp", num_cts_qp_per_device);
+            out.field("cq_poll_count", num_cq_polls(device_cq_stats));
+            out.begin_object("cq_stats");
+            write_cq_stats(out, device_cq_stats);
+            out.end_object();
+            write_latency_percentiles(out, device_latency.data(), device_latency_max);
+            out.field("qp_pool_hits", device.stats.qp_pool_hits);
+            out.field("qp_pool_misses", device.stats.qp_pool_misses);
+            counter_t qp_pool_requests = device.stats.qp_pool_hits + device.stats.qp_pool_misses;
+            out.field("qp_pool_hit_rate",
+                      qp_pool_requests ? (double)device.stats.qp_pool_hits / qp_pool_requests : 0.0);
+            out.end_object();
+            out.end_object();
+        }
+        out.end_array();
+
+        counter_t events_dropped;
+        {
+            std::lock_guard<std::mutex> events_guard(device_events->lock);
+            export_events = device_events->events;
+            events_dropped = device_events->dropped;
         }
-        root.add_child("devices", devices_node);
+        out.begin_array("device_events");
+        for (const auto& device_event : export_events) {
+            out.begin_object();
+            out.field("device_id", device_event.device_id);
+            out.field("port", device_event.port);
+            out.field("event", device_event.event);
+            out.field("timestamp_ns", device_event.timestamp_ns);
+            out.end_object();
+        }
+        out.end_array();
+        out.field("device_events_dropped", events_dropped);
+
+        out.begin_array("device_health");
+        for (const auto& health : export_health) {
+            out.begin_object();
+            out.field("device_id", health.device_id);
+            out.field("device", health.device);
+            out.field("port", health.port);
+            out.field("nominal_speed_mbps", health.nominal_speed);
+            out.field("loopback_speed_mbps", health.loopback_speed);
+            out.field("reported_speed_mbps", health.reported_speed);
+            out.field("errors", health.errors);
+            out.field("status", health.status);
+            out.field("reason", health.reason);
+            out.end_object();
+        }
+        out.end_array();
+        out.end_object();
     }
 
-    void update_wqe_send_metrics(const int& qp_id,
-                                 const uint64_t& wqe_id,
-                                 const uint64_t& start_time) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            ANP_LOG_ERROR("invalid qp_id %d", qp_id);
-            return;
+    // fills the export_* vectors, which keep their capacity across exports
+    void copy_export_bookkeeping() {
+        std::lock_guard<std::mutex> guard(state_lock);
+        export_devices.clear();
+        export_channels.clear();
+        export_qps.clear();
+        export_cqs.clear();
+        for (const auto& [device_id, device] : devices) {
+            export_device_s entry;
+            entry.device_id = device_id;
+            entry.status = device.status;
+            entry.stats = device.stats;
+            entry.channels_begin = export_channels.size();
+            for (const auto& [channel_id, channel] : device.channels) {
+                export_channels.push_back({channel_id, export_qps.size(), 0});
+                for (const auto& [qp_id, slot] : channel.queue_pairs) {
+                    export_qps.push_back({qp_id, slot, valid_slot(slot) && qp_info[slot].status.data_qp});
+                }
+                export_channels.back().qps_end = export_qps.size();
+            }
+            entry.channels_end = export_channels.size();
+            entry.cqs_begin = export_cqs.size();
+            for (int slot = 0; slot < num_cq_slots.load(std::memory_order_relaxed); slot++) {
+                if (cq_info[slot].in_use && cq_info[slot].device_id == device_id) {
+                    export_cqs.push_back({slot, cq_info[slot].channel_id, cq_private(slot).max_batch});
+                }
+            }
+            entry.cqs_end = export_cqs.size();
+            export_devices.push_back(std::move(entry));
         }
-        qp_info->stats.num_wqe_sent++;
-        qp_info->wqe_id_tracker[wqe_id] = start_time;
+        export_health = device_health;
     }
 
+    bool valid_slot(int slot) const {
+        return slot >= 0 && slot < num_slots.load(std::memory_order_acquire);
+    }
+
+    bool valid_cq_slot(int slot) const {
+        return slot >= 0 && slot < num_cq_slots.load(std::memory_order_acquire);
+    }
+
+    // the update functions below run on the proxy thread owning the slot
+
+    uint32_t level() const {
+        return control->level.load(std::memory_order_relaxed);
+    }
+
+    // whether the next WQE posted on slot gets a completion latency
+    bool sample_wqe(int slot) {
+        if (!valid_slot(slot)) {
+            return false;
+        }
+        qp_private_s& priv = qp_private(slot);
+        uint32_t current = writer_level(priv);
+        if (current == ANP_TELEMETRY_FULL) {
+            return true;
+        }
+        return current == ANP_TELEMETRY_SAMPLED && sample_next(priv.sample_countdown);
+    }
 
-    void update_recv_wqe_metrics(const int& qp_id,
+    void update_wqe_send_metrics(int slot,
                                  const uint64_t& wqe_id,
                                  const uint64_t& start_time) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_wqe_sent++;
-        qp_info->wqe_id_tracker[wqe_id] = start_time;
+        shard_add(shard(slot).stats.num_wqe_sent, 1);
+        qp_private(slot).wqe_start_ns[wqe_id & (ANP_MAX_INFLIGHT_WQES - 1)] = start_time;
     }
 
-    void update_wqe_rcvd_metrics(const int& qp_id,
+    // now() is only called for WQEs whose post was timed
+    template <typename Clock>
+    void update_wqe_rcvd_metrics(int slot,
                                  const uint64_t& wqe_id,
-                                 const uint64_t& end_time) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+                                 Clock now) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_wqe_rcvd++;
-        if (qp_info->wqe_id_tracker.find(wqe_id) != qp_info->wqe_id_tracker.end()) {
-            qp_info->stats.num_wqe_completed++;
-            auto completion_time = end_time - qp_info->wqe_id_tracker[wqe_id];
-            qp_info->stats.wqe_completion_time_max =
-                (qp_info->stats.wqe_completion_time_max < completion_time) ?
-                    completion_time : qp_info->stats.wqe_completion_time_max;
+        qp_shard_s& qp = shard(slot);
+        qp_stats_s& stats = qp.stats;
+        qp_private_s& priv = qp_private(slot);
+        writer_level(priv);
+        uint64_t& start_time = priv.wqe_start_ns[wqe_id & (ANP_MAX_INFLIGHT_WQES - 1)];
+        write_begin(qp);
+        shard_add(stats.num_wqe_rcvd, 1);
+        if (start_time) {
+            shard_add(stats.num_wqe_completed, 1);
+            auto completion_time = now() - start_time;
+            if (stats.wqe_completion_time_max < completion_time) {
+                shard_set(stats.wqe_completion_time_max, completion_time);
+            }
+            if ((stats.wqe_completion_time_min > completion_time) ||
+                !stats.wqe_completion_time_min) {
+                shard_set(stats.wqe_completion_time_min, completion_time);
+            }
+            shard_add(qp.completion_buckets[histogram.index(completion_time)], 1);
+            start_time = 0;
+        }
+        write_end(qp);
+    }
 
-            qp_info->stats.wqe_completion_time_min =
-                ((qp_info->stats.wqe_completion_time_min > completion_time) ||
-                 !qp_info->stats.wqe_completion_time_min) ?
-                    completion_time : qp_info->stats.wqe_completion_time_min;
-            qp_info->completion_metrics.log_time(completion_time);
-            qp_info->wqe_id_tracker.erase(wqe_id);
+    void update_slot_miss_metrics(int slot) {
+        if (!valid_slot(slot)) {
+            return;
         }
+        shard_add(shard(slot).stats.num_slot_miss, 1);
     }
 
-    void update_slot_miss_metrics(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void update_cts_send_metrics(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_slot_miss++;
+        qp_shard_s& qp = shard(slot);
+        write_begin(qp);
+        shard_add(qp.stats.num_cts_sent, 1);
+        shard_add(qp.stats.num_wqe_sent, 1);
+        write_end(qp);
     }
 
-    void update_cts_send_metrics(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_cts_sent(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_cts_sent++;
-        qp_info->stats.num_wqe_sent++;
+        shard_add(shard(slot).stats.num_cts_sent, 1);
     }
 
-    void increment_num_cts_sent(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_cts_sent_unsignalled(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_cts_sent++;
+        shard_add(shard(slot).stats.num_cts_sent_unsignalled, 1);
     }
 
-    void increment_num_cts_sent_unsignalled(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_cts_sent_signalled(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_cts_sent_unsignalled++;
+        shard_add(shard(slot).stats.num_cts_sent_signalled, 1);
     }
 
-    void increment_num_cts_sent_signalled(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_recv_wqe(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_cts_sent_signalled++;
+        shard_add(shard(slot).stats.num_recv_wqe, 1);
     }
 
-    void increment_num_recv_wqe(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_write_wqe(int slot, uint32_t count) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_recv_wqe++;
+        shard_add(shard(slot).stats.num_write_wqe, count);
     }
 
-    void increment_num_write_wqe(const int& qp_id, uint32_t count) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void increment_num_write_imm_wqe(int slot) {
+        if (!valid_slot(slot)) {
             return;
         }
-        qp_info->stats.num_write_wqe += count;
+        shard_add(shard(slot).stats.num_write_imm_wqe, 1);
     }
 
-    void increment_num_write_imm_wqe(const int& qp_id) {
-        auto& qp_info = queue_state[qp_id];
-        if (!qp_info) {
-            //ANP_LOG_ERROR("invalid qp_id %d", qp_id);
+    void update_wqe_size_metrics(int slot, const uint32_t& wqe_length) {
+        if (!valid_slot(slot)) {
+            return;
+        }
+        qp_shard_s& qp = shard(slot);
+        counter_t key = (counter_t)wqe_length + 1;
+        for (auto& wqe_size : qp.wqe_sizes) {
+            if (wqe_size.key == key) {
+                shard_add(wqe_size.count, 1);
+                return;
+            }
+            if (!wqe_size.key) {
+                write_begin(qp);
+                shard_set(wqe_size.key, key);
+                shard_set(wqe_size.count, 1);
+                write_end(qp);
+                return;
+            }
+        }
+        shard_add(qp.stats.num_wqe_size_untracked, 1);
+    }
+
+    // Accounts a poll of CQ slot that reaped completions CQEs. Those arrived
+    // after the previous poll, unless it returned a full batch, so the time
+    // since then bounds how long they waited. Every poll is timed at the full
+    // level, 1 in sample_rate pairs of consecutive polls when sampled. now()
+    // is only called for timed polls.
+    template <typename Clock>
+    void update_cq_poll_metrics(int slot, int completions, Clock now) {
+        if (!valid_cq_slot(slot)) {
+            return;
+        }
+        cq_shard_s& cq = cq_shard(slot);
+        cq_private_s& priv = cq_private(slot);
+        uint32_t current = writer_level(priv);
+        uint64_t prev_ns = priv.last_poll_ns;
+        uint64_t poll_ns = 0;
+        if (current == ANP_TELEMETRY_FULL ||
+            (current == ANP_TELEMETRY_SAMPLED && (prev_ns || sample_next(priv.sample_countdown)))) {
+            poll_ns = now();
+        }
+        bool drained = priv.last_batch < priv.max_batch;
+        // a sampled pair ends with its second poll
+        priv.last_poll_ns = (current == ANP_TELEMETRY_SAMPLED && prev_ns) ? 0 : poll_ns;
+        priv.last_batch = completions;
+        if (completions <= 0) {
+            shard_add(cq.stats.poll_batch[0], 1);
             return;
         }
-        qp_info->stats.num_write_imm_wqe++;
+        write_begin(cq);
+        shard_add(cq.stats.poll_batch[std::min(completions, ANP_MAX_CQ_POLL_BATCH)], 1);
+        shard_add(cq.stats.num_completion, completions);
+        if (prev_ns && poll_ns > prev_ns && drained) {
+            uint64_t poll_interval = poll_ns - prev_ns;
+            shard_add(cq.stats.num_poll_interval, 1);
+            if (cq.stats.poll_interval_max < poll_interval) {
+                shard_set(cq.stats.poll_interval_max, poll_interval);
+            }
+            shard_add(cq.stats.poll_interval_buckets[histogram.index(poll_interval)], 1);
+        }
+        write_end(cq);
     }
 
-    void update_wqe_size_metrics(const uint32_t& wqe_length) {
-        if (!devices.empty()) {
-            devices.begin()->second.stats.wqe_size_metrics[wqe_length]++;
+    // connection setup only, not on the data path
+    void update_qp_pool_metrics(int device_id, bool hit) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        device_stats_s& stats = devices[device_id].stats;
+        if (hit) {
+            stats.qp_pool_hits++;
+        } else {
+            stats.qp_pool_misses++;
+        }
+        anp_shm_device_s* shm_dev = shm_device(device_id);
+        if (shm_dev) {
+            header_write_begin();
+            shm_dev->qp_pool_hits = stats.qp_pool_hits;
+            shm_dev->qp_pool_misses = stats.qp_pool_misses;
+            header_write_end();
         }
     }
 
-    void update_cq_poll_metrics() {
-        if (!devices.empty()) {
-            devices.begin()->second.stats.cq_poll_count++;
+    // called from the async event thread, concurrently with the data path
+    void record_device_event(int device_id, int port, const char* event) {
+        std::lock_guard<std::mutex> guard(device_events->lock);
+        if (device_events->events.size() >= ANP_MAX_DEVICE_EVENTS) {
+            device_events->dropped++;
+            return;
         }
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        device_events->events.push_back({device_id, port, event, now});
+    }
+
+    // called once per port at init, before any connection exists
+    void record_device_health(int device_id, const char* device, int port, int nominal_speed,
+                              int loopback_speed, int reported_speed, counter_t errors,
+                              const char* status, const char* reason) {
+        std::lock_guard<std::mutex> guard(state_lock);
+        device_health.push_back({device_id, device, port, nominal_speed, loopback_speed,
+                                 reported_speed, errors, status, reason});
     }
 
     // function to load the configuration from JSON
@@ -476,8 +951,10 @@ public:
         anp_config_file_path = "";
         anp_logger::log_level = LOG_ERROR;
         output_dir = "/tmp";
-        bucket_sz_log2 = (uint32_t) log2(1024);
-        max_buckets = 5;
+        histogram = anp_latency_histogram(ANP_HISTOGRAM_MAX_PRECISION);
+        shared_memory = true;
+        initial_level = ANP_TELEMETRY_OFF;
+        initial_sample_rate = 64;
 
         const char* config_file_env = std::getenv("RCCL_ANP_CONFIG_FILE");
 
@@ -505,18 +982,33 @@ public:
                     anp_logger::log_level = LOG_ERROR;
                 // read the output_dir
                 output_dir = pt.get("output_dir", "/tmp");
-                // histogram bucket_interval_ns is expected to be in power of 2.
-                // read the value and if it input is not a power of 2, adjust it to next power of 2.
-                size_t bucket_interval_ns = pt.get<size_t>("bucket_interval_ns", 1024);
-                if (!IS_POWER_OF_2(bucket_interval_ns)) {
-                    bucket_interval_ns = power_of_2(bucket_interval_ns);
+                // sub-buckets per power of two of the latency histogram, as log2
+                uint32_t precision = pt.get<uint32_t>("histogram_precision", ANP_HISTOGRAM_MAX_PRECISION);
+                if (precision < 1 || precision > ANP_HISTOGRAM_MAX_PRECISION) {
+                    ANP_LOG_ERROR("histogram_precision %u out of range, using %d", precision,
+                                  ANP_HISTOGRAM_MAX_PRECISION);
+                    precision = ANP_HISTOGRAM_MAX_PRECISION;
+                }
+                histogram = anp_latency_histogram(precision);
+                shared_memory = pt.get<bool>("shared_memory", true);
+                std::string telemetry_level = pt.get<std::string>("telemetry_level", "off");
+                if (telemetry_level == "off")
+                    initial_level = ANP_TELEMETRY_OFF;
+                else if (telemetry_level == "counters")
+                    initial_level = ANP_TELEMETRY_COUNTERS;
+                else if (telemetry_level == "full")
+                    initial_level = ANP_TELEMETRY_FULL;
+                else
+                    initial_level = ANP_TELEMETRY_SAMPLED;
+                initial_sample_rate = pt.get<uint32_t>("sample_rate", 64);
+                if (initial_sample_rate < 1 || initial_sample_rate > ANP_TELEMETRY_MAX_SAMPLE_RATE) {
+                    ANP_LOG_ERROR("sample_rate %u out of range, using 64", initial_sample_rate);
+                    initial_sample_rate = 64;
                 }
-                bucket_sz_log2 = (uint32_t) log2(bucket_interval_ns);
-                max_buckets = pt.get<size_t>("max_buckets", 5);
                 ANP_LOG_VERBOSE("config_json %s", anp_config_file_path.c_str());
                 ANP_LOG_VERBOSE("log_level %d, input level %s", anp_logger::log_level, level.c_str());
-                ANP_LOG_VERBOSE("output_dir %s, bucket_interval_ns(bucket_sz_log2) %lu(%u), max_buckets %d",
-                                output_dir.c_str(), bucket_interval_ns, bucket_sz_log2, max_buckets);
+                ANP_LOG_VERBOSE("output_dir %s, histogram_precision %u, telemetry_level %u, sample_rate %u",
+                                output_dir.c_str(), histogram.precision, initial_level, initial_sample_rate);
             } catch (const std::exception& e) {
                 ANP_LOG_ERROR("error parsing JSON: %s", e.what());
             }
@@ -526,18 +1018,30 @@ public:
         ANP_LOG_VERBOSE("Boost version: %d", BOOST_VERSION);
     }
 
-    void shutdown() {
+    // called by the exporter thread, reads the shards while the data path
+    // keeps updating them
+    void export_json() {
         process_id = getpid();
         update_host_name();
         update_process_name();
         //load_histogram_config();
-        if (!devices.empty()) {
-            device_id = devices.begin()->first;
+        {
+            std::lock_guard<std::mutex> guard(state_lock);
+            if (!devices.empty()) {
+                device_id = devices.begin()->first;
+            }
         }
         end_time = std::time(nullptr);
         write_json_to_file();
     }
 
+    void shutdown() {
+        // with telemetry off nothing is written unless requested
+        if (level() != ANP_TELEMETRY_OFF) {
+            export_json();
+        }
+    }
+
     bool file_exists(const std::string& filename) {
         return access(filename.c_str(), F_OK) == 0;
     }
@@ -546,7 +1050,6 @@ public:
         std::string filename;
         std::string tmp_path;
         std::ostringstream oss;
-        boost::property_tree::ptree root;
 
         filename = output_dir + "/device_status_" + std::to_string(device_id) + ".json";
 	// construct a unique temporary file path
@@ -557,17 +1060,29 @@ public:
             ANP_LOG_ERROR("json output directory not specified");
             return;
         }
-        to_json(root);
 
-	std::ofstream ofs(tmp_path);
-        if (!ofs.is_open()) {
+        int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
             ANP_LOG_ERROR("failed to open temp file %s, err %d, %s",
                           tmp_path.c_str(), errno, strerror(errno));
 	    return;
         }
-        boost::property_tree::write_json(ofs, root);
-        ofs.flush();
-        ofs.close();
+        // allocated once, exports are serialized on the exporter thread
+        if (!json_buffer) {
+            json_buffer.reset(new char[ANP_JSON_BUFFER_SIZE]);
+        }
+        anp_json_writer out(fd, json_buffer.get(), ANP_JSON_BUFFER_SIZE);
+        to_json(out);
+        bool written = out.flush();
+        if (close(fd) != 0) {
+            written = false;
+        }
+        if (!written) {
+            ANP_LOG_ERROR("failed to write temp file %s, err %d, %s",
+                          tmp_path.c_str(), errno, strerror(errno));
+            unlink(tmp_path.c_str());
+            return;
+        }
         if (std::rename(tmp_path.c_str(), filename.c_str()) != 0) {
             ANP_LOG_ERROR("failed to rename file %s to %s, err %d, %s",
                           tmp_path.c_str(), filename.c_str(),
@@ -578,16 +1093,369 @@ public:
     anp_state() {
         start_time = std::time(nullptr);
         load_config();
+        map_shm();
+        anp_shm_set_level(*control, initial_level, initial_sample_rate);
     }
 
+    anp_state(const anp_state&) = delete;
+    anp_state& operator=(const anp_state&) = delete;
+
     ~anp_state() {
 #ifndef ANP_TELEMETRY_ENABLED
         return;
 #endif
         shutdown();
+        // proxy threads may still be running, so the region stays mapped
+        // until the process exits. Only its name goes away.
+        if (!shm_name.empty()) {
+            shm_unlink(shm_name.c_str());
+        }
+        if (shm_fd >= 0) {
+            close(shm_fd);
+        }
     }
 
 private:
+    // The QP shards live in /dev/shm so monitors can read them in place, see
+    // anp_shm.h. Without shared memory they are kept in an anonymous mapping
+    // of the same layout.
+    void map_shm() {
+        int fd = -1;
+        if (shared_memory) {
+            char name[64];
+            snprintf(name, sizeof(name), ANP_SHM_NAME_FMT, getpid());
+            fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            // the header is backed now, the tables as their slots are handed out
+            int err = 0;
+            if (fd >= 0 && (ftruncate(fd, ANP_SHM_SIZE) != 0 ||
+                            (err = posix_fallocate(fd, 0, ANP_SHM_HEADER_SIZE)) != 0)) {
+                if (err) {
+                    errno = err;
+                }
+                close(fd);
+                shm_unlink(name);
+                fd = -1;
+            }
+            if (fd >= 0) {
+                shm_name = name;
+            } else {
+                ANP_LOG_ERROR("failed to create shared memory %s, err %d, %s",
+                              name, errno, strerror(errno));
+            }
+        }
+        // sparse, only the pages of QPs in use get backed
+        void* addr = (fd >= 0) ?
+            mmap(nullptr, ANP_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+            mmap(nullptr, ANP_SHM_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED) {
+            ANP_LOG_ERROR("failed to map telemetry region, err %d, %s", errno, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (!shm_name.empty()) {
+                shm_unlink(shm_name.c_str());
+                shm_name.clear();
+            }
+            return;
+        }
+        shm_fd = fd;
+        shm = static_cast<anp_shm_header_s*>(addr);
+        qp_table = reinterpret_cast<qp_shard_s*>(static_cast<char*>(addr) + ANP_SHM_HEADER_SIZE);
+        cq_table = reinterpret_cast<cq_shard_s*>(static_cast<char*>(addr) + ANP_SHM_CQ_TABLE_OFFSET);
+
+        update_host_name();
+        update_process_name();
+        shm->version = ANP_SHM_VERSION;
+        shm->header_size = ANP_SHM_HEADER_SIZE;
+        shm->qp_size = sizeof(qp_shard_s);
+        shm->max_qps = ANP_SHM_MAX_QPS;
+        shm->max_devices = ANP_SHM_MAX_DEVICES;
+        shm->pid = getpid();
+        shm->histogram_precision = histogram.precision;
+        shm->cq_size = sizeof(cq_shard_s);
+        shm->max_cqs = ANP_SHM_MAX_CQS;
+        control = &shm->control;
+        shm->start_time = start_time;
+        snprintf(shm->host_name, sizeof(shm->host_name), "%s", host_name.c_str());
+        snprintf(shm->process_name, sizeof(shm->process_name), "%s", process_name.c_str());
+        shm->magic.store(ANP_SHM_MAGIC, std::memory_order_release);
+    }
+
+    // Allocates the tmpfs pages under [addr, addr + size) of the region, so
+    // that a full /dev/shm fails here instead of raising SIGBUS on the first
+    // store. Under the state lock. A private mapping needs nothing.
+    bool back_shm(char* addr, size_t size) {
+        if (shm_fd < 0) {
+            return true;
+        }
+        off_t offset = addr - reinterpret_cast<char*>(shm);
+        size = std::min(size, (size_t)(ANP_SHM_SIZE - offset));
+        int err = posix_fallocate(shm_fd, offset, size);
+        if (err != 0) {
+            ANP_LOG_ERROR("failed to allocate shared memory %s, err %d, %s",
+                          shm_name.c_str(), err, strerror(err));
+            return false;
+        }
+        return true;
+    }
+
+    // entry of device_id in the region, added on first use. Under the state lock.
+    anp_shm_device_s* shm_device(int device_id) {
+        if (!shm) {
+            return nullptr;
+        }
+        for (uint32_t i = 0; i < shm->num_devices; i++) {
+            if (shm->devices[i].device_id == device_id) {
+                return &shm->devices[i];
+            }
+        }
+        if (shm->num_devices == ANP_SHM_MAX_DEVICES) {
+            return nullptr;
+        }
+        header_write_begin();
+        anp_shm_device_s* shm_dev = &shm->devices[shm->num_devices++];
+        shm_dev->device_id = device_id;
+        shm_dev->in_use = 1;
+        header_write_end();
+        return shm_dev;
+    }
+
+    void header_write_begin() {
+        shm->seq.store(shm->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void header_write_end() {
+        shm->seq.store(shm->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void write_latency_percentiles(anp_json_writer& out, const counter_t* buckets, uint64_t max_value) const {
+        out.field("wqe_completion_ns_p50", histogram.percentile(buckets, 0.5, max_value));
+        out.field("wqe_completion_ns_p90", histogram.percentile(buckets, 0.9, max_value));
+        out.field("wqe_completion_ns_p99", histogram.percentile(buckets, 0.99, max_value));
+        out.field("wqe_completion_ns_p999", histogram.percentile(buckets, 0.999, max_value));
+    }
+
+    static counter_t num_cq_polls(const cq_stats_s& stats) {
+        counter_t polls = 0;
+        for (counter_t count : stats.poll_batch) {
+            polls += count;
+        }
+        return polls;
+    }
+
+    void write_cq_stats(anp_json_writer& out, const cq_stats_s& stats) const {
+        counter_t num_poll = num_cq_polls(stats);
+        counter_t num_empty_poll = stats.poll_batch[0];
+        out.field("num_poll", num_poll);
+        out.field("num_empty_poll", num_empty_poll);
+        out.field("empty_poll_rate", num_poll ? (double)num_empty_poll / num_poll : 0.0);
+        out.field("num_completion", stats.num_completion);
+        out.field("completions_per_poll",
+                  num_poll > num_empty_poll ? (double)stats.num_completion / (num_poll - num_empty_poll) : 0.0);
+        out.field("num_poll_interval", stats.num_poll_interval);
+        out.field("poll_interval_ns_p50", histogram.percentile(stats.poll_interval_buckets, 0.5, stats.poll_interval_max));
+        out.field("poll_interval_ns_p90", histogram.percentile(stats.poll_interval_buckets, 0.9, stats.poll_interval_max));
+        out.field("poll_interval_ns_p99", histogram.percentile(stats.poll_interval_buckets, 0.99, stats.poll_interval_max));
+        out.field("poll_interval_ns_max", stats.poll_interval_max);
+        out.begin_array("poll_batch_stats");
+        for (uint32_t batch = 1; batch <= ANP_MAX_CQ_POLL_BATCH; batch++) {
+            if (!stats.poll_batch[batch]) {
+                continue;
+            }
+            out.begin_object();
+            out.field("num_completion", batch);
+            out.field("num_poll", stats.poll_batch[batch]);
+            out.end_object();
+        }
+        out.end_array();
+    }
+
+    static void merge_cq_stats(cq_stats_s& into, const cq_stats_s& from) {
+        into.num_completion += from.num_completion;
+        into.num_poll_interval += from.num_poll_interval;
+        into.poll_interval_max = std::max(into.poll_interval_max, from.poll_interval_max);
+        for (uint32_t batch = 0; batch <= ANP_MAX_CQ_POLL_BATCH; batch++) {
+            into.poll_batch[batch] += from.poll_batch[batch];
+        }
+        anp_latency_histogram::merge(into.poll_interval_buckets, from.poll_interval_buckets);
+    }
+
+    qp_shard_s& shard(int slot) const {
+        return qp_table[slot];
+    }
+
+    qp_private_s& qp_private(int slot) const {
+        return qp_private_chunks[slot / ANP_QP_PRIVATE_CHUNK][slot % ANP_QP_PRIVATE_CHUNK];
+    }
+
+    cq_shard_s& cq_shard(int slot) const {
+        return cq_table[slot];
+    }
+
+    cq_private_s& cq_private(int slot) const {
+        return cq_private_chunks[slot / ANP_CQ_PRIVATE_CHUNK][slot % ANP_CQ_PRIVATE_CHUNK];
+    }
+
+    // whether the next event of a writer counting down countdown is sampled
+    bool sample_next(uint32_t& countdown) const {
+        if (countdown) {
+            countdown--;
+            return false;
+        }
+        uint32_t rate = control->sample_rate.load(std::memory_order_relaxed);
+        countdown = (rate > 1 && rate <= ANP_TELEMETRY_MAX_SAMPLE_RATE) ? rate - 1 : 0;
+        return true;
+    }
+
+    // Level as seen by the writer of a slot. While telemetry is off the
+    // writer is not called at all, so timestamps it kept may belong to WQEs
+    // or polls from before any number of switches. Every change bumps the
+    // control epoch, and the writer drops its timing state on its first
+    // update in a new epoch. The countdown restarts at the new sample rate.
+    template <typename Private>
+    uint32_t writer_level(Private& priv) const {
+        uint32_t current = control->level.load(std::memory_order_acquire);
+        uint32_t epoch = control->epoch.load(std::memory_order_relaxed);
+        if (epoch != priv.epoch) {
+            drop_timing(priv);
+            priv.sample_countdown = 0;
+            priv.epoch = epoch;
+        }
+        return current;
+    }
+
+    static void drop_timing(qp_private_s& priv) {
+        memset(priv.wqe_start_ns, 0, sizeof(priv.wqe_start_ns));
+    }
+
+    static void drop_timing(cq_private_s& priv) {
+        priv.last_poll_ns = 0;
+    }
+
+    // single writer, so a plain read-modify-write published with a relaxed store
+    static void shard_add(counter_t& counter, counter_t count) {
+        __atomic_store_n(&counter, counter + count, __ATOMIC_RELAXED);
+    }
+
+    static void shard_set(counter_t& counter, counter_t value) {
+        __atomic_store_n(&counter, value, __ATOMIC_RELAXED);
+    }
+
+    template <typename Shard>
+    static void write_begin(Shard& shard) {
+        shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    template <typename Shard>
+    static void write_end(Shard& shard) {
+        shard.seq.store(shard.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    static void copy_counters(const void* src, void* dst, size_t size) {
+        static_assert(sizeof(qp_stats_s) % sizeof(counter_t) == 0, "qp_stats_s must only hold counters");
+        static_assert(sizeof(cq_stats_s) % sizeof(counter_t) == 0, "cq_stats_s must only hold counters");
+        const counter_t* from = static_cast<const counter_t*>(src);
+        counter_t* to = static_cast<counter_t*>(dst);
+        for (size_t i = 0; i < size / sizeof(counter_t); i++) {
+            to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    // who a shard belongs to, read along with its counters. The exporter
+    // reads shards without the state lock, so a slot may have been released
+    // or handed to another queue since the bookkeeping was copied.
+    struct shard_owner_s {
+        uint32_t flags;
+        int32_t  qp_id; // -1 for a CQ
+        int32_t  device_id;
+        int32_t  channel_id;
+    };
+
+    // a writer stuck mid-update, e.g. a thread killed inside write_begin, is
+    // given up on after this many tries, the way anp_telemetry_reader does
+    static constexpr int max_read_retries = 1000;
+
+    // copy of the exported part of a shard, retried until no update of the
+    // owner overlapped it. false when the shard stayed unreadable.
+    bool read_shard(int slot, qp_shard_s& out, shard_owner_s* owner = nullptr) const {
+        const qp_shard_s& qp = shard(slot);
+        for (int tries = 0; tries < max_read_retries; tries++) {
+            uint32_t seq = qp.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (owner) {
+                owner->flags = __atomic_load_n(&qp.flags, __ATOMIC_RELAXED);
+                owner->qp_id = __atomic_load_n(&qp.qp_id, __ATOMIC_RELAXED);
+                owner->device_id = __atomic_load_n(&qp.device_id, __ATOMIC_RELAXED);
+                owner->channel_id = __atomic_load_n(&qp.channel_id, __ATOMIC_RELAXED);
+            }
+            copy_counters(&qp.stats, &out.stats, sizeof(qp.stats));
+            copy_counters(qp.completion_buckets, out.completion_buckets, sizeof(qp.completion_buckets));
+            copy_counters(qp.wqe_sizes, out.wqe_sizes, sizeof(qp.wqe_sizes));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (qp.seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool read_cq_shard(int slot, cq_stats_s& out, shard_owner_s* owner = nullptr) const {
+        const cq_shard_s& cq = cq_shard(slot);
+        for (int tries = 0; tries < max_read_retries; tries++) {
+            uint32_t seq = cq.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (owner) {
+                owner->flags = __atomic_load_n(&cq.flags, __ATOMIC_RELAXED);
+                owner->qp_id = -1;
+                owner->device_id = __atomic_load_n(&cq.device_id, __ATOMIC_RELAXED);
+                owner->channel_id = __atomic_load_n(&cq.channel_id, __ATOMIC_RELAXED);
+            }
+            copy_counters(&cq.stats, &out, sizeof(cq.stats));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (cq.seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static void clear_counters(void* dst, size_t size) {
+        counter_t* to = static_cast<counter_t*>(dst);
+        for (size_t i = 0; i < size / sizeof(counter_t); i++) {
+            __atomic_store_n(&to[i], 0, __ATOMIC_RELAXED);
+        }
+    }
+
+    // recycled QP or reused slot, its previous comm is gone so there is no
+    // concurrent writer
+    void reset_shard(int slot) {
+        qp_shard_s& qp = shard(slot);
+        write_begin(qp);
+        clear_counters(&qp.stats, sizeof(qp.stats));
+        clear_counters(qp.completion_buckets, sizeof(qp.completion_buckets));
+        clear_counters(qp.wqe_sizes, sizeof(qp.wqe_sizes));
+        write_end(qp);
+        memset(&qp_private(slot), 0, sizeof(qp_private_s));
+    }
+
+    // reused CQ slot, its previous CQ is no longer polled
+    void reset_cq_shard(int slot) {
+        cq_shard_s& cq = cq_shard(slot);
+        write_begin(cq);
+        clear_counters(&cq.stats, sizeof(cq.stats));
+        write_end(cq);
+        memset(&cq_private(slot), 0, sizeof(cq_private_s));
+    }
+
     int                    device_id;
     int                    process_id;
     std::string            host_name;
@@ -596,11 +1464,48 @@ private:
     std::string            anp_config_file_path;
     std::time_t            start_time;
     std::time_t            end_time;
-    int                    max_buckets;
-    uint32_t               bucket_sz_log2;
+    anp_latency_histogram  histogram;
     device_map_t           devices;
-    queue_pair_map_t       queue_state;
+    // guards everything but the QP shards, which the data path updates
+    // without locking
+    mutable std::mutex     state_lock;
+    // per-QP state indexed by the telemetry slot handed out by add_queue_pair
+    bool                   shared_memory;
+    std::string            shm_name;
+    anp_shm_header_s*      shm = nullptr;
+    // kept open to back table chunks as slots are handed out, -1 when private
+    int                    shm_fd = -1;
+    qp_shard_s*            qp_table = nullptr;
+    std::unique_ptr<qp_private_s[]> qp_private_chunks[ANP_SHM_MAX_QPS / ANP_QP_PRIVATE_CHUNK];
+    // runtime telemetry level, in the shared region when it is mapped
+    uint32_t               initial_level;
+    uint32_t               initial_sample_rate;
+    anp_shm_control_s      local_control;
+    anp_shm_control_s*     control = &local_control;
+    std::atomic<int>       num_slots{0};
+    std::vector<qp_info_s> qp_info;
+    // (device, queue-id) → telemetry slot, only consulted when a QP is created.
+    // QP numbers are only unique within an HCA.
+    std::unordered_map<uint64_t, int> qp_slots;
+    std::vector<int>       free_qp_slots;
+    // per-CQ state indexed by the slot handed out by add_completion_queue
+    cq_shard_s*            cq_table = nullptr;
+    std::unique_ptr<cq_private_s[]> cq_private_chunks[ANP_SHM_MAX_CQS / ANP_CQ_PRIVATE_CHUNK];
+    std::atomic<int>       num_cq_slots{0};
+    std::vector<cq_info_s> cq_info;
+    std::vector<int>       free_cq_slots;
+    // export buffers, only used by the exporter thread
+    std::unique_ptr<char[]>     json_buffer;
+    std::unique_ptr<qp_shard_s> json_scratch;
+    std::vector<export_device_s>  export_devices;
+    std::vector<export_channel_s> export_channels;
+    std::vector<export_qp_s>      export_qps;
+    std::vector<export_cq_s>      export_cqs;
+    std::vector<device_event_s>   export_events;
+    std::vector<device_health_s>  export_health;
     histogram_config_s     histogram_config;
+    std::shared_ptr<device_event_log_s> device_events = std::make_shared<device_event_log_s>();
+    std::vector<device_health_s> device_health;
 
 };
 
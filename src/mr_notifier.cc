@@ -0,0 +1,143 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#include <dlfcn.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include "anp_mr_notifier.h"
+
+#define ANP_MR_NOTIFIER_RING_SIZE 4096
+#define ANP_MR_NOTIFIER_SPIN_MAX  1024
+
+// Each entry is guarded by its own sequence number: 0 while a writer fills it,
+// then (ring position + 1) once it is valid.
+struct anpMrNotifierEntry {
+  std::atomic<uint64_t> seq;
+  std::atomic<uint64_t> addr;
+  std::atomic<uint64_t> len;
+};
+
+static anpMrNotifierEntry anpMrNotifierRing[ANP_MR_NOTIFIER_RING_SIZE];
+static std::atomic<uint64_t> anpMrNotifierRingHead(0);
+static std::atomic<bool> anpMrNotifierActive(false);
+
+static void anpMrNotifierRecord(void* addr, size_t len) {
+  if (!anpMrNotifierActive.load(std::memory_order_relaxed) || len == 0) return;
+  uint64_t pos = anpMrNotifierRingHead.fetch_add(1, std::memory_order_relaxed);
+  anpMrNotifierEntry* e = anpMrNotifierRing + (pos % ANP_MR_NOTIFIER_RING_SIZE);
+  e->seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  e->addr.store((uintptr_t)addr, std::memory_order_relaxed);
+  e->len.store(len, std::memory_order_relaxed);
+  e->seq.store(pos + 1, std::memory_order_release);
+}
+
+int anpMrNotifierEnable(void) {
+  // Make sure munmap()/madvise() calls actually land in this library
+  Dl_info self, munmapDef, madviseDef;
+  void* munmapSym = dlsym(RTLD_DEFAULT, "munmap");
+  void* madviseSym = dlsym(RTLD_DEFAULT, "madvise");
+  if (munmapSym == NULL || madviseSym == NULL ||
+      dladdr((void*)anpMrNotifierEnable, &self) == 0 ||
+      dladdr(munmapSym, &munmapDef) == 0 || dladdr(madviseSym, &madviseDef) == 0 ||
+      munmapDef.dli_fbase != self.dli_fbase || madviseDef.dli_fbase != self.dli_fbase) {
+    return -1;
+  }
+  anpMrNotifierActive.store(true, std::memory_order_release);
+  return 0;
+}
+
+bool anpMrNotifierEnabled(void) {
+  return anpMrNotifierActive.load(std::memory_order_acquire);
+}
+
+uint64_t anpMrNotifierHead(void) {
+  return anpMrNotifierRingHead.load(std::memory_order_acquire);
+}
+
+bool anpMrNotifierDrain(uint64_t* cursor, void (*cb)(uintptr_t addr, size_t len, void* arg), void* arg) {
+  uint64_t head = anpMrNotifierRingHead.load(std::memory_order_acquire);
+  if (head - *cursor > ANP_MR_NOTIFIER_RING_SIZE) {
+    *cursor = head;
+    return false;
+  }
+  for (uint64_t pos = *cursor; pos < head; pos++) {
+    anpMrNotifierEntry* e = anpMrNotifierRing + (pos % ANP_MR_NOTIFIER_RING_SIZE);
+    uint64_t seq;
+    int spins = 0;
+    // A writer may still be filling this entry
+    while ((seq = e->seq.load(std::memory_order_acquire)) < pos + 1) {
+      if (++spins > ANP_MR_NOTIFIER_SPIN_MAX) { *cursor = head; return false; }
+      sched_yield();
+    }
+    uint64_t addr = e->addr.load(std::memory_order_relaxed);
+    uint64_t len = e->len.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (seq != pos + 1 || e->seq.load(std::memory_order_relaxed) != seq) {
+      // Overwritten by a newer release, we lost track
+      *cursor = head;
+      return false;
+    }
+    cb((uintptr_t)addr, (size_t)len, arg);
+  }
+  *cursor = head;
+  return true;
+}
+
+// Interposed libc entry points. The real implementation is looked up lazily;
+// if the lookup itself ends up unmapping memory we go straight to the syscall.
+typedef int (*anpMunmapFn)(void*, size_t);
+typedef int (*anpMadviseFn)(void*, size_t, int);
+static std::atomic<anpMunmapFn> anpRealMunmap(nullptr);
+static std::atomic<anpMadviseFn> anpRealMadvise(nullptr);
+static __thread int anpMrNotifierResolving = 0;
+
+static int anpSysMunmap(void* addr, size_t len) {
+  return syscall(SYS_munmap, addr, len);
+}
+
+static int anpSysMadvise(void* addr, size_t len, int advice) {
+  return syscall(SYS_madvise, addr, len, advice);
+}
+
+template <typename T>
+static T anpMrNotifierResolve(std::atomic<T>& real, const char* name, T fallback) {
+  T fn = real.load(std::memory_order_relaxed);
+  if (fn) return fn;
+  if (anpMrNotifierResolving) return fallback;
+  anpMrNotifierResolving = 1;
+  fn = (T)dlsym(RTLD_NEXT, name);
+  anpMrNotifierResolving = 0;
+  if (fn == nullptr) fn = fallback;
+  real.store(fn, std::memory_order_relaxed);
+  return fn;
+}
+
+extern "C" int munmap(void* addr, size_t len) noexcept {
+  anpMrNotifierRecord(addr, len);
+  return anpMrNotifierResolve(anpRealMunmap, "munmap", anpSysMunmap)(addr, len);
+}
+
+extern "C" int madvise(void* addr, size_t len, int advice) noexcept {
+  if (advice == MADV_DONTNEED || advice == MADV_REMOVE || advice == MADV_FREE) {
+    anpMrNotifierRecord(addr, len);
+  }
+  return anpMrNotifierResolve(anpRealMadvise, "madvise", anpSysMadvise)(addr, len, advice);
+}
@@ -29,11 +29,19 @@
 #include <vector>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <linux/mempolicy.h>
 #include <x86intrin.h>
+#include <cpuid.h>
 #include <dlfcn.h>
 #include "net.h"
 #include "timer.h"
 #include "anp_ibvwrap.h"
+#include "anp_mr_notifier.h"
 #include "anp_param.h"
 #include "anp_state.h"
 #include "mpi.h"
@@ -60,13 +68,18 @@ static union ncclSocketAddress ncclIbIfAddr;
 
 #ifdef ANP_TELEMETRY_ENABLED
 static anp_state g_anp_state;
+// per-message telemetry, skipped by one well predicted branch while the
+// runtime level is off
+#define ANP_TELEMETRY_COUNT(stmt) \
+    do { if (g_anp_state.level() != ANP_TELEMETRY_OFF) { stmt; } } while (0)
+#else
+#define ANP_TELEMETRY_COUNT(stmt)
 #endif
 anp_log_level_e anp_logger::log_level = LOG_ERROR;
-std::atomic<int> active_threads(0);
 
 static char libPathInfo[2048];
 
-struct {
+struct anpDebugStats {
   uint64_t num_cts_sent;
 
   uint64_t num_signalled_cts_sent;
@@ -78,28 +91,76 @@ struct {
   uint64_t num_recv_wqe;
   uint64_t num_recv_completion;
   uint64_t num_recv_completion_ok;
-} g_debug_stats;
+};
+static_assert(sizeof(struct anpDebugStats) % sizeof(uint64_t) == 0, "anpDebugStats must only hold counters");
+
+// Debug counters are kept per thread so that proxy threads never write to a
+// shared cache line. Shards are never freed, the counts of threads that exited
+// stay in the totals.
+struct alignas(64) anpDebugStatsShard {
+  struct anpDebugStats stats;
+  struct anpDebugStatsShard* next;
+};
+static struct anpDebugStatsShard* anpDebugStatsShards = NULL;
+static thread_local struct anpDebugStatsShard* anpDebugStatsLocal = NULL;
+
+static struct anpDebugStats* anpDebugStatsGet(void) {
+  if (anpDebugStatsLocal == NULL) {
+    struct anpDebugStatsShard* shard = new anpDebugStatsShard();
+    shard->next = __atomic_load_n(&anpDebugStatsShards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&anpDebugStatsShards, &shard->next, shard, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    anpDebugStatsLocal = shard;
+  }
+  return &anpDebugStatsLocal->stats;
+}
+
+// Only the owning thread writes a shard, no locked instruction needed
+#define ANP_DEBUG_STATS_INC(field) do { \
+  struct anpDebugStats* debugStats = anpDebugStatsGet(); \
+  __atomic_store_n(&debugStats->field, debugStats->field + 1, __ATOMIC_RELAXED); \
+} while (0)
+
+static void anpDebugStatsSum(struct anpDebugStats* total) {
+  uint64_t* to = (uint64_t*)total;
+  memset(total, 0, sizeof(*total));
+  for (struct anpDebugStatsShard* shard = __atomic_load_n(&anpDebugStatsShards, __ATOMIC_ACQUIRE);
+       shard; shard = shard->next) {
+    uint64_t* from = (uint64_t*)&shard->stats;
+    for (size_t i = 0; i < sizeof(*total)/sizeof(uint64_t); i++) to[i] += __atomic_load_n(from+i, __ATOMIC_RELAXED);
+  }
+}
 
 struct ncclIbMr {
   uintptr_t addr;
   size_t pages;
   int refs;
+  int stale; // Memory was released, never hand out this MR again
   ibv_mr *mr;
 };
 
 struct ncclIbMrCache {
   struct ncclIbMr *slots;
   int capacity, population;
+  int idle; // Entries kept registered with no references
+  uint64_t notifierCursor;
 };
 
 static int ncclNMergedIbDevs = -1;
-#define NCCL_IB_MAX_DEVS_PER_NIC 2
+// Upper bound on the ports merged into one net device. The width actually
+// used is NCCL_IB_MERGE_WIDTH, set at init.
+#define NCCL_IB_MAX_DEVS_PER_NIC 8
+static_assert(NCCL_IB_MAX_DEVS_PER_NIC <= 8, "request device masks are 8 bits");
+static int ncclIbMergeWidth = 2;
 #define MAX_MERGED_DEV_NAME (MAXNAMESIZE*NCCL_IB_MAX_DEVS_PER_NIC)+NCCL_IB_MAX_DEVS_PER_NIC
 struct alignas(64) ncclIbMergedDev {
   int ndevs;
   int devs[NCCL_IB_MAX_DEVS_PER_NIC]; // Points to an index in ncclIbDevs
   int speed;
   char devName[MAX_MERGED_DEV_NAME]; // Up to NCCL_IB_MAX_DEVS_PER_NIC * name size, and a character for each '+'
+  float latency; // Measured at init (us), 0 if not calibrated
+  int measuredSpeed; // Measured at init (Mbps), 0 if not calibrated
+  struct ncclIbFifoSlab* fifoSlabs; // Protected by ncclIbFifoLock
 };
 
 static int ncclNIbDevs = -1;
@@ -110,21 +171,37 @@ struct alignas(64) ncclIbDev {
   uint8_t portNum;
   uint8_t link;
   int speed;
+  int nominalSpeed; // Link speed before the self-test lowers speed
   ibv_context* context;
   int pdRefs;
   ibv_pd* pd;
   char devName[MAXNAMESIZE];
   char* pciPath;
+  int numaNode; // -1 if unknown
   int realPort;
   int maxQp;
   struct ncclIbMrCache mrCache;
   int ar; // ADAPTIVE_ROUTING
   struct ibv_port_attr portAttr;
+  struct ncclIbQpPoolEntry* qpPool; // Idle CQ and QPs ready for reuse, protected by lock
+  int qpPoolSize;
+  // Resolved local GID, protected by lock. Invalidated by GID change/port events
+  int gidValid;
+  int gidIndex;
+  union ibv_gid gid;
+  volatile int portDown; // Set and cleared by the async event thread
+  int excluded; // Failed the init self-test, not exposed as a net device
+  // Init loopback test, run once and shared by the self-test and calibration
+  int loopbackState;
+  float loopbackLatency; // us
+  int loopbackSpeed; // Mbps
+  bool lastUd[2]; // udma the last CTS [0] and data [1] channel was bound to
 };
 
-#define MAX_IB_DEVS 32
-struct ncclIbMergedDev ncclIbMergedDevs[MAX_IB_DEVS];
-struct ncclIbDev ncclIbDevs[MAX_IB_DEVS];
+// Sized at init to the number of ports found, see ncclIbAllocDevTables
+#define MAX_IB_USER_IFS 64
+struct ncclIbMergedDev* ncclIbMergedDevs = NULL;
+struct ncclIbDev* ncclIbDevs = NULL;
 pthread_mutex_t ncclIbLock = PTHREAD_MUTEX_INITIALIZER;
 static int ncclIbRelaxedOrderingEnabled = 0;
 
@@ -142,6 +219,22 @@ NCCL_PARAM(IbPciRelaxedOrdering, "IB_PCI_RELAXED_ORDERING", 2);
 NCCL_PARAM(IbAdaptiveRouting, "IB_ADAPTIVE_ROUTING", -2);
 NCCL_PARAM(IbFifoTc, "IB_FIFO_TC", 0);
 NCCL_PARAM(DmaBufEnable, "DMABUF_ENABLE", 0);
+NCCL_PARAM(IbMrCacheInvalidate, "IB_MR_CACHE_INVALIDATE", 0);
+NCCL_PARAM(IbMrCacheMaxIdle, "IB_MR_CACHE_MAX_IDLE", 256);
+NCCL_PARAM(IbCalibrate, "IB_CALIBRATE", 0);
+NCCL_PARAM(IbHealthCheck, "IB_HEALTH_CHECK", 0);
+
+#define NCCL_IB_LOOPBACK_UNTESTED 0
+#define NCCL_IB_LOOPBACK_PASSED   1
+#define NCCL_IB_LOOPBACK_FAILED   2 // A write completed in error or the test could not be set up
+#define NCCL_IB_LOOPBACK_TIMEOUT  3 // The budget ran out first
+
+// Keep unreferenced MRs registered; only safe when released memory is reported to us
+static int ncclIbMrCacheLongLived = 0;
+
+static ncclResult_t ncclIbQpPoolPrewarm(int ibDevN);
+static void ncclIbCalibrate(void);
+static void ncclIbHealthCheck(void);
 
 pthread_t ncclIbAsyncThread;
 struct allocationTracker allocTracker[MAX_ALLOC_TRACK_NGPU] = {};
@@ -149,44 +242,46 @@ struct allocationTracker allocTracker[MAX_ALLOC_TRACK_NGPU] = {};
 static void
 anp_stats_dump_on_signal (void)
 {
+  struct anpDebugStats stats;
+  anpDebugStatsSum(&stats);
   fprintf(stderr, "=======\n");
   for (int i = 0; i < ncclNMergedIbDevs; i++) {
     fprintf(stderr, "Ibdev %s\n", ncclIbMergedDevs[i].devName);
   }
-  fprintf(stderr, "%-52s : %lu\n", "num_cts_sent", g_debug_stats.num_cts_sent);
-  fprintf(stderr, "%-52s : %lu\n", "num_signalled_cts_sent", g_debug_stats.num_signalled_cts_sent);
-  fprintf(stderr, "%-52s : %lu\n", "num_recv_wqe", g_debug_stats.num_recv_wqe);
-  if (g_debug_stats.num_recv_completion ==
-          (g_debug_stats.num_signalled_cts_sent + g_debug_stats.num_recv_wqe)) {
+  fprintf(stderr, "%-52s : %lu\n", "num_cts_sent", stats.num_cts_sent);
+  fprintf(stderr, "%-52s : %lu\n", "num_signalled_cts_sent", stats.num_signalled_cts_sent);
+  fprintf(stderr, "%-52s : %lu\n", "num_recv_wqe", stats.num_recv_wqe);
+  if (stats.num_recv_completion ==
+          (stats.num_signalled_cts_sent + stats.num_recv_wqe)) {
       fprintf(stderr, "%-52s : %lu/%lu (OK)\n", "num_recv_completion/expected",
-              g_debug_stats.num_recv_completion,
-              (g_debug_stats.num_signalled_cts_sent + g_debug_stats.num_recv_wqe));
+              stats.num_recv_completion,
+              (stats.num_signalled_cts_sent + stats.num_recv_wqe));
   } else {
       fprintf(stderr, "%-52s : %lu/%lu (ERR)\n", "num_recv_completion/expected",
-              g_debug_stats.num_recv_completion,
-              (g_debug_stats.num_signalled_cts_sent + g_debug_stats.num_recv_wqe));
+              stats.num_recv_completion,
+              (stats.num_signalled_cts_sent + stats.num_recv_wqe));
   }
-  fprintf(stderr, "%-52s : %lu\n", "num_recv_completion_ok", g_debug_stats.num_recv_completion_ok);
-  if ((g_debug_stats.num_recv_completion - g_debug_stats.num_recv_completion_ok) > 0) {
+  fprintf(stderr, "%-52s : %lu\n", "num_recv_completion_ok", stats.num_recv_completion_ok);
+  if ((stats.num_recv_completion - stats.num_recv_completion_ok) > 0) {
       fprintf(stderr, "%-52s : %lu\n", "num_recv_completion_err (ERR)",
-              g_debug_stats.num_recv_completion - g_debug_stats.num_recv_completion_ok);
+              stats.num_recv_completion - stats.num_recv_completion_ok);
   }
 
-  fprintf(stderr, "%-52s : %lu\n", "num_wr_wqe", g_debug_stats.num_wr_wqe);
-  fprintf(stderr, "%-52s : %lu\n", "num_wi_wqe", g_debug_stats.num_wi_wqe);
-  if (g_debug_stats.num_send_completion ==
-          (g_debug_stats.num_wr_wqe + g_debug_stats.num_wi_wqe)) {
+  fprintf(stderr, "%-52s : %lu\n", "num_wr_wqe", stats.num_wr_wqe);
+  fprintf(stderr, "%-52s : %lu\n", "num_wi_wqe", stats.num_wi_wqe);
+  if (stats.num_send_completion ==
+          (stats.num_wr_wqe + stats.num_wi_wqe)) {
       fprintf(stderr, "%-52s : %lu/%lu (OK)\n", "num_send_completion/expected",
-              g_debug_stats.num_send_completion,
-              (g_debug_stats.num_wr_wqe + g_debug_stats.num_wi_wqe));
+              stats.num_send_completion,
+              (stats.num_wr_wqe + stats.num_wi_wqe));
   } else {
       fprintf(stderr, "%-52s : %lu/%lu (ERR)\n", "num_send_completion/expected",
-              g_debug_stats.num_send_completion,
-              (g_debug_stats.num_wr_wqe + g_debug_stats.num_wi_wqe));
+              stats.num_send_completion,
+              (stats.num_wr_wqe + stats.num_wi_wqe));
   }
-  if ((g_debug_stats.num_send_completion - g_debug_stats.num_send_completion_ok) > 0) {
+  if ((stats.num_send_completion - stats.num_send_completion_ok) > 0) {
       fprintf(stderr, "%-52s : %lu\n", "num_send_completion_err (ERR)",
-              g_debug_stats.num_send_completion - g_debug_stats.num_send_completion_ok);
+              stats.num_send_completion - stats.num_send_completion_ok);
   }
   fprintf(stderr, "=======\n");
 }
@@ -196,40 +291,55 @@ void anp_reinit_debug_log (void) {
   setenv("NCCL_DEBUG_SUBSYS", "ALL", true);
 }
 
-void* json_thread_init(void* arg) {
+#ifdef ANP_TELEMETRY_ENABLED
+// Long-lived exporter writing the device status JSON each time it is woken
+// through anp_json_event_fd. It reads the live telemetry state, see
+// anp_state::read_shard, so no copy of the state is made.
+static int anp_json_event_fd = -1;
+static pthread_t anp_json_thread;
+static std::atomic<bool> anp_json_stop(false);
+
+static void* anp_json_thread_main(void* arg) {
     ANP_LOG_VERBOSE("Process ID: %d, Thread ID: %lu", getpid(), pthread_self());
-    anp_state* snapshot = static_cast<anp_state*>(arg);
-    // destructor will trigger the dump json function
-    delete snapshot;
-    active_threads--;
-    ANP_LOG_VERBOSE("Thread %lu completed. active threads %d", pthread_self(),
-		    active_threads.load());
+    while (!anp_json_stop.load()) {
+        uint64_t requests;
+        // Requests made while a file is written are coalesced into the next one
+        if (read(anp_json_event_fd, &requests, sizeof(requests)) != sizeof(requests)) {
+            if (errno == EINTR) continue;
+            ANP_LOG_ERROR("json exporter read failed, err %d, %s", errno, strerror(errno));
+            break;
+        }
+        if (anp_json_stop.load()) break;
+        g_anp_state.export_json();
+    }
     return nullptr;
 }
+#endif
 
-void anp_create_json_thread(void) {
+void anp_start_json_thread(void) {
 #ifdef ANP_TELEMETRY_ENABLED
-    pthread_t thread_id;
     pthread_attr_t attr;
     struct sched_param param;
-    anp_state* snapshot = new anp_state(g_anp_state);
 
-    pthread_attr_init(&attr);
-    // detached thread
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (anp_json_event_fd >= 0) return;
+    anp_json_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (anp_json_event_fd < 0) {
+        ANP_LOG_ERROR("Failed to create json exporter eventfd, err %d, %s", errno, strerror(errno));
+        return;
+    }
 
+    pthread_attr_init(&attr);
     // set scheduling policy as default and lowest priority
     pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
     param.sched_priority = 0;
     pthread_attr_setschedparam(&attr, &param);
-    active_threads++;
 
-    if (pthread_create(&thread_id, &attr, json_thread_init, snapshot) != 0) {
+    if (pthread_create(&anp_json_thread, &attr, anp_json_thread_main, NULL) != 0) {
         ANP_LOG_ERROR("Failed to create json thread");
-        active_threads--;
-        delete snapshot;
+        close(anp_json_event_fd);
+        anp_json_event_fd = -1;
     } else {
-        ANP_LOG_VERBOSE("Thread %lu created. Active threads %d", thread_id, active_threads.load());
+        ncclSetThreadName(anp_json_thread, "ANP Telemetry");
     }
 
     // Cleanup thread attributes
@@ -237,14 +347,39 @@ void anp_create_json_thread(void) {
 #endif
 }
 
-void anp_sig_handler(int signum) {
-  ANP_LOG_VERBOSE("Process ID: %d, Thread ID: %lu, signal: %s (%u)",
-                  getpid(), pthread_self(), strsignal(signum), signum);
+// Async-signal-safe: only writes to the exporter's eventfd
+void anp_request_json_export(void) {
+#ifdef ANP_TELEMETRY_ENABLED
+    uint64_t one = 1;
+    if (anp_json_event_fd >= 0) {
+        ssize_t ret = write(anp_json_event_fd, &one, sizeof(one));
+        (void)ret;
+    }
+#endif
+}
+
+void anp_stop_json_thread(void) {
+#ifdef ANP_TELEMETRY_ENABLED
+    if (anp_json_event_fd < 0) return;
+    anp_json_stop.store(true);
+    anp_request_json_export();
+    pthread_join(anp_json_thread, NULL);
+    close(anp_json_event_fd);
+    anp_json_event_fd = -1;
+#endif
+}
 
+void anp_sig_handler(int signum) {
   if (signum == SIGUSR1) {
-    anp_create_json_thread();
+    int savedErrno = errno;
+    anp_request_json_export();
+    errno = savedErrno;
     return;
-  } else if (signum == SIGUSR2) {
+  }
+
+  ANP_LOG_VERBOSE("Process ID: %d, Thread ID: %lu, signal: %s (%u)",
+                  getpid(), pthread_self(), strsignal(signum), signum);
+  if (signum == SIGUSR2) {
     anp_reinit_debug_log();
   }
   exit (-1);
@@ -272,28 +407,131 @@ void wait_for_threads_before_exit(void) {
     // Restore default signal handling
     anp_deregister_signal_hdl();
 
-    while (active_threads > 0) {
-        ANP_LOG_VERBOSE("Waiting for threads to complete...");
-        sleep(1);
-    }
-    ANP_LOG_VERBOSE("All threads completed. Safe to exit.");
+    // The final JSON is written by the g_anp_state destructor
+    anp_stop_json_thread();
+    ANP_LOG_VERBOSE("Telemetry exporter stopped. Safe to exit.");
+}
+
+// Map an async event to the ncclIbDevs entry (port) it concerns. Events not
+// tied to a port are reported on the first port of the device.
+static int ncclIbAsyncEventDev(int ibDevN, struct ibv_async_event* event) {
+  switch (event->event_type) {
+    case IBV_EVENT_PORT_ACTIVE:
+    case IBV_EVENT_PORT_ERR:
+    case IBV_EVENT_LID_CHANGE:
+    case IBV_EVENT_PKEY_CHANGE:
+    case IBV_EVENT_GID_CHANGE:
+    case IBV_EVENT_SM_CHANGE:
+    case IBV_EVENT_CLIENT_REREGISTER:
+      for (int d = 0; d < ncclNIbDevs; d++) {
+        if (ncclIbDevs[d].context == ncclIbDevs[ibDevN].context && ncclIbDevs[d].portNum == event->element.port_num) return d;
+      }
+      return ibDevN;
+    default:
+      return ibDevN;
+  }
+}
+
+static void ncclIbHandleAsyncEvent(int ibDevN, struct ibv_async_event* event) {
+  int d = ncclIbAsyncEventDev(ibDevN, event);
+  struct ncclIbDev* dev = ncclIbDevs + d;
+  char *str;
+  if (ncclSuccess != wrap_ibv_event_type_str(&str, event->event_type)) str = (char*)"unknown";
+  switch (event->event_type) {
+    case IBV_EVENT_COMM_EST:
+    case IBV_EVENT_SQ_DRAINED:
+    case IBV_EVENT_QP_LAST_WQE_REACHED:
+      // Part of normal QP operation
+      return;
+    case IBV_EVENT_QP_FATAL:
+    case IBV_EVENT_QP_REQ_ERR:
+    case IBV_EVENT_QP_ACCESS_ERR:
+    case IBV_EVENT_PATH_MIG_ERR:
+      WARN("NET/IB : %s:%d Got async event : %s on QP %u", dev->devName, dev->portNum, str, event->element.qp->qp_num);
+      break;
+    case IBV_EVENT_PORT_ERR:
+      dev->portDown = 1;
+      WARN("NET/IB : %s:%d Got async event : %s", dev->devName, dev->portNum, str);
+      break;
+    case IBV_EVENT_PORT_ACTIVE:
+      dev->portDown = 0;
+      WARN("NET/IB : %s:%d Got async event : %s", dev->devName, dev->portNum, str);
+      break;
+    case IBV_EVENT_DEVICE_FATAL:
+      for (int i = 0; i < ncclNIbDevs; i++) {
+        if (ncclIbDevs[i].context == dev->context) ncclIbDevs[i].portDown = 1;
+      }
+      WARN("NET/IB : %s:%d Got async event : %s", dev->devName, dev->portNum, str);
+      break;
+    default:
+      WARN("NET/IB : %s:%d Got async event : %s", dev->devName, dev->portNum, str);
+      break;
+  }
+  if (event->event_type == IBV_EVENT_GID_CHANGE || event->event_type == IBV_EVENT_PORT_ACTIVE) {
+    // The GID table may have changed, resolve the GID again on next use
+    pthread_mutex_lock(&dev->lock);
+    dev->gidValid = 0;
+    pthread_mutex_unlock(&dev->lock);
+  }
+  ANP_TELEMETRY_EXECUTE(g_anp_state.record_device_event(d, dev->portNum, str));
 }
 
+#define NCCL_IB_ASYNC_MAX_EVENTS 16
+
+// One thread waits on the async event fd of every opened device. Each fd is
+// registered with the index of the first ncclIbDevs entry using that context.
 static void* ncclIbAsyncThreadMain(void* args) {
   ANP_LOG_VERBOSE("Process ID: %d, Thread ID: %lu", getpid(), pthread_self());
-  struct ncclIbDev* dev = (struct ncclIbDev*)args;
+  int epollFd = (int)(intptr_t)args;
+  struct epoll_event events[NCCL_IB_ASYNC_MAX_EVENTS];
   while (1) {
-    struct ibv_async_event event;
-    if (ncclSuccess != wrap_ibv_get_async_event(dev->context, &event)) { break; }
-    char *str;
-    if (ncclSuccess != wrap_ibv_event_type_str(&str, event.event_type)) { break; }
-    if (event.event_type != IBV_EVENT_COMM_EST)
-      WARN("NET/IB : %s:%d Got async event : %s", dev->devName, dev->portNum, str);
-    if (ncclSuccess != wrap_ibv_ack_async_event(&event)) { break; }
+    int nEvents = epoll_wait(epollFd, events, NCCL_IB_ASYNC_MAX_EVENTS, -1);
+    if (nEvents < 0) {
+      if (errno == EINTR) continue;
+      WARN("NET/IB : epoll_wait on async events failed : %s", strerror(errno));
+      break;
+    }
+    for (int e = 0; e < nEvents; e++) {
+      int ibDevN = events[e].data.u32;
+      struct ibv_async_event event;
+      // The fd is readable, so this returns one event without blocking
+      if (ncclSuccess != wrap_ibv_get_async_event(ncclIbDevs[ibDevN].context, &event)) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, ncclIbDevs[ibDevN].context->async_fd, NULL);
+        continue;
+      }
+      ncclIbHandleAsyncEvent(ibDevN, &event);
+      wrap_ibv_ack_async_event(&event);
+    }
   }
+  close(epollFd);
   return NULL;
 }
 
+static ncclResult_t ncclIbStartAsyncThread(void) {
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd < 0) {
+    WARN("NET/IB : epoll_create1 failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    // Ports of the same device share its context and async fd
+    int first = 0;
+    while (ncclIbDevs[first].context != ncclIbDevs[d].context) first++;
+    if (first != d) continue;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = d;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, ncclIbDevs[d].context->async_fd, &ev) != 0) {
+      WARN("NET/IB : Unable to watch async events of %s : %s", ncclIbDevs[d].devName, strerror(errno));
+    }
+  }
+  pthread_create(&ncclIbAsyncThread, NULL, ncclIbAsyncThreadMain, (void*)(intptr_t)epollFd);
+  ncclSetThreadName(ncclIbAsyncThread, "NCCL IbAsync");
+  pthread_detach(ncclIbAsyncThread); // will not be pthread_join()'d
+  return ncclSuccess;
+}
+
 static inline uint64_t gettime_ns(void) {
   struct timespec ts;
 
@@ -301,6 +539,56 @@ static inline uint64_t gettime_ns(void) {
   return uint64_t(ts.tv_sec)*1000*1000*1000 + ts.tv_nsec;
 }
 
+// WQE timestamps are taken at every post and completion when telemetry is on.
+// With an invariant TSC they are read with rdtsc and scaled to ns by a factor
+// calibrated once against CLOCK_MONOTONIC, otherwise they fall back to
+// clock_gettime. The calibration only runs when the plugin starts at a level
+// that times WQEs; a level raised at runtime uses clock_gettime. Only
+// differences of these timestamps are used.
+#define ANP_TSC_CALIBRATION_NS (10*1000*1000)
+static bool anpTscClock = false;
+static uint64_t anpTscBase;
+static uint64_t anpTscBaseNs;
+static uint64_t anpTscNsMult; // ns per cycle, 32.32 fixed point
+
+// TSC read paired with the middle of the clock_gettime calls around it
+static void anpTscSample(uint64_t* ns, uint64_t* tsc) {
+  uint64_t before = gettime_ns();
+  *tsc = __rdtsc();
+  *ns = before + (gettime_ns() - before) / 2;
+}
+
+static void anpTscCalibrate(void) {
+  unsigned int eax, ebx, ecx, edx;
+  // CPUID.80000007H:EDX[8], constant rate in all P, C and T states
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+    INFO(NCCL_INIT, "NET/IB : TSC is not invariant, WQE timestamps use CLOCK_MONOTONIC");
+    return;
+  }
+  uint64_t startNs, startTsc, endNs, endTsc;
+  anpTscSample(&startNs, &startTsc);
+  do {
+    anpTscSample(&endNs, &endTsc);
+  } while (endNs - startNs < ANP_TSC_CALIBRATION_NS);
+  if (endTsc <= startTsc) {
+    WARN("NET/IB : TSC did not advance during calibration, WQE timestamps use CLOCK_MONOTONIC");
+    return;
+  }
+  anpTscNsMult = ((endNs - startNs) << 32) / (endTsc - startTsc);
+  anpTscBase = endTsc;
+  anpTscBaseNs = endNs;
+  anpTscClock = true;
+  INFO(NCCL_INIT, "NET/IB : WQE timestamps use the TSC at %.3f GHz",
+       (double)(endTsc - startTsc) / (endNs - startNs));
+}
+
+static inline uint64_t anpTimestampNs(void) {
+  if (anpTscClock) {
+    return anpTscBaseNs + (uint64_t)(((unsigned __int128)(__rdtsc() - anpTscBase) * anpTscNsMult) >> 32);
+  }
+  return gettime_ns();
+}
+
 static sa_family_t envIbAddrFamily(void) {
   sa_family_t family = AF_INET;
   const char* env = getenv("NCCL_IB_ADDR_FAMILY");
@@ -536,11 +824,80 @@ static ncclResult_t ncclIbGetGidIndex(struct ibv_context *context, uint8_t portN
   return ncclSuccess;
 }
 
+// Returns the GID index and GID connections should use on this device.
+// Walking the GID table is costly (verbs queries and sysfs reads per entry),
+// so the result is cached until the async thread reports a GID change.
+static ncclResult_t ncclIbDevGetGid(int ibDevN, int* gidIndex, union ibv_gid* gid) {
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  ncclResult_t res = ncclSuccess;
+  pthread_mutex_lock(&ibDev->lock);
+  if (!ibDev->gidValid) {
+    NCCLCHECKGOTO(ncclIbGetGidIndex(ibDev->context, ibDev->portNum, &ibDev->portAttr, &ibDev->gidIndex), res, returning);
+    NCCLCHECKGOTO(wrap_ibv_query_gid(ibDev->context, ibDev->portNum, ibDev->gidIndex, &ibDev->gid), res, returning);
+    ibDev->gidValid = 1;
+    TRACE(NCCL_NET, "NET/IB : %s:%d resolved GID index %d", ibDev->devName, ibDev->portNum, ibDev->gidIndex);
+  }
+  *gidIndex = ibDev->gidIndex;
+  *gid = ibDev->gid;
+returning:
+  pthread_mutex_unlock(&ibDev->lock);
+  return res;
+}
+
 NCCL_PARAM(IbDisable, "IB_DISABLE", 0);
 NCCL_PARAM(IbMergeVfs, "IB_MERGE_VFS", 1);
 NCCL_PARAM(IbMergeNics, "IB_MERGE_NICS", 1);
+NCCL_PARAM(IbMergeWidth, "IB_MERGE_WIDTH", 2);
+NCCL_PARAM(IbNumaAlloc, "IB_NUMA_ALLOC", 1);
+NCCL_PARAM(IbHugePages, "IB_HUGEPAGES", 0);
+
+static int ncclIbGetNumaNode(const char* pciPath) {
+  char path[PATH_MAX];
+  char str[16] = { 0 };
+  if (pciPath == NULL) return -1;
+  snprintf(path, PATH_MAX, "%s/numa_node", pciPath);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+  int ret = read(fd, str, sizeof(str)-1);
+  close(fd);
+  if (ret <= 0) return -1;
+  return strtol(str, NULL, 10);
+}
+
+#define NCCL_IB_HUGE_PAGE_SIZE (2UL<<20)
+
+// Allocate zeroed, page aligned memory on the NUMA node of a NIC, so that the
+// fifos and requests the NIC writes and the proxy polls stay socket local.
+// With hugePages, size must be a multiple of NCCL_IB_HUGE_PAGE_SIZE and
+// hugetlbfs pages are tried first, then transparent huge pages.
+// Must be released with ncclIbNumaFree.
+static ncclResult_t ncclIbNumaAlloc(void** ptr, size_t size, int ibDevN, bool hugePages) {
+  void* p = MAP_FAILED;
+  if (hugePages) p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if (p == MAP_FAILED) p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    WARN("NET/IB : Failed to allocate %zu bytes : %s", size, strerror(errno));
+    return ncclSystemError;
+  }
+  if (hugePages || ncclParamIbHugePages()) madvise(p, size, MADV_HUGEPAGE);
+  int node = ncclIbDevs[ibDevN].numaNode;
+  if (ncclParamIbNumaAlloc() && node >= 0 && node < 64) {
+    unsigned long nodeMask = 1UL << node;
+    if (syscall(SYS_mbind, p, size, MPOL_PREFERRED, &nodeMask, sizeof(nodeMask)*8, 0) != 0) {
+      TRACE(NCCL_NET, "NET/IB : mbind to NUMA node %d failed : %s", node, strerror(errno));
+    }
+  }
+  // Fault the pages in now, under the policy above
+  memset(p, 0, size);
+  *ptr = p;
+  return ncclSuccess;
+}
 
-static ncclResult_t ncclIbGetPciPath(char* devName, char** path, int* realPort) {
+static void ncclIbNumaFree(void* ptr, size_t size) {
+  if (ptr) munmap(ptr, size);
+}
+
+static ncclResult_t ncclIbGetPciPath(const char* devName, char** path) {
   char devicePath[PATH_MAX];
   snprintf(devicePath, PATH_MAX, "/sys/class/infiniband/%s/device", devName);
   char* p = realpath(devicePath, NULL);
@@ -551,16 +908,52 @@ static ncclResult_t ncclIbGetPciPath(char* devName, char** path, int* realPort)
     p[strlen(p)-1] = '0';
     // Also merge virtual functions (VF) into the same device
     if (ncclParamIbMergeVfs()) p[strlen(p)-3] = p[strlen(p)-4] = '0';
-    // And keep the real port aside (the ibv port is always 1 on recent cards)
-    *realPort = 0;
-    for (int d=0; d<ncclNIbDevs; d++) {
-      if (strcmp(p, ncclIbDevs[d].pciPath) == 0) (*realPort)++;
-    }
   }
   *path = p;
   return ncclSuccess;
 }
 
+// Everything init needs to know about one verbs device. Devices are probed
+// concurrently since opening a context and querying ports each cost a few
+// milliseconds of driver work per device.
+struct ncclIbProbe {
+  struct ibv_device* device;
+  struct ibv_context* context;
+  struct ibv_device_attr devAttr;
+  struct ibv_port_attr* portAttrs; // [devAttr.phys_port_cnt], state is IBV_PORT_NOP if the query failed
+  char* pciPath;
+  int numaNode;
+  ncclResult_t ret;
+};
+
+static void* ncclIbProbeDevice(void* args) {
+  struct ncclIbProbe* probe = (struct ncclIbProbe*)args;
+  if (ncclSuccess != wrap_ibv_open_device(&probe->context, probe->device) || probe->context == NULL) {
+    WARN("NET/IB : Unable to open device %s", probe->device->name);
+    probe->context = NULL;
+    return NULL;
+  }
+  memset(&probe->devAttr, 0, sizeof(probe->devAttr));
+  if (ncclSuccess != wrap_ibv_query_device(probe->context, &probe->devAttr)) {
+    WARN("NET/IB : Unable to query device %s", probe->device->name);
+    goto close;
+  }
+  if (ncclCalloc(&probe->portAttrs, probe->devAttr.phys_port_cnt) != ncclSuccess) goto close;
+  for (int p = 0; p < probe->devAttr.phys_port_cnt; p++) {
+    if (ncclSuccess != wrap_ibv_query_port(probe->context, p+1, probe->portAttrs+p)) {
+      WARN("NET/IB : Unable to query port_num %d", p+1);
+      probe->portAttrs[p].state = IBV_PORT_NOP;
+    }
+  }
+  ncclIbGetPciPath(probe->device->name, &probe->pciPath);
+  probe->numaNode = ncclIbGetNumaNode(probe->pciPath);
+  return NULL;
+close:
+  if (ncclSuccess != wrap_ibv_close_device(probe->context)) probe->ret = ncclInternalError;
+  probe->context = NULL;
+  return NULL;
+}
+
 static int ibvWidths[] = { 1, 4, 8, 12, 2 };
 static int ibvSpeeds[] = {
   2500,  /* SDR */
@@ -598,7 +991,7 @@ static int ncclIbRelaxedOrderingCapable(void) {
 // Compare ncclIbDev[dev] to all stored mergedIbDevs
 int ncclIbFindMatchingDev(int dev) {
   for (int i = 0; i < ncclNMergedIbDevs; i++) {
-    if (ncclIbMergedDevs[i].ndevs < NCCL_IB_MAX_DEVS_PER_NIC) {
+    if (ncclIbMergedDevs[i].ndevs < ncclIbMergeWidth) {
       int compareDev = ncclIbMergedDevs[i].devs[0];
       if (strcmp(ncclIbDevs[dev].pciPath, ncclIbDevs[compareDev].pciPath) == 0 &&
           (ncclIbDevs[dev].guid == ncclIbDevs[compareDev].guid) &&
@@ -614,6 +1007,62 @@ int ncclIbFindMatchingDev(int dev) {
   return ncclNMergedIbDevs;
 }
 
+// Allocate the device tables for up to nPorts ports. Entries are cache line
+// aligned since the data path reads them from every proxy thread.
+static ncclResult_t ncclIbAllocDevTables(int nPorts) {
+  void* devs;
+  void* mergedDevs;
+  if (nPorts == 0) nPorts = 1;
+  if (posix_memalign(&devs, 64, nPorts*sizeof(struct ncclIbDev)) != 0) {
+    WARN("NET/IB : Failed to allocate the table of %d devices", nPorts);
+    return ncclSystemError;
+  }
+  if (posix_memalign(&mergedDevs, 64, nPorts*sizeof(struct ncclIbMergedDev)) != 0) {
+    free(devs);
+    WARN("NET/IB : Failed to allocate the table of %d merged devices", nPorts);
+    return ncclSystemError;
+  }
+  memset(devs, 0, nPorts*sizeof(struct ncclIbDev));
+  memset(mergedDevs, 0, nPorts*sizeof(struct ncclIbMergedDev));
+  ncclIbDevs = (struct ncclIbDev*)devs;
+  ncclIbMergedDevs = (struct ncclIbMergedDev*)mergedDevs;
+  return ncclSuccess;
+}
+
+// Group ncclIbDevs into merged devices. Only touches in-memory state, so init
+// can regroup without probing the hardware again.
+static void ncclIbBuildMergedDevs(int mergeNics) {
+  ncclNMergedIbDevs = 0;
+  memset(ncclIbMergedDevs, 0, ncclNIbDevs*sizeof(struct ncclIbMergedDev));
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    if (ncclIbDevs[d].excluded) continue;
+    int mergedDev = ncclNMergedIbDevs;
+    if (mergeNics) {
+      mergedDev = ncclIbFindMatchingDev(d);
+    }
+
+    // No matching dev found, create new mergedDev entry (it's okay if there's only one dev inside)
+    if (mergedDev == ncclNMergedIbDevs) {
+      // Set ndevs to 1, assign first ibDevN to the current IB device
+      ncclIbMergedDevs[mergedDev].ndevs = 1;
+      ncclIbMergedDevs[mergedDev].devs[0] = d;
+      ncclNMergedIbDevs++;
+      strncpy(ncclIbMergedDevs[mergedDev].devName, ncclIbDevs[d].devName, MAXNAMESIZE);
+    // Matching dev found, edit name
+    } else {
+      // Set next device in this array to the current IB device
+      int ndevs = ncclIbMergedDevs[mergedDev].ndevs;
+      ncclIbMergedDevs[mergedDev].devs[ndevs] = d;
+      ncclIbMergedDevs[mergedDev].ndevs++;
+      int len = strlen(ncclIbMergedDevs[mergedDev].devName);
+      snprintf(ncclIbMergedDevs[mergedDev].devName + len, MAX_MERGED_DEV_NAME - len, "+%s", ncclIbDevs[d].devName);
+    }
+
+    // Aggregate speed
+    ncclIbMergedDevs[mergedDev].speed += ncclIbDevs[d].speed;
+  }
+}
+
 int convert_hostname_to_ip(const char *hostname, char *ip_str, size_t ip_str_size) {
     struct addrinfo hints, *res, *p;
     int status;
@@ -743,13 +1192,18 @@ ncclResult_t anpNetInit(ncclDebugLogger_t logFunction) {
   //do_bootstrap();
   // register exit handler
 #ifdef ANP_TELEMETRY_ENABLED
+  static pthread_once_t tscOnce = PTHREAD_ONCE_INIT;
+  if (g_anp_state.level() >= ANP_TELEMETRY_SAMPLED) pthread_once(&tscOnce, anpTscCalibrate);
   std::atexit(wait_for_threads_before_exit);
+  anp_start_json_thread();
 #endif
   anp_register_signal_hdl();
 
   // Detect IB cards
   int nIbDevs = 0;
   struct ibv_device** devices = NULL;
+  struct ncclIbProbe* probes = NULL;
+  pthread_t* probeThreads = NULL;
 
   if (ncclNIbDevs == -1) {
     pthread_mutex_lock(&ncclIbLock);
@@ -766,43 +1220,52 @@ ncclResult_t anpNetInit(ncclDebugLogger_t logFunction) {
       // Check if user defined which IB device:port to use
       char* userIbEnv = getenv("NCCL_IB_HCA");
       if (userIbEnv != NULL && shownIbHcaEnv++ == 0) INFO(NCCL_NET|NCCL_ENV, "NCCL_IB_HCA set to %s", userIbEnv);
-      struct netIf userIfs[MAX_IB_DEVS];
+      struct netIf userIfs[MAX_IB_USER_IFS];
       bool searchNot = userIbEnv && userIbEnv[0] == '^';
       if (searchNot) userIbEnv++;
       bool searchExact = userIbEnv && userIbEnv[0] == '=';
       if (searchExact) userIbEnv++;
-      int nUserIfs = parseStringList(userIbEnv, userIfs, MAX_IB_DEVS);
+      int nUserIfs = parseStringList(userIbEnv, userIfs, MAX_IB_USER_IFS);
 
       if (ncclSuccess != wrap_ibv_get_device_list(&devices, &nIbDevs)) { ret = ncclInternalError; goto fail; }
 
-      // Should NCCL merge multi-port devices into one?
+      // Should NCCL merge multi-port devices into one, and how many ports at most?
       int mergeNics = ncclParamIbMergeNics();
+      ncclIbMergeWidth = ncclParamIbMergeWidth();
+      if (ncclIbMergeWidth < 1 || ncclIbMergeWidth > NCCL_IB_MAX_DEVS_PER_NIC) {
+        WARN("NET/IB : NCCL_IB_MERGE_WIDTH=%d out of range [1,%d], using %d", ncclIbMergeWidth, NCCL_IB_MAX_DEVS_PER_NIC, NCCL_IB_MAX_DEVS_PER_NIC);
+        ncclIbMergeWidth = NCCL_IB_MAX_DEVS_PER_NIC;
+      }
 
-build_ib_list:
-      for (int d=0; d<nIbDevs && ncclNIbDevs<MAX_IB_DEVS; d++) {
-        struct ibv_context * context;
-        if (ncclSuccess != wrap_ibv_open_device(&context, devices[d]) || context == NULL) {
-          WARN("NET/IB : Unable to open device %s", devices[d]->name);
-          continue;
+      // Open and query all devices concurrently
+      int nPortSlots = 0;
+      uint64_t probeStartNs = gettime_ns();
+      NCCLCHECKGOTO(ncclCalloc(&probes, nIbDevs), ret, fail);
+      NCCLCHECKGOTO(ncclCalloc(&probeThreads, nIbDevs), ret, fail);
+      for (int d=0; d<nIbDevs; d++) {
+        probes[d].device = devices[d];
+        probes[d].numaNode = -1;
+        if (pthread_create(probeThreads+d, NULL, ncclIbProbeDevice, probes+d) != 0) {
+          probeThreads[d] = 0;
+          ncclIbProbeDevice(probes+d);
         }
+      }
+      for (int d=0; d<nIbDevs; d++) {
+        if (probeThreads[d]) pthread_join(probeThreads[d], NULL);
+      }
+      for (int d=0; d<nIbDevs; d++) {
+        if (probes[d].ret != ncclSuccess) { ret = probes[d].ret; goto fail; }
+        if (probes[d].context) nPortSlots += probes[d].devAttr.phys_port_cnt;
+      }
+      NCCLCHECKGOTO(ncclIbAllocDevTables(nPortSlots), ret, fail);
+
+      for (int d=0; d<nIbDevs; d++) {
+        struct ibv_context * context = probes[d].context;
+        if (context == NULL) continue;
         int nPorts = 0;
-        struct ibv_device_attr devAttr;
-        memset(&devAttr, 0, sizeof(devAttr));
-        if (ncclSuccess != wrap_ibv_query_device(context, &devAttr)) {
-          WARN("NET/IB : Unable to query device %s", devices[d]->name);
-          if (ncclSuccess != wrap_ibv_close_device(context))
-          {
-            ret = ncclInternalError;
-            goto fail;
-          }
-          continue;
-        }
-        for (int port_num = 1; port_num <= devAttr.phys_port_cnt; port_num++) {
-          struct ibv_port_attr portAttr;
-          if (ncclSuccess != wrap_ibv_query_port(context, port_num, &portAttr)) {
-            WARN("NET/IB : Unable to query port_num %d", port_num);
-            continue;
-          }
+        struct ibv_device_attr* devAttr = &probes[d].devAttr;
+        for (int port_num = 1; port_num <= devAttr->phys_port_cnt; port_num++) {
+          struct ibv_port_attr portAttr = probes[d].portAttrs[port_num-1];
           if (portAttr.state != IBV_PORT_ACTIVE) continue;
           if (portAttr.link_layer != IBV_LINK_LAYER_INFINIBAND
               && portAttr.link_layer != IBV_LINK_LAYER_ETHERNET) continue;
@@ -813,75 +1276,77 @@ build_ib_list:
           }
           pthread_mutex_init(&ncclIbDevs[ncclNIbDevs].lock, NULL);
           ncclIbDevs[ncclNIbDevs].device = d;
-          ncclIbDevs[ncclNIbDevs].guid = devAttr.sys_image_guid;
+          ncclIbDevs[ncclNIbDevs].guid = devAttr->sys_image_guid;
           ncclIbDevs[ncclNIbDevs].portAttr = portAttr;
           ncclIbDevs[ncclNIbDevs].portNum = port_num;
           ncclIbDevs[ncclNIbDevs].link = portAttr.link_layer;
           ncclIbDevs[ncclNIbDevs].speed = ncclIbSpeed(portAttr.active_speed) * ncclIbWidth(portAttr.active_width);
+          ncclIbDevs[ncclNIbDevs].nominalSpeed = ncclIbDevs[ncclNIbDevs].speed;
           ncclIbDevs[ncclNIbDevs].context = context;
           ncclIbDevs[ncclNIbDevs].pdRefs = 0;
           ncclIbDevs[ncclNIbDevs].pd = NULL;
           strncpy(ncclIbDevs[ncclNIbDevs].devName, devices[d]->name, MAXNAMESIZE);
-          NCCLCHECK(ncclIbGetPciPath(ncclIbDevs[ncclNIbDevs].devName, &ncclIbDevs[ncclNIbDevs].pciPath, &ncclIbDevs[ncclNIbDevs].realPort));
-          ncclIbDevs[ncclNIbDevs].maxQp = devAttr.max_qp;
+          // Each port keeps its own copy of the path, as before
+          ncclIbDevs[ncclNIbDevs].pciPath = nPorts == 0 || probes[d].pciPath == NULL ? probes[d].pciPath : strdup(probes[d].pciPath);
+          // Keep the real port aside (the ibv port is always 1 on recent cards)
+          ncclIbDevs[ncclNIbDevs].realPort = 0;
+          for (int i=0; i<ncclNIbDevs && ncclIbDevs[ncclNIbDevs].pciPath; i++) {
+            if (ncclIbDevs[i].pciPath && strcmp(ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[i].pciPath) == 0) ncclIbDevs[ncclNIbDevs].realPort++;
+          }
+          ncclIbDevs[ncclNIbDevs].numaNode = probes[d].numaNode;
+          ncclIbDevs[ncclNIbDevs].maxQp = devAttr->max_qp;
           ncclIbDevs[ncclNIbDevs].mrCache.capacity = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.population = 0;
           ncclIbDevs[ncclNIbDevs].mrCache.slots = NULL;
+          ncclIbDevs[ncclNIbDevs].mrCache.idle = 0;
+          ncclIbDevs[ncclNIbDevs].qpPool = NULL;
+          ncclIbDevs[ncclNIbDevs].qpPoolSize = 0;
+          ncclIbDevs[ncclNIbDevs].gidValid = 0;
 
           // Enable ADAPTIVE_ROUTING by default on IB networks
           // But allow it to be overloaded by an env parameter
           ncclIbDevs[ncclNIbDevs].ar = (portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND) ? 1 : 0;
           if (ncclParamIbAdaptiveRouting() != -2) ncclIbDevs[ncclNIbDevs].ar = ncclParamIbAdaptiveRouting();
 
-          TRACE(NCCL_NET,"NET/IB: [%d] %s:%s:%d/%s speed=%d context=%p pciPath=%s ar=%d", d, devices[d]->name, devices[d]->dev_name, ncclIbDevs[ncclNIbDevs].portNum,
-              portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND ? "IB" : "RoCE", ncclIbDevs[ncclNIbDevs].speed, context, ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[ncclNIbDevs].ar);
-
-          pthread_create(&ncclIbAsyncThread, NULL, ncclIbAsyncThreadMain, ncclIbDevs + ncclNIbDevs);
-          ncclSetThreadName(ncclIbAsyncThread, "NCCL IbAsync %2d", ncclNIbDevs);
-          pthread_detach(ncclIbAsyncThread); // will not be pthread_join()'d
-
-          int mergedDev = ncclNMergedIbDevs;
-          if (mergeNics) {
-            mergedDev = ncclIbFindMatchingDev(ncclNIbDevs);
-          }
+          TRACE(NCCL_NET,"NET/IB: [%d] %s:%s:%d/%s speed=%d context=%p pciPath=%s numa=%d ar=%d", d, devices[d]->name, devices[d]->dev_name, ncclIbDevs[ncclNIbDevs].portNum,
+              portAttr.link_layer == IBV_LINK_LAYER_INFINIBAND ? "IB" : "RoCE", ncclIbDevs[ncclNIbDevs].speed, context, ncclIbDevs[ncclNIbDevs].pciPath, ncclIbDevs[ncclNIbDevs].numaNode, ncclIbDevs[ncclNIbDevs].ar);
 
-          // No matching dev found, create new mergedDev entry (it's okay if there's only one dev inside)
-          if (mergedDev == ncclNMergedIbDevs) {
-            // Set ndevs to 1, assign first ibDevN to the current IB device
-            ncclIbMergedDevs[mergedDev].ndevs = 1;
-            ncclIbMergedDevs[mergedDev].devs[0] = ncclNIbDevs;
-            ncclNMergedIbDevs++;
-            strncpy(ncclIbMergedDevs[mergedDev].devName, ncclIbDevs[ncclNIbDevs].devName, MAXNAMESIZE);
-          // Matching dev found, edit name
-          } else {
-            // Set next device in this array to the current IB device
-            int ndevs = ncclIbMergedDevs[mergedDev].ndevs;
-            ncclIbMergedDevs[mergedDev].devs[ndevs] = ncclNIbDevs;
-            ncclIbMergedDevs[mergedDev].ndevs++;
-            snprintf(ncclIbMergedDevs[mergedDev].devName + strlen(ncclIbMergedDevs[mergedDev].devName), MAXNAMESIZE+1, "+%s", ncclIbDevs[ncclNIbDevs].devName);
-          }
+          ncclIbDevs[ncclNIbDevs].portDown = 0;
+          ncclIbDevs[ncclNIbDevs].excluded = 0;
+          ncclIbDevs[ncclNIbDevs].loopbackState = NCCL_IB_LOOPBACK_UNTESTED;
+          ncclIbDevs[ncclNIbDevs].lastUd[0] = ncclIbDevs[ncclNIbDevs].lastUd[1] = false;
 
-          // Aggregate speed
-          ncclIbMergedDevs[mergedDev].speed += ncclIbDevs[ncclNIbDevs].speed;
           ncclNIbDevs++;
           nPorts++;
         }
-        if (nPorts == 0 && ncclSuccess != wrap_ibv_close_device(context)) { ret = ncclInternalError; goto fail; }
+        if (nPorts == 0) {
+          free(probes[d].pciPath);
+          if (ncclSuccess != wrap_ibv_close_device(context)) { ret = ncclInternalError; goto fail; }
+        }
       }
 
-      // Detect if there are both multi-port and single-port NICs in the system. If so, disable port merging and build the list again
+      if (ncclNIbDevs > 0) NCCLCHECKGOTO(ncclIbStartAsyncThread(), ret, fail);
+      if (ncclNIbDevs > 0 && ncclParamIbHealthCheck()) ncclIbHealthCheck();
+
+      // Merging requires all NICs to have the same number of ports. Group
+      // once with merging, and if that yields a mix of single and multi-port
+      // NICs fall back to one merged device per port, without re-probing.
+      ncclIbBuildMergedDevs(mergeNics);
       if (mergeNics) {
         for (int d = 0; d < ncclNMergedIbDevs; d++) {
           if (ncclIbMergedDevs[d].ndevs != ncclIbMergedDevs[0].ndevs) {
             INFO(NCCL_NET, "Detected a mix of single and multiple-port NICs. Force-disabling NCCL_IB_MERGE_NICS");
-            mergeNics = 0;
-            ncclNIbDevs = 0;
-            ncclNMergedIbDevs = 0;
-            memset(ncclIbMergedDevs, 0, sizeof(ncclIbMergedDevs));
-            goto build_ib_list;
+            ncclIbBuildMergedDevs(0);
+            break;
           }
         }
       }
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : Probed %d devices in %lu us", nIbDevs, (gettime_ns() - probeStartNs)/1000);
+      for (int d=0; d<nIbDevs; d++) free(probes[d].portAttrs);
+      free(probes);
+      free(probeThreads);
+      probes = NULL;
+      probeThreads = NULL;
       if (ncclSuccess != wrap_ibv_free_device_list(devices)) { ret = ncclInternalError; goto fail;}
     }
     if (ncclNIbDevs == 0) {
@@ -891,6 +1356,28 @@ build_ib_list:
       line[0] = '\0';
       // Determine whether RELAXED_ORDERING is enabled and possible
       ncclIbRelaxedOrderingEnabled = ncclIbRelaxedOrderingCapable();
+      if (ncclParamIbMrCacheInvalidate() && !ncclIbMrCacheLongLived) {
+        if (anpMrNotifierEnable() == 0) {
+          for (int d = 0; d < ncclNIbDevs; d++) ncclIbDevs[d].mrCache.notifierCursor = anpMrNotifierHead();
+          ncclIbMrCacheLongLived = 1;
+          INFO(NCCL_INIT|NCCL_NET, "NET/IB : MR cache invalidation on munmap/madvise enabled, keeping up to %ld idle MRs per device",
+               ncclParamIbMrCacheMaxIdle());
+        } else {
+          WARN("NET/IB : NCCL_IB_MR_CACHE_INVALIDATE needs the plugin preloaded (LD_PRELOAD) to intercept munmap/madvise, idle MRs will not be cached");
+        }
+      }
+      for (int d = 0; d < ncclNIbDevs; d++) {
+        int gidIndex;
+        union ibv_gid gid;
+        if (ncclIbDevs[d].excluded) continue;
+        if (ncclIbDevGetGid(d, &gidIndex, &gid) != ncclSuccess) {
+          WARN("NET/IB : Failed to resolve the GID of %s:%d, will retry at connection time", ncclIbDevs[d].devName, ncclIbDevs[d].portNum);
+        }
+        if (ncclIbQpPoolPrewarm(d) != ncclSuccess) {
+          WARN("NET/IB : Failed to pre-create QPs for %s, connections will create them", ncclIbDevs[d].devName);
+        }
+      }
+      if (ncclParamIbCalibrate()) ncclIbCalibrate();
       for (int d = 0; d < ncclNMergedIbDevs; d++) {
         struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + d;
         if (mergedDev->ndevs > 1) {
@@ -919,6 +1406,9 @@ build_ib_list:
   }
   return ncclSuccess;
 fail:
+  if (probes) for (int d=0; d<nIbDevs; d++) free(probes[d].portAttrs);
+  free(probes);
+  free(probeThreads);
   if(ncclSuccess != wrap_ibv_free_device_list(devices)){WARN("NET/IB : Unable to free device list");}
   pthread_mutex_unlock(&ncclIbLock);
   return ret;
@@ -957,7 +1447,7 @@ ncclResult_t anpNetGetProperties(int dev, ncclNetProperties_t* props) {
   // Implement logic to get properties of the specified device
   struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs+dev;
   props->name = mergedDev->devName;
-  props->speed = mergedDev->speed;
+  props->speed = mergedDev->measuredSpeed ? mergedDev->measuredSpeed : mergedDev->speed;
 
   // Take the rest of the properties from an arbitrary sub-device (should be the same)
   struct ncclIbDev* ibDev = ncclIbDevs + mergedDev->devs[0];
@@ -971,7 +1461,7 @@ ncclResult_t anpNetGetProperties(int dev, ncclNetProperties_t* props) {
   if (ncclIbDmaBufSupport(dev) == ncclSuccess) {
     props->ptrSupport |= NCCL_PTR_DMABUF; // GDR support via DMA-BUF
   }
-  props->latency = 0; // Not set
+  props->latency = mergedDev->latency; // 0 (not set) unless NCCL_IB_CALIBRATE
   props->port = ibDev->portNum + ibDev->realPort;
   props->maxComms = ibDev->maxQp;
   props->maxRecvs = NCCL_NET_IB_MAX_RECVS;
@@ -984,8 +1474,11 @@ ncclResult_t anpNetGetProperties(int dev, ncclNetProperties_t* props) {
 // We need to support NCCL_NET_MAX_REQUESTS for each concurrent receive
 #define MAX_REQUESTS (NCCL_NET_MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS)
 static_assert(MAX_REQUESTS <= 256, "request id are encoded in wr_id and we need up to 8 requests ids per completion");
+static_assert(MAX_REQUESTS <= ANP_MAX_INFLIGHT_WQES, "the telemetry WQE tracker is indexed by request id");
 
 #define NCCL_IB_MAX_QPS 128
+#define ANP_CQ_POLL_MAX_EVENT        16
+static_assert(ANP_CQ_POLL_MAX_EVENT <= ANP_MAX_CQ_POLL_BATCH, "the telemetry poll batch histogram must cover every batch size");
 
 // Per-QP connection metatdata
 struct ncclIbQpInfo {
@@ -1016,15 +1509,49 @@ struct ncclIbDevInfo {
   int ibv_dev_index;
 };
 
-// Struct containing everything needed to establish connections
+#define NCCL_IB_META_VERSION 2
+
+// Struct containing everything needed to establish connections.
+// Only the first nqps entries of qpInfo are sent, see ncclIbMetaSize()
 struct ncclIbConnectionMetadata {
-  struct ncclIbQpInfo qpInfo[NCCL_IB_MAX_QPS];
-  struct ncclIbDevInfo devs[NCCL_IB_MAX_DEVS_PER_NIC];
-  char devName[MAX_MERGED_DEV_NAME];
-  uint64_t fifoAddr;
+  uint32_t version;
   int ndevs;
+  int nqps;
+  uint64_t fifoAddr;
+  char devName[MAX_MERGED_DEV_NAME];
+  struct ncclIbDevInfo devs[NCCL_IB_MAX_DEVS_PER_NIC];
+  struct ncclIbQpInfo qpInfo[NCCL_IB_MAX_QPS];
 };
 
+#define NCCL_IB_META_HDR_SIZE ((int)offsetof(struct ncclIbConnectionMetadata, qpInfo))
+
+static inline int ncclIbMetaSize(int nqps) {
+  return NCCL_IB_META_HDR_SIZE + nqps*sizeof(struct ncclIbQpInfo);
+}
+
+static ncclResult_t ncclIbMetaCheck(struct ncclIbConnectionMetadata* meta) {
+  if (meta->version != NCCL_IB_META_VERSION) {
+    WARN("NET/IB : Connection metadata version %u from peer, expected %u. Mismatched plugin versions?", meta->version, NCCL_IB_META_VERSION);
+    return ncclInternalError;
+  }
+  if (meta->ndevs <= 0 || meta->ndevs > NCCL_IB_MAX_DEVS_PER_NIC || meta->nqps <= 0 || meta->nqps > NCCL_IB_MAX_QPS) {
+    WARN("NET/IB : Invalid connection metadata from peer, ndevs %d nqps %d", meta->ndevs, meta->nqps);
+    return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
+// Receive variable size metadata: the fixed part first, then the QP entries it announces
+static ncclResult_t ncclIbMetaRecv(struct ncclSocket* sock, struct ncclIbConnectionMetadata* meta, int* offset, int* done) {
+  *done = 0;
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, sock, meta, NCCL_IB_META_HDR_SIZE, offset));
+  if (*offset < NCCL_IB_META_HDR_SIZE) return ncclSuccess;
+  NCCLCHECK(ncclIbMetaCheck(meta));
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, sock, meta, ncclIbMetaSize(meta->nqps), offset));
+  *done = (*offset == ncclIbMetaSize(meta->nqps));
+  return ncclSuccess;
+}
+
 enum ncclIbCommState {
   ncclIbCommStateStart = 0,
   ncclIbCommStateConnect = 1,
@@ -1033,7 +1560,6 @@ enum ncclIbCommState {
   ncclIbCommStateRecv = 5,
   ncclIbCommStateConnecting = 6,
   ncclIbCommStateConnected = 7,
-  ncclIbCommStatePendingReady = 8,
 };
 
 struct ncclIbCommStage {
@@ -1041,6 +1567,8 @@ struct ncclIbCommStage {
   int offset;
   void* buffer;
   void* comm;
+  uint64_t startNs; // Connection setup time, for logging
+  int bytes;        // Bytes exchanged during connection setup, for logging
 };
 
 struct ncclIbHandle {
@@ -1066,8 +1594,8 @@ struct ncclIbRequest {
   struct ncclIbNetCommBase* base;
   int type;
   struct ncclSocket* sock;
-  int events[NCCL_IB_MAX_DEVS_PER_NIC];
-  struct ncclIbNetCommDevBase* devBases[NCCL_IB_MAX_DEVS_PER_NIC];
+  uint8_t events[NCCL_IB_MAX_DEVS_PER_NIC]; // Completions still expected from each device
+  uint8_t devMask; // Devices with events[] != 0
   int nreqs;
   union {
     struct {
@@ -1082,23 +1610,61 @@ struct ncclIbRequest {
   };
 };
 
+// Telemetry slots of the QPs sharing a CQ, looked up by the qp_num of a
+// completion. Open addressed on the low bits of qp_num; qp_num 0 is the SMI
+// QP and never ours, so it marks a free entry.
+#define NCCL_IB_QP_SLOT_TABLE 256
+static_assert(NCCL_IB_QP_SLOT_TABLE >= 2*NCCL_IB_MAX_QPS, "the slot table must hold every QP of a comm at half load");
+struct ncclIbQpSlotEntry {
+  uint32_t qpNum;
+  int telemetrySlot;
+};
+
 struct ncclIbNetCommDevBase {
   int ibDevN;
   struct ibv_pd* pd;
   struct ibv_cq* cq;
-  uint64_t pad[2];
+  struct ncclIbQpPoolEntry* qpPool; // QPs taken from the device pool, not handed out yet
+  int qpPoolKind;
+  int qpPoolNext;
+  int telemetryCqSlot;
+  struct ncclIbQpSlotEntry qpSlots[NCCL_IB_QP_SLOT_TABLE];
   struct ncclIbGidInfo gidInfo;
 };
 
+static void ncclIbQpSlotAdd(struct ncclIbNetCommDevBase* base, uint32_t qpNum, int telemetrySlot) {
+  for (int i = 0; i < NCCL_IB_QP_SLOT_TABLE; i++) {
+    struct ncclIbQpSlotEntry* entry = base->qpSlots + ((qpNum + i) & (NCCL_IB_QP_SLOT_TABLE-1));
+    if (entry->qpNum == 0 || entry->qpNum == qpNum) {
+      entry->qpNum = qpNum;
+      entry->telemetrySlot = telemetrySlot;
+      return;
+    }
+  }
+  // Not reached, the table is sized for every QP of a comm
+}
+
+static inline int ncclIbQpSlotFind(struct ncclIbNetCommDevBase* base, uint32_t qpNum) {
+  for (int i = 0; i < NCCL_IB_QP_SLOT_TABLE; i++) {
+    struct ncclIbQpSlotEntry* entry = base->qpSlots + ((qpNum + i) & (NCCL_IB_QP_SLOT_TABLE-1));
+    if (entry->qpNum == qpNum) return entry->telemetrySlot;
+    if (entry->qpNum == 0) return -1;
+  }
+  return -1;
+}
+
 struct ncclIbListenComm {
   int dev;
   struct ncclSocket sock;
   struct ncclIbCommStage stage;
 };
 
+// A CTS entry travels on one QP and the matching data is written on the
+// same QP, so it carries the rkey of the single port that QP lives on.
+// Merged ports are striped per message, by round-robin over the QPs.
 struct alignas(32) ncclIbSendFifo {
   uint64_t addr;
-  uint32_t rkeys[1];
+  uint32_t rkey;
   int      size;
   uint8_t  nreqs;
   uint16_t tag;
@@ -1111,6 +1677,7 @@ struct ncclIbQp {
   int devIndex;
   int remDevIdx;
   int8_t ctsQpSlot;
+  int telemetrySlot; // Index of the QP in the telemetry state, -1 if not tracked
 #ifdef ANP_DEBUG_TRACE_EN
   uint16_t channelId;
   uint8_t data;
@@ -1118,27 +1685,52 @@ struct ncclIbQp {
 };
 
 struct ncclIbRemSizesFifo {
-  int elems[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  int (*elems)[NCCL_NET_IB_MAX_RECVS]; // In the fifo block
   uint64_t fifoTail;
   uint64_t addr;
   uint32_t rkeys[NCCL_IB_MAX_DEVS_PER_NIC];
   uint32_t flags;
-  struct ibv_mr* mrs[NCCL_IB_MAX_DEVS_PER_NIC];
+  struct ibv_mr* mrs[NCCL_IB_MAX_DEVS_PER_NIC]; // Fifo block MRs, not owned
   struct ibv_sge sge;
 };
 
 // A per-dev struct for netIbSendComm
 struct alignas(8) ncclIbSendCommDev {
   struct ncclIbNetCommDevBase base;
-  struct ibv_mr* fifoMr;
+  struct ibv_mr* fifoMr; // Fifo block MR, not owned
 };
 
 
 // Wrapper to track an MR per-device, if needed
+// Handles are carved out of slabs and shared (refcounted) between
+// registrations of the same (addr, size) on the same set of devices.
 struct ncclIbMrHandle {
   ibv_mr* mrs[NCCL_IB_MAX_DEVS_PER_NIC];
+  uintptr_t addr;
+  size_t size;
+  int refs;
+  uint16_t ndevs;
+  uint16_t ibDevNs[NCCL_IB_MAX_DEVS_PER_NIC];
+  int linked; // In the hash, i.e. shared with new registrations of the same buffer
+  struct ncclIbMrHandle* next; // Hash bucket chain when in use, free list otherwise
+};
+
+#define NCCL_IB_MR_HANDLES_PER_SLAB 64
+#define NCCL_IB_MR_HANDLE_BUCKETS   256
+
+struct ncclIbMrHandleSlab {
+  struct ncclIbMrHandleSlab* next;
+  struct ncclIbMrHandle handles[NCCL_IB_MR_HANDLES_PER_SLAB];
 };
 
+struct ncclIbMrHandlePool {
+  pthread_mutex_t lock;
+  struct ncclIbMrHandle* freeList;
+  struct ncclIbMrHandleSlab* slabs;
+  struct ncclIbMrHandle* buckets[NCCL_IB_MR_HANDLE_BUCKETS];
+};
+static struct ncclIbMrHandlePool ncclIbMrHandlePool = { PTHREAD_MUTEX_INITIALIZER };
+
 struct alignas(32) ncclIbNetCommBase {
   int ndevs;
   bool isSend;
@@ -1149,6 +1741,7 @@ struct alignas(32) ncclIbNetCommBase {
   int devIndex;
   struct ncclSocket sock;
   int ready;
+  struct ncclIbNetCommDevBase* devBases[NCCL_IB_MAX_DEVS_PER_NIC]; // Per-dev bases of the send or recv comm
   // Track necessary remDevInfo here
   int nRemDevs;
   struct ncclIbDevInfo remDevs[NCCL_IB_MAX_DEVS_PER_NIC];
@@ -1156,7 +1749,6 @@ struct alignas(32) ncclIbNetCommBase {
 
 struct ncclIbSendComm {
   struct ncclIbNetCommBase base;
-  struct ncclIbSendFifo fifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
   // Each dev correlates to a mergedIbDev
   struct ncclIbSendCommDev devs[NCCL_IB_MAX_DEVS_PER_NIC];
   struct ncclIbRequest* fifoReqs[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
@@ -1165,13 +1757,16 @@ struct ncclIbSendComm {
   struct ncclIbRemSizesFifo remSizesFifo;
   uint64_t fifoHead;
   int ar; // Use adaptive routing when all merged devices have it enabled
+  struct ncclIbSendFifo (*fifo)[NCCL_NET_IB_MAX_RECVS]; // In the fifo block
+  struct ncclIbFifoSlab* fifoSlab;
+  struct ncclIbFifoBlock* fifoBlock;
 };
+static_assert((sizeof(struct ncclIbNetCommBase) % 32) == 0, "ncclIbNetCommBase size must be 32-byte multiple");
 // The SendFifo needs to be 32-byte aligned and each element needs
 // to be a 32-byte multiple, so that an entry does not get split and
 // written out of order when IB Relaxed Ordering is enabled
-static_assert((sizeof(struct ncclIbNetCommBase) % 32) == 0, "ncclIbNetCommBase size must be 32-byte multiple to ensure fifo is at proper offset");
-static_assert((offsetof(struct ncclIbSendComm, fifo) % 32) == 0, "ncclIbSendComm fifo must be 32-byte aligned");
 static_assert((sizeof(struct ncclIbSendFifo) % 32) == 0, "ncclIbSendFifo element size must be 32-byte multiples");
+static_assert(offsetof(struct ncclIbSendFifo, idx) + sizeof(uint32_t) <= MAX_INLINE_DATA_SIZE, "CTS entry must fit the inline data");
 static_assert((offsetof(struct ncclIbSendComm, sges) % 32) == 0, "sges must be 32-byte aligned");
 static_assert((offsetof(struct ncclIbSendComm, wrs) % 32) == 0, "wrs must be 32-byte aligned");
 
@@ -1184,7 +1779,7 @@ struct ncclIbGpuFlush {
 };
 
 struct ncclIbRemFifo {
-  struct ncclIbSendFifo elems[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  struct ncclIbSendFifo (*elems)[NCCL_NET_IB_MAX_RECVS]; // In the fifo block
   uint64_t fifoTail;
   uint64_t addr;
   uint32_t flags;
@@ -1194,30 +1789,91 @@ struct alignas(16) ncclIbRecvCommDev {
   struct ncclIbNetCommDevBase base;
   struct ncclIbGpuFlush gpuFlush;
   uint32_t fifoRkey;
-  struct ibv_mr* fifoMr;
+  struct ibv_mr* fifoMr;      // Fifo block MR, not owned
   struct ibv_sge fifoSge;
-  struct ibv_mr* sizesFifoMr;
+  struct ibv_mr* sizesFifoMr; // Fifo block MR, not owned
 };
 
 struct ncclIbRecvComm {
   struct ncclIbNetCommBase base;
   struct ncclIbRecvCommDev    devs[NCCL_IB_MAX_DEVS_PER_NIC];
   struct ncclIbRemFifo remFifo;
-  int sizesFifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
-  int gpuFlushHostMem;
+  int (*sizesFifo)[NCCL_NET_IB_MAX_RECVS]; // In the fifo block
   int flushEnabled;
+  struct ncclIbFifoSlab* fifoSlab;
+  struct ncclIbFifoBlock* fifoBlock;
 };
-static_assert((offsetof(struct ncclIbRecvComm, remFifo) % 32) == 0, "ncclIbRecvComm fifo must be 32-byte aligned");
+
+// Registered memory a connection needs for its fifos. Blocks are carved out of
+// per-NIC huge page slabs, so connections don't allocate and pin private fifo
+// memory. Each block is registered on its own, the first time it is handed
+// out, and keeps its MRs when it is reused. A peer's remote-write rkey then
+// only covers the block of its own connection, not those of the others
+// sharing the slab. By the time a block is reused, the QPs of its previous
+// connection are destroyed or reset, so that peer can no longer write to it.
+// Senders use fifo for incoming CTS and sizes to stage the sizes they write back,
+// receivers use fifo to stage outgoing CTS, sizes as the sizes fifo and flush
+// as the GPU flush read target.
+struct alignas(32) ncclIbFifoBlock {
+  struct ncclIbSendFifo fifo[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  int sizes[MAX_REQUESTS][NCCL_NET_IB_MAX_RECVS];
+  int flush;
+};
+static_assert((offsetof(struct ncclIbFifoBlock, fifo) % 32) == 0, "fifo must be 32-byte aligned");
+
+NCCL_PARAM(IbFifoSlabSize, "IB_FIFO_SLAB_SIZE", 4<<20);
+
+struct ncclIbFifoSlab {
+  struct ncclIbFifoBlock* blocks;
+  size_t size;
+  int nblocks;
+  int ndevs;
+  struct ibv_pd* pds[NCCL_IB_MAX_DEVS_PER_NIC];
+  struct ibv_mr* (*blockMrs)[NCCL_IB_MAX_DEVS_PER_NIC]; // Per block and device, NULL until first handed out
+  int* freeList;
+  int nfree;
+  struct ncclIbFifoSlab* next;
+};
+
+// Protects the slabs of all merged devices; only taken at connection setup and close
+static pthread_mutex_t ncclIbFifoLock = PTHREAD_MUTEX_INITIALIZER;
 
 NCCL_PARAM(IbQpsPerConn, "IB_QPS_PER_CONNECTION", 1);
+NCCL_PARAM(IbQpPoolSize, "IB_QP_POOL_SIZE", 64);
+NCCL_PARAM(IbQpPoolPrewarm, "IB_QP_POOL_PREWARM", 1);
 
-static void ncclIbAddEvent(struct ncclIbRequest* req, int devIndex, struct ncclIbNetCommDevBase* base) {
+// A CQ and the QPs a connection created on it, kept in INIT state once the
+// connection is closed so the next connection can skip creating them
+struct ncclIbQpPoolEntry {
+  struct ibv_cq* cq;
+  struct ibv_qp* qps[NCCL_IB_MAX_QPS];
+  int nqps;
+  int kind;
+  struct ncclIbQpPoolEntry* next;
+};
+
+// QPs are created with different attributes depending on whether they carry
+// data or CTS and on the udma they are bound to; only reuse a matching kind
+#define NCCL_IB_QP_POOL_KIND_DATA 0x2
+#define NCCL_IB_QP_POOL_KIND_UDMA_HIGH 0x1
+#define NCCL_IB_QP_POOL_KINDS 4
+
+static void ncclIbAddEvent(struct ncclIbRequest* req, int devIndex) {
   req->events[devIndex]++;
-  req->devBases[devIndex] = base;
+  req->devMask |= 1 << devIndex;
+}
+
+static void ncclIbDoneEvent(struct ncclIbRequest* req, int devIndex) {
+  if (--req->events[devIndex] == 0) req->devMask &= ~(1 << devIndex);
 }
 
-ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base) {
+ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base, int qpPoolKind) {
   base->ibDevN = ibDevN;
+  base->qpPool = NULL;
+  base->qpPoolKind = qpPoolKind;
+  base->qpPoolNext = 0;
+  base->telemetryCqSlot = -1;
+  memset(base->qpSlots, 0, sizeof(base->qpSlots));
   ncclIbDev* ibDev = ncclIbDevs + ibDevN;
   pthread_mutex_lock(&ibDev->lock);
   if (0 == ibDev->pdRefs++) {
@@ -1230,7 +1886,23 @@ ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base
     }
   }
   base->pd = ibDev->pd;
+  for (struct ncclIbQpPoolEntry** entry = &ibDev->qpPool; *entry; entry = &(*entry)->next) {
+    if ((*entry)->kind == qpPoolKind) {
+      base->qpPool = *entry;
+      *entry = base->qpPool->next;
+      ibDev->qpPoolSize--;
+      ibDev->pdRefs--; // The entry's PD reference, we hold our own
+      break;
+    }
+  }
   pthread_mutex_unlock(&ibDev->lock);
+  ANP_TELEMETRY_EXECUTE(
+      if (qpPoolKind >= 0) g_anp_state.update_qp_pool_metrics(ibDevN, base->qpPool != NULL);
+  );
+  if (base->qpPool) {
+    base->cq = base->qpPool->cq;
+    return ncclSuccess;
+  }
 
   // CQ is sized to accommodate the max SQ + RQ WQE completions. If each SQ WQE could be signaled, then,
   // for each QP, there can be 2*MAX_REQUESTS completions for SQ and MAX_REQUESTS completions for RQ.
@@ -1246,7 +1918,17 @@ ncclResult_t ncclIbInitCommDevBase(int ibDevN, struct ncclIbNetCommDevBase* base
 
 ncclResult_t ncclIbDestroyBase(struct ncclIbNetCommDevBase* base) {
   ncclResult_t res;
-  NCCLCHECK(wrap_ibv_destroy_cq(base->cq));
+  ANP_TELEMETRY_EXECUTE(
+      g_anp_state.remove_completion_queue(base->telemetryCqSlot);
+      base->telemetryCqSlot = -1;
+  );
+  if (base->qpPool) {
+    // Pooled QPs this connection never used
+    for (int q = base->qpPoolNext; q < base->qpPool->nqps; q++) NCCLCHECK(wrap_ibv_destroy_qp(base->qpPool->qps[q]));
+    free(base->qpPool);
+    base->qpPool = NULL;
+  }
+  if (base->cq) NCCLCHECK(wrap_ibv_destroy_cq(base->cq));
 
   pthread_mutex_lock(&ncclIbDevs[base->ibDevN].lock);
   if (0 == --ncclIbDevs[base->ibDevN].pdRefs) {
@@ -1258,51 +1940,157 @@ returning:
   return res;
 }
 
+// NIC side footprint of a connection, to help sizing how many peers fit on a NIC
+static void ncclIbLogCommFootprint(const char* type, int dev, struct ncclIbNetCommBase* base, int privateMrs) {
+  INFO(NCCL_NET, "NET/IB: %s comm on %s uses %d QPs, %d CQEs, %zu bytes of pooled fifo memory and %d private MRs",
+       type, ncclIbMergedDevs[dev].devName, base->nqps, base->ndevs*3*MAX_REQUESTS*(int)ncclParamIbQpsPerConn(),
+       sizeof(struct ncclIbFifoBlock), privateMrs);
+}
+
+static ncclResult_t ncclIbFifoSlabCreate(int dev, struct ncclIbFifoSlab** slabOut) {
+  struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + dev;
+  struct ncclIbFifoSlab* slab;
+  NCCLCHECK(ncclCalloc(&slab, 1));
+  // Whole huge pages, holding at least one block
+  slab->size = std::max((size_t)ncclParamIbFifoSlabSize(), sizeof(struct ncclIbFifoBlock));
+  slab->size = (slab->size + NCCL_IB_HUGE_PAGE_SIZE-1) & ~(NCCL_IB_HUGE_PAGE_SIZE-1);
+  slab->nblocks = slab->size / sizeof(struct ncclIbFifoBlock);
+  NCCLCHECK(ncclCalloc(&slab->freeList, slab->nblocks));
+  NCCLCHECK(ncclCalloc(&slab->blockMrs, slab->nblocks));
+  NCCLCHECK(ncclIbNumaAlloc((void**)&slab->blocks, slab->size, mergedDev->devs[0], true));
+  slab->ndevs = mergedDev->ndevs;
+  for (int i = 0; i < mergedDev->ndevs; i++) {
+    ncclIbDev* ibDev = ncclIbDevs + mergedDev->devs[i];
+    // Slabs are never released, keep the PD for good
+    pthread_mutex_lock(&ibDev->lock);
+    if (0 == ibDev->pdRefs++) {
+      ncclResult_t res;
+      NCCLCHECKGOTO(wrap_ibv_alloc_pd(&ibDev->pd, ibDev->context), res, failure);
+      if (0) {
+      failure:
+        ibDev->pdRefs--;
+        pthread_mutex_unlock(&ibDev->lock);
+        return res;
+      }
+    }
+    slab->pds[i] = ibDev->pd;
+    pthread_mutex_unlock(&ibDev->lock);
+  }
+  for (int b = 0; b < slab->nblocks; b++) slab->freeList[b] = slab->nblocks-1-b;
+  slab->nfree = slab->nblocks;
+  INFO(NCCL_NET, "NET/IB : Allocated fifo slab of %zu bytes (%d connections) on %s", slab->size, slab->nblocks, mergedDev->devName);
+  *slabOut = slab;
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbFifoAlloc(int dev, struct ncclIbFifoSlab** slabOut, struct ncclIbFifoBlock** blockOut) {
+  ncclResult_t res = ncclSuccess;
+  struct ncclIbFifoSlab* slab;
+  pthread_mutex_lock(&ncclIbFifoLock);
+  for (slab = ncclIbMergedDevs[dev].fifoSlabs; slab; slab = slab->next) {
+    if (slab->nfree) break;
+  }
+  if (slab == NULL) {
+    NCCLCHECKGOTO(ncclIbFifoSlabCreate(dev, &slab), res, returning);
+    slab->next = ncclIbMergedDevs[dev].fifoSlabs;
+    ncclIbMergedDevs[dev].fifoSlabs = slab;
+  }
+  {
+    int b = slab->freeList[slab->nfree-1];
+    for (int i = 0; i < slab->ndevs; i++) {
+      if (slab->blockMrs[b][i]) continue;
+      NCCLCHECKGOTO(wrap_ibv_reg_mr(slab->blockMrs[b]+i, slab->pds[i], slab->blocks+b, sizeof(struct ncclIbFifoBlock),
+                                    IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ), res, returning);
+    }
+    slab->nfree--;
+    *slabOut = slab;
+    *blockOut = slab->blocks + b;
+  }
+  // Stale CTS entries from a previous connection would look valid
+  memset(*blockOut, 0, sizeof(struct ncclIbFifoBlock));
+returning:
+  pthread_mutex_unlock(&ncclIbFifoLock);
+  return res;
+}
+
+// MR of a fifo block on device devIndex of its merged device
+static struct ibv_mr* ncclIbFifoMr(struct ncclIbFifoSlab* slab, struct ncclIbFifoBlock* block, int devIndex) {
+  return slab->blockMrs[block - slab->blocks][devIndex];
+}
+
+static void ncclIbFifoFree(struct ncclIbFifoSlab* slab, struct ncclIbFifoBlock* block) {
+  if (slab == NULL) return;
+  pthread_mutex_lock(&ncclIbFifoLock);
+  slab->freeList[slab->nfree++] = block - slab->blocks;
+  pthread_mutex_unlock(&ncclIbFifoLock);
+}
+
 typedef struct channel_ud_s_ {
     int channelId;
     bool ud_id;
     bool ud_allocated;
 } channel_ud_t;
-static channel_ud_t data_channel_ud[128];
-static bool data_last_ud[128];
-static channel_ud_t channel_ud[128];
-static bool last_ud[128];
+// Per-channel udma binding, CTS [0] and data [1]. Grown as channels show up.
+static channel_ud_t* channel_ud[2];
+static int channel_ud_size = 0;
+static pthread_mutex_t channel_ud_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ncclIbQpPoolKind(int ibDevN, int channelId, bool dataQP) {
+  int kind = dataQP ? NCCL_IB_QP_POOL_KIND_DATA : 0;
+  pthread_mutex_lock(&channel_ud_lock);
+  if (channelId >= channel_ud_size) {
+    int size = channel_ud_size ? channel_ud_size : 64;
+    while (size <= channelId) size *= 2;
+    for (int t = 0; t < 2; t++) {
+      channel_ud_t* ud = (channel_ud_t*)realloc(channel_ud[t], size*sizeof(channel_ud_t));
+      if (ud == NULL) {
+        // Keep going unbound to the high udma
+        WARN("NET/IB : Failed to grow the channel udma table to %d channels", size);
+        pthread_mutex_unlock(&channel_ud_lock);
+        return kind;
+      }
+      memset(ud+channel_ud_size, 0, (size-channel_ud_size)*sizeof(channel_ud_t));
+      channel_ud[t] = ud;
+    }
+    channel_ud_size = size;
+  }
+  channel_ud_t* ud = channel_ud[dataQP] + channelId;
+  bool* lastUd = ncclIbDevs[ibDevN].lastUd + dataQP;
+  if (!ud->ud_allocated) {
+    ud->ud_id = *lastUd;
+    *lastUd = !*lastUd;
+    ud->ud_allocated = true;
+  }
+  if (ud->ud_id) kind |= NCCL_IB_QP_POOL_KIND_UDMA_HIGH;
+  pthread_mutex_unlock(&channel_ud_lock);
+  return kind;
+}
 
-ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
-                            int access_flags, struct ncclIbQp* qp, int channelId,
-                            bool dataQP, int8_t qp_idx) {
+static ncclResult_t ncclIbInitQp(struct ibv_qp* qp, uint8_t ib_port, int access_flags) {
+  struct ibv_qp_attr qpAttr;
+  memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
+  qpAttr.qp_state = IBV_QPS_INIT;
+  qpAttr.pkey_index = ncclParamIbPkey();
+  qpAttr.port_num = ib_port;
+  qpAttr.qp_access_flags = access_flags;
+  NCCLCHECK(wrap_ibv_modify_qp(qp, &qpAttr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS));
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclIbCreateQpInternal(uint8_t ib_port, struct ibv_pd* pd, struct ibv_cq* cq,
+                                           int access_flags, int kind, struct ibv_qp** qp) {
   struct ibv_qp_init_attr qpInitAttr;
   memset(&qpInitAttr, 0, sizeof(struct ibv_qp_init_attr));
-  qpInitAttr.send_cq = base->cq;
-  qpInitAttr.recv_cq = base->cq;
+  qpInitAttr.send_cq = cq;
+  qpInitAttr.recv_cq = cq;
   qpInitAttr.qp_type = IBV_QPT_RC;
-  if (dataQP) {
-    if (!data_channel_ud[channelId].ud_allocated) {
-      bool lud = data_last_ud[base->ibDevN];
-      data_channel_ud[channelId].ud_id = lud;
-      data_last_ud[base->ibDevN] = !(data_last_ud[base->ibDevN]);
-      data_channel_ud[channelId].ud_allocated = true;
-    }
-    if (data_channel_ud[channelId].ud_id) {
-        wrap_ibv_pd_set_udma_mask(base->pd, IONIC_UDMA_MASK_HIGH);
-    } else {
-        wrap_ibv_pd_set_udma_mask(base->pd, IONIC_UDMA_MASK_LOW);
-    }
+  if (kind & NCCL_IB_QP_POOL_KIND_UDMA_HIGH) {
+      wrap_ibv_pd_set_udma_mask(pd, IONIC_UDMA_MASK_HIGH);
   } else {
-    if (!channel_ud[channelId].ud_allocated) {
-      bool lud = last_ud[base->ibDevN];
-      channel_ud[channelId].ud_id = lud;
-      last_ud[base->ibDevN] = !(last_ud[base->ibDevN]);
-      channel_ud[channelId].ud_allocated = true;
-    }
-    if (channel_ud[channelId].ud_id) {
-        wrap_ibv_pd_set_udma_mask(base->pd, IONIC_UDMA_MASK_HIGH);
-    } else {
-        wrap_ibv_pd_set_udma_mask(base->pd, IONIC_UDMA_MASK_LOW);
-    }
+      wrap_ibv_pd_set_udma_mask(pd, IONIC_UDMA_MASK_LOW);
   }
   qpInitAttr.sq_sig_all |= (1 << 16);
-  if (dataQP) {
+  if (kind & NCCL_IB_QP_POOL_KIND_DATA) {
     qpInitAttr.sq_sig_all |= (1 << 17);
   } else {
     qpInitAttr.sq_sig_all &= (~(1 << 17));
@@ -1323,20 +2111,40 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
 #else
   qpInitAttr.cap.max_inline_data = ncclParamIbUseInline() ? sizeof(struct ncclIbSendFifo) : 0;
 #endif
-  NCCLCHECK(wrap_ibv_create_qp(&qp->qp, base->pd, &qpInitAttr));
-  ANP_TELEMETRY_EXECUTE(
-      g_anp_state.add_queue_pair(base->ibDevN, channelId, qp->qp->qp_num, dataQP);
-  );
-  wrap_ionic_dv_qp_set_gda(qp->qp, false, true);
-  struct ibv_qp_attr qpAttr;
-  memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
-  qpAttr.qp_state = IBV_QPS_INIT;
-  qpAttr.pkey_index = ncclParamIbPkey();
-  qpAttr.port_num = ib_port;
-  qpAttr.qp_access_flags = access_flags;
-  NCCLCHECK(wrap_ibv_modify_qp(qp->qp, &qpAttr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS));
+  NCCLCHECK(wrap_ibv_create_qp(qp, pd, &qpInitAttr));
+  wrap_ionic_dv_qp_set_gda(*qp, false, true);
+  NCCLCHECK(ncclIbInitQp(*qp, ib_port, access_flags));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
+                            int access_flags, struct ncclIbQp* qp, int channelId,
+                            bool dataQP, int8_t qp_idx) {
+  int kind = ncclIbQpPoolKind(base->ibDevN, channelId, dataQP);
+  struct ncclIbQpPoolEntry* entry = base->qpPool;
+  if (entry && kind == base->qpPoolKind && access_flags == IBV_ACCESS_REMOTE_WRITE && base->qpPoolNext < entry->nqps) {
+    // Recycled QP, already in INIT state
+    qp->qp = entry->qps[base->qpPoolNext++];
+    if (base->qpPoolNext == entry->nqps) {
+      free(entry);
+      base->qpPool = NULL;
+    }
+  } else {
+    NCCLCHECK(ncclIbCreateQpInternal(ib_port, base->pd, base->cq, access_flags, kind, &qp->qp));
+  }
+  qp->telemetrySlot = -1;
   ANP_TELEMETRY_EXECUTE(
-      anp_create_json_thread();
+      qp->telemetrySlot = g_anp_state.add_queue_pair(base->ibDevN, channelId, qp->qp->qp_num, dataQP);
+      ncclIbQpSlotAdd(base, qp->qp->qp_num, qp->telemetrySlot);
+      // The CQ is accounted to the channel of its first QP
+      if (base->telemetryCqSlot < 0) {
+        base->telemetryCqSlot = g_anp_state.add_completion_queue(base->ibDevN, channelId, ANP_CQ_POLL_MAX_EVENT);
+      }
+      static int shownUntracked = 0;
+      if ((qp->telemetrySlot < 0 || base->telemetryCqSlot < 0) && __atomic_exchange_n(&shownUntracked, 1, __ATOMIC_RELAXED) == 0) {
+        WARN("NET/IB : telemetry can't track %s of %s, further untracked queues are not reported",
+             qp->telemetrySlot < 0 ? "a QP" : "the CQ", ncclIbDevs[base->ibDevN].devName);
+      }
   );
   if (dataQP == false) {
     qp->ctsQpSlot = qp_idx;
@@ -1353,6 +2161,113 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbNetCommDevBase* base,
   return ncclSuccess;
 }
 
+static ncclResult_t ncclIbQpPoolPush(int ibDevN, struct ncclIbQpPoolEntry* entry, int* pushed) {
+  ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  pthread_mutex_lock(&ibDev->lock);
+  *pushed = ibDev->qpPoolSize < ncclParamIbQpPoolSize();
+  if (*pushed) {
+    entry->next = ibDev->qpPool;
+    ibDev->qpPool = entry;
+    ibDev->qpPoolSize++;
+    ibDev->pdRefs++; // Keep the PD alive while its QPs are pooled
+  }
+  pthread_mutex_unlock(&ibDev->lock);
+  return ncclSuccess;
+}
+
+// Give the telemetry slots of a closing connection's QPs back for reuse. The
+// connection no longer posts nor polls, whether its QPs are pooled or destroyed.
+static void ncclIbReleaseQpTelemetry(struct ncclIbQp* qp) {
+  if (qp->qp == NULL) return;
+  ANP_TELEMETRY_EXECUTE(
+      g_anp_state.remove_queue_pair(qp->telemetrySlot);
+  );
+  qp->telemetrySlot = -1;
+}
+
+// Move the QPs a closing connection used on this device back to INIT and keep
+// them, together with their CQ, for the next connection. Whatever is not taken
+// by the pool is left for the caller to destroy.
+static ncclResult_t ncclIbQpPoolPut(struct ncclIbNetCommBase* comm, int devIndex, struct ncclIbNetCommDevBase* base) {
+  ncclIbDev* ibDev = ncclIbDevs + base->ibDevN;
+  struct ncclIbQpPoolEntry* entry;
+  struct ibv_qp_attr qpAttr;
+  struct ibv_wc wcs[ANP_CQ_POLL_MAX_EVENT];
+  int done, pushed;
+  if (base->qpPool || base->cq == NULL || ncclParamIbQpPoolSize() <= 0) return ncclSuccess;
+  pthread_mutex_lock(&ibDev->lock);
+  int full = ibDev->qpPoolSize >= ncclParamIbQpPoolSize();
+  pthread_mutex_unlock(&ibDev->lock);
+  if (full) return ncclSuccess;
+
+  NCCLCHECK(ncclCalloc(&entry, 1));
+  memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
+  qpAttr.qp_state = IBV_QPS_RESET;
+  for (int q = 0; q < comm->nqps; q++) {
+    struct ncclIbQp* qp = comm->qps + q;
+    if (qp->devIndex != devIndex) continue;
+    // Moving to RESET drops any outstanding WQEs and the remote QP number
+    if (qp->qp == NULL ||
+        wrap_ibv_modify_qp(qp->qp, &qpAttr, IBV_QP_STATE) != ncclSuccess ||
+        ncclIbInitQp(qp->qp, ibDev->portNum, IBV_ACCESS_REMOTE_WRITE) != ncclSuccess) {
+      free(entry);
+      return ncclSuccess;
+    }
+    entry->qps[entry->nqps++] = qp->qp;
+  }
+  // Discard completions of the previous connection
+  do {
+    NCCLCHECK(wrap_ibv_poll_cq(base->cq, ANP_CQ_POLL_MAX_EVENT, wcs, &done));
+  } while (done > 0);
+
+  entry->cq = base->cq;
+  entry->kind = base->qpPoolKind;
+  NCCLCHECK(ncclIbQpPoolPush(base->ibDevN, entry, &pushed));
+  if (!pushed) {
+    free(entry);
+    return ncclSuccess;
+  }
+  for (int q = 0; q < comm->nqps; q++) {
+    if (comm->qps[q].devIndex == devIndex) comm->qps[q].qp = NULL;
+  }
+  base->cq = NULL;
+  return ncclSuccess;
+}
+
+// Fill the QP pool of a device ahead of the first connections
+static ncclResult_t ncclIbQpPoolPrewarm(int ibDevN) {
+  ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  struct ncclIbNetCommDevBase base;
+  int nqps = ncclParamIbQpsPerConn();
+  if (ncclParamIbQpPoolSize() <= 0 || nqps > NCCL_IB_MAX_QPS) return ncclSuccess;
+  for (int n = 0; n < ncclParamIbQpPoolPrewarm(); n++) {
+    for (int kind = 0; kind < NCCL_IB_QP_POOL_KINDS; kind++) {
+      struct ncclIbQpPoolEntry* entry;
+      int pushed;
+      // Take a PD reference the same way connections do, skipping the pool lookup
+      NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &base, -1));
+      NCCLCHECK(ncclCalloc(&entry, 1));
+      entry->cq = base.cq;
+      entry->kind = kind;
+      for (int q = 0; q < nqps; q++) {
+        NCCLCHECK(ncclIbCreateQpInternal(ibDev->portNum, base.pd, base.cq, IBV_ACCESS_REMOTE_WRITE, kind, entry->qps+q));
+        entry->nqps++;
+      }
+      NCCLCHECK(ncclIbQpPoolPush(ibDevN, entry, &pushed));
+      if (!pushed) {
+        for (int q = 0; q < entry->nqps; q++) NCCLCHECK(wrap_ibv_destroy_qp(entry->qps[q]));
+        free(entry);
+        NCCLCHECK(ncclIbDestroyBase(&base));
+        return ncclSuccess;
+      }
+      // The pool now owns the CQ; drop the base's PD reference
+      base.cq = NULL;
+      NCCLCHECK(ncclIbDestroyBase(&base));
+    }
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbRtrQp(struct ibv_qp* qp, struct ncclIbGidInfo* sGidInfo, uint32_t dest_qp_num, struct ncclIbDevInfo* info, bool override_tc) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
@@ -1415,6 +2330,396 @@ ncclResult_t ncclIbRtsQp(struct ibv_qp* qp) {
   return ncclSuccess;
 }
 
+// Optional init time calibration. Each port runs RDMA writes over a QP
+// connected to itself (like the GPU flush QP): one small write at a time for
+// latency, then a window of large writes for bandwidth. Results are cached
+// per node so only the first job after a hardware change pays for it.
+NCCL_PARAM(IbCalibrateBudgetMs, "IB_CALIBRATE_BUDGET_MS", 200);
+NCCL_PARAM(IbCalibrateCacheTtl, "IB_CALIBRATE_CACHE_TTL", 3600);
+
+#define NCCL_IB_CALIB_LAT_SIZE 8
+#define NCCL_IB_CALIB_LAT_ITERS 1000
+#define NCCL_IB_CALIB_BW_SIZE (1<<20)
+#define NCCL_IB_CALIB_BW_DEPTH 16
+#define NCCL_IB_CALIB_KEY_SIZE 1024
+
+// Wait for at least one completion, or until the deadline passes
+static ncclResult_t ncclIbCalibratePoll(struct ibv_cq* cq, int* done, uint64_t deadline) {
+  struct ibv_wc wcs[ANP_CQ_POLL_MAX_EVENT];
+  do {
+    NCCLCHECK(wrap_ibv_poll_cq(cq, ANP_CQ_POLL_MAX_EVENT, wcs, done));
+    for (int w = 0; w < *done; w++) {
+      if (wcs[w].status != IBV_WC_SUCCESS) {
+        INFO(NCCL_NET, "NET/IB : Calibration write completed with status %d vendor err %d", wcs[w].status, wcs[w].vendor_err);
+        return ncclSystemError;
+      }
+    }
+  } while (*done == 0 && gettime_ns() < deadline);
+  return ncclSuccess;
+}
+
+// Sets latency (us) and speed (Mbps) of one port, or leaves them 0 if the
+// budget ran out before any write completed.
+static ncclResult_t ncclIbCalibrateDev(int ibDevN, uint64_t budgetNs, float* latency, int* speed) {
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  struct ncclIbNetCommDevBase base;
+  struct ncclIbGidInfo gidInfo;
+  struct ncclIbDevInfo devInfo;
+  struct ibv_qp* qp = NULL;
+  struct ibv_mr* mr = NULL;
+  char* buf = NULL;
+  struct ibv_sge sge;
+  struct ibv_send_wr wr, *bad_wr;
+  uint64_t start, last, deadline, bytes = 0;
+  int iters = 0, inflight = 0, done;
+  ncclResult_t res = ncclSuccess;
+  *latency = 0;
+  *speed = 0;
+
+  NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &base, -1));
+  NCCLCHECKGOTO(ncclIbNumaAlloc((void**)&buf, 2*NCCL_IB_CALIB_BW_SIZE, ibDevN, true), res, returning);
+  NCCLCHECKGOTO(wrap_ibv_reg_mr(&mr, base.pd, buf, 2*NCCL_IB_CALIB_BW_SIZE, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE), res, returning);
+  NCCLCHECKGOTO(ncclIbCreateQpInternal(ibDev->portNum, base.pd, base.cq, IBV_ACCESS_REMOTE_WRITE, NCCL_IB_QP_POOL_KIND_DATA, &qp), res, returning);
+  gidInfo.link_layer = ibDev->portAttr.link_layer;
+  NCCLCHECKGOTO(ncclIbDevGetGid(ibDevN, &gidInfo.localGidIndex, &gidInfo.localGid), res, returning);
+  memset(&devInfo, 0, sizeof(devInfo));
+  devInfo.lid        = ibDev->portAttr.lid;
+  devInfo.link_layer = ibDev->portAttr.link_layer;
+  devInfo.ib_port    = ibDev->portNum;
+  devInfo.gid        = gidInfo.localGid;
+  devInfo.mtu        = ibDev->portAttr.active_mtu;
+  NCCLCHECKGOTO(ncclIbRtrQp(qp, &gidInfo, qp->qp_num, &devInfo, false), res, returning);
+  NCCLCHECKGOTO(ncclIbRtsQp(qp), res, returning);
+
+  // Write from the first half of the buffer to the second
+  memset(&wr, 0, sizeof(wr));
+  sge.addr = (uintptr_t)buf;
+  sge.lkey = mr->lkey;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.wr.rdma.remote_addr = (uintptr_t)(buf + NCCL_IB_CALIB_BW_SIZE);
+  wr.wr.rdma.rkey = mr->rkey;
+
+  // Latency, first half of the budget
+  sge.length = NCCL_IB_CALIB_LAT_SIZE;
+  start = gettime_ns();
+  deadline = start + budgetNs/2;
+  while (iters < NCCL_IB_CALIB_LAT_ITERS && gettime_ns() < deadline) {
+    NCCLCHECKGOTO(wrap_ibv_post_send(qp, &wr, &bad_wr), res, returning);
+    inflight++;
+    NCCLCHECKGOTO(ncclIbCalibratePoll(base.cq, &done, deadline), res, returning);
+    if (done == 0) goto returning;
+    inflight--;
+    iters++;
+  }
+  if (iters == 0) goto returning;
+  // A write completes when its ack is back, so this is half a round trip
+  *latency = (gettime_ns() - start) / 2000.0 / iters;
+
+  // Bandwidth, second half of the budget
+  sge.length = NCCL_IB_CALIB_BW_SIZE;
+  start = last = gettime_ns();
+  deadline = start + budgetNs/2;
+  while (gettime_ns() < deadline) {
+    while (inflight < NCCL_IB_CALIB_BW_DEPTH) {
+      NCCLCHECKGOTO(wrap_ibv_post_send(qp, &wr, &bad_wr), res, returning);
+      inflight++;
+    }
+    NCCLCHECKGOTO(ncclIbCalibratePoll(base.cq, &done, deadline), res, returning);
+    if (done) last = gettime_ns();
+    inflight -= done;
+    bytes += (uint64_t)done*NCCL_IB_CALIB_BW_SIZE;
+  }
+  // bits per ns is Gbps
+  if (last > start) *speed = bytes*8*1000 / (last - start);
+
+returning:
+  // Writes still in flight are flushed when the QP is destroyed
+  if (qp) wrap_ibv_destroy_qp(qp);
+  if (mr) wrap_ibv_dereg_mr(mr);
+  ncclIbNumaFree(buf, 2*NCCL_IB_CALIB_BW_SIZE);
+  ncclIbDestroyBase(&base);
+  if (*speed == 0) *latency = 0;
+  return res;
+}
+
+// Loopback test of a port, run at most once per process. With both
+// NCCL_IB_HEALTH_CHECK and NCCL_IB_CALIBRATE set, the calibration reuses
+// what the self-test measured.
+static int ncclIbLoopbackTest(int ibDevN, uint64_t budgetNs) {
+  struct ncclIbDev* ibDev = ncclIbDevs + ibDevN;
+  if (ibDev->loopbackState == NCCL_IB_LOOPBACK_UNTESTED) {
+    if (ncclIbCalibrateDev(ibDevN, budgetNs, &ibDev->loopbackLatency, &ibDev->loopbackSpeed) != ncclSuccess) {
+      ibDev->loopbackLatency = 0;
+      ibDev->loopbackSpeed = 0;
+      ibDev->loopbackState = NCCL_IB_LOOPBACK_FAILED;
+    } else {
+      ibDev->loopbackState = ibDev->loopbackSpeed ? NCCL_IB_LOOPBACK_PASSED : NCCL_IB_LOOPBACK_TIMEOUT;
+    }
+  }
+  return ibDev->loopbackState;
+}
+
+// Identifies the hardware behind a port, so a cached result is not reused
+// after a NIC, firmware link speed or MTU change. Uses the link speed, not
+// the one the self-test may have lowered.
+static void ncclIbPortKey(struct ncclIbDev* ibDev, char* key, int len) {
+  snprintf(key, len, "%s:%d:0x%lx:%d:%d", ibDev->devName, ibDev->portNum,
+           ibDev->guid, ibDev->nominalSpeed, ibDev->portAttr.active_mtu);
+}
+
+static void ncclIbCalibrateKey(int dev, char* key, int len) {
+  struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + dev;
+  key[0] = '\0';
+  for (int i = 0; i < mergedDev->ndevs; i++) {
+    if (i) snprintf(key+strlen(key), len-strlen(key), "+");
+    ncclIbPortKey(ncclIbDevs + mergedDev->devs[i], key+strlen(key), len-strlen(key));
+  }
+}
+
+// Self-test results share the file, keyed by "health:<port key>"
+static void ncclIbHealthKey(int ibDevN, char* key, int len) {
+  snprintf(key, len, "health:");
+  ncclIbPortKey(ncclIbDevs + ibDevN, key+strlen(key), len-strlen(key));
+}
+
+// Calibration lines are "<key> <time> <latency us> <speed Mbps>", self-test
+// lines "<key> <time> <latency us> <speed Mbps> <loopback state> <new errors>"
+static int ncclIbCalibrateCacheLoad(const char* path, const char* key, float* latency, int* speed) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return 0;
+  char line[NCCL_IB_CALIB_KEY_SIZE+64];
+  char lineKey[NCCL_IB_CALIB_KEY_SIZE];
+  long time;
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%1023s %ld %f %d", lineKey, &time, latency, speed) == 4 && strcmp(lineKey, key) == 0 &&
+        std::time(nullptr) - time < ncclParamIbCalibrateCacheTtl() && *speed > 0) found = 1;
+  }
+  fclose(file);
+  return found;
+}
+
+static int ncclIbHealthCacheLoad(const char* path, const char* key, struct ncclIbDev* ibDev, uint64_t* errors) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return 0;
+  char line[NCCL_IB_CALIB_KEY_SIZE+64];
+  char lineKey[NCCL_IB_CALIB_KEY_SIZE];
+  long time;
+  float latency;
+  int speed, state;
+  unsigned long lineErrors;
+  int found = 0;
+  while (!found && fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%1023s %ld %f %d %d %lu", lineKey, &time, &latency, &speed, &state, &lineErrors) == 6 &&
+        strcmp(lineKey, key) == 0 && std::time(nullptr) - time < ncclParamIbCalibrateCacheTtl() &&
+        state > NCCL_IB_LOOPBACK_UNTESTED && state <= NCCL_IB_LOOPBACK_TIMEOUT) found = 1;
+  }
+  fclose(file);
+  if (found) {
+    ibDev->loopbackState = state;
+    ibDev->loopbackLatency = latency;
+    ibDev->loopbackSpeed = speed;
+    *errors = lineErrors;
+  }
+  return found;
+}
+
+// value is what follows the time on the line
+static void ncclIbCalibrateCacheStore(const char* path, const char* key, const char* value) {
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, PATH_MAX, "%s.tmp.%d", path, getpid());
+  FILE* out = fopen(tmpPath, "w");
+  if (out == NULL) {
+    INFO(NCCL_NET, "NET/IB : Unable to write calibration cache %s : %s", tmpPath, strerror(errno));
+    return;
+  }
+  FILE* in = fopen(path, "r");
+  if (in) {
+    // Keep the entries of other devices
+    char line[NCCL_IB_CALIB_KEY_SIZE+64];
+    char lineKey[NCCL_IB_CALIB_KEY_SIZE];
+    while (fgets(line, sizeof(line), in)) {
+      if (sscanf(line, "%1023s", lineKey) == 1 && strcmp(lineKey, key) != 0) fputs(line, out);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %ld %s\n", key, (long)std::time(nullptr), value);
+  fclose(out);
+  if (rename(tmpPath, path) != 0) unlink(tmpPath);
+}
+
+static const char* ncclIbCalibrateCachePath(void) {
+  const char* path = getenv("NCCL_IB_CALIBRATE_CACHE");
+  return path == NULL || strlen(path) == 0 ? "/tmp/anp_ib_calibration.cache" : path;
+}
+
+// Loopback tests of ranks sharing the node would skew each other, so they
+// take turns. Returns the fd to close to release the lock, or -1.
+static int ncclIbCalibrateLock(void) {
+  char lockPath[PATH_MAX];
+  snprintf(lockPath, PATH_MAX, "%s.lock", ncclIbCalibrateCachePath());
+  int lockFd = open(lockPath, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+  if (lockFd >= 0) flock(lockFd, LOCK_EX);
+  return lockFd;
+}
+
+static void ncclIbCalibrate(void) {
+  const char* path = ncclIbCalibrateCachePath();
+  // All ranks but the first find the results in the cache
+  int lockFd = ncclIbCalibrateLock();
+
+  uint64_t budgetNs = ncclParamIbCalibrateBudgetMs()*1000000ULL / ncclNIbDevs;
+  for (int d = 0; d < ncclNMergedIbDevs; d++) {
+    struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + d;
+    char key[NCCL_IB_CALIB_KEY_SIZE];
+    ncclIbCalibrateKey(d, key, sizeof(key));
+    if (ncclIbCalibrateCacheLoad(path, key, &mergedDev->latency, &mergedDev->measuredSpeed)) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s calibrated latency %.2f us speed %d Mbps (cached)",
+           mergedDev->devName, mergedDev->latency, mergedDev->measuredSpeed);
+      continue;
+    }
+    float latency = 0;
+    int speed = 0;
+    for (int i = 0; i < mergedDev->ndevs; i++) {
+      struct ncclIbDev* ibDev = ncclIbDevs + mergedDev->devs[i];
+      if (ncclIbLoopbackTest(mergedDev->devs[i], budgetNs) != NCCL_IB_LOOPBACK_PASSED) {
+        speed = 0;
+        break;
+      }
+      latency = ibDev->loopbackLatency > latency ? ibDev->loopbackLatency : latency;
+      speed += ibDev->loopbackSpeed;
+    }
+    if (speed == 0) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s calibration failed or did not complete within budget, using nominal speed", mergedDev->devName);
+      mergedDev->latency = 0;
+      mergedDev->measuredSpeed = 0;
+      continue;
+    }
+    // Loopback does not cross the link, so it can only show a slower rail
+    mergedDev->latency = latency;
+    mergedDev->measuredSpeed = speed < mergedDev->speed ? speed : mergedDev->speed;
+    INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s calibrated latency %.2f us speed %d Mbps (nominal %d Mbps)",
+         mergedDev->devName, mergedDev->latency, mergedDev->measuredSpeed, mergedDev->speed);
+    char value[64];
+    snprintf(value, sizeof(value), "%f %d", mergedDev->latency, mergedDev->measuredSpeed);
+    ncclIbCalibrateCacheStore(path, key, value);
+  }
+  if (lockFd >= 0) close(lockFd);
+}
+
+// Init self-test of every port, to keep a NIC that trained down or is
+// taking errors from slowing down the whole job. NCCL_IB_HEALTH_CHECK=1
+// lowers the speed reported for failing ports, 2 excludes them.
+NCCL_PARAM(IbHealthMinSpeedPct, "IB_HEALTH_MIN_SPEED_PCT", 90);
+NCCL_PARAM(IbHealthMaxErrors, "IB_HEALTH_MAX_ERRORS", 0);
+
+static const char* ncclIbPortErrorCounters[] = {
+  "symbol_error", "port_rcv_errors", "port_xmit_discards", "link_error_recovery",
+  "link_downed", "local_link_integrity_errors", "excessive_buffer_overrun_errors" };
+
+// Sum of the port error counters the driver exposes, missing ones count as 0
+static uint64_t ncclIbPortErrors(struct ncclIbDev* ibDev) {
+  uint64_t errors = 0;
+  for (int c = 0; c < sizeof(ncclIbPortErrorCounters)/sizeof(ncclIbPortErrorCounters[0]); c++) {
+    char path[PATH_MAX];
+    char str[32] = { 0 };
+    snprintf(path, PATH_MAX, "/sys/class/infiniband/%s/ports/%d/counters/%s", ibDev->devName, ibDev->portNum, ncclIbPortErrorCounters[c]);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) continue;
+    int ret = read(fd, str, sizeof(str)-1);
+    close(fd);
+    if (ret > 0) errors += strtoull(str, NULL, 10);
+  }
+  return errors;
+}
+
+static void ncclIbHealthCheck(void) {
+  std::vector<int> measured(ncclNIbDevs);
+  std::vector<int> states(ncclNIbDevs);
+  std::vector<uint64_t> errors(ncclNIbDevs);
+  std::vector<const char*> reasons(ncclNIbDevs);
+  std::vector<int> cached(ncclNIbDevs);
+  int bestSpeed = 0, bestMeasured = 0, nFailed = 0;
+  uint64_t budgetNs = ncclParamIbCalibrateBudgetMs()*1000000ULL / ncclNIbDevs;
+  const char* path = ncclIbCalibrateCachePath();
+
+  // All ranks but the first find the results in the cache, so they all
+  // reach the same verdict
+  int lockFd = ncclIbCalibrateLock();
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    char key[NCCL_IB_CALIB_KEY_SIZE];
+    ncclIbHealthKey(d, key, sizeof(key));
+    cached[d] = ncclIbHealthCacheLoad(path, key, ncclIbDevs+d, &errors[d]);
+    if (cached[d]) {
+      states[d] = ncclIbDevs[d].loopbackState;
+    } else {
+      uint64_t before = ncclIbPortErrors(ncclIbDevs+d);
+      states[d] = ncclIbLoopbackTest(d, budgetNs);
+      errors[d] = ncclIbPortErrors(ncclIbDevs+d) - before;
+      char value[96];
+      snprintf(value, sizeof(value), "%f %d %d %lu", ncclIbDevs[d].loopbackLatency, ncclIbDevs[d].loopbackSpeed,
+               states[d], errors[d]);
+      ncclIbCalibrateCacheStore(path, key, value);
+    }
+    measured[d] = ncclIbDevs[d].loopbackSpeed;
+    if (ncclIbDevs[d].speed > bestSpeed) bestSpeed = ncclIbDevs[d].speed;
+    if (measured[d] > bestMeasured) bestMeasured = measured[d];
+  }
+  if (lockFd >= 0) close(lockFd);
+
+  // Ports are compared to the best one, which is taken as healthy. A port
+  // whose loopback test ran out of budget is not judged on it.
+  int64_t pct = ncclParamIbHealthMinSpeedPct();
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + d;
+    reasons[d] = NULL;
+    if ((int64_t)ibDev->speed*100 < bestSpeed*pct) reasons[d] = "link speed below other ports";
+    else if (states[d] == NCCL_IB_LOOPBACK_FAILED) reasons[d] = "loopback test failed";
+    else if (states[d] == NCCL_IB_LOOPBACK_PASSED && (int64_t)measured[d]*100 < bestMeasured*pct) reasons[d] = "loopback bandwidth below other ports";
+    else if (errors[d] > (uint64_t)ncclParamIbHealthMaxErrors()) reasons[d] = "error counters increased";
+    if (reasons[d]) nFailed++;
+  }
+  int exclude = ncclParamIbHealthCheck() == 2;
+  if (exclude && nFailed == ncclNIbDevs) {
+    WARN("NET/IB : All ports failed the self-test, keeping them all");
+    exclude = 0;
+  }
+
+  for (int d = 0; d < ncclNIbDevs; d++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + d;
+    int nominal = ibDev->speed;
+    const char* status = "healthy";
+    if (reasons[d] && exclude) {
+      ibDev->excluded = 1;
+      status = "excluded";
+    } else if (reasons[d]) {
+      // Scale to the bandwidth measured relative to the best port, halve if taking errors
+      if (measured[d] && bestMeasured && measured[d] < bestMeasured) ibDev->speed = (int64_t)ibDev->speed*measured[d]/bestMeasured;
+      if (errors[d] > (uint64_t)ncclParamIbHealthMaxErrors()) ibDev->speed /= 2;
+      status = "degraded";
+    }
+    const char* fromCache = cached[d] ? " (cached)" : "";
+    if (reasons[d]) {
+      WARN("NET/IB : %s:%d %s (%s) : speed %d Mbps, loopback %d Mbps, %lu new errors%s",
+           ibDev->devName, ibDev->portNum, status, reasons[d], nominal, measured[d], errors[d], fromCache);
+    } else if (states[d] == NCCL_IB_LOOPBACK_TIMEOUT) {
+      status = "not tested";
+      reasons[d] = "loopback test did not complete within budget";
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s:%d not tested (%s) : speed %d Mbps, %lu new errors%s",
+           ibDev->devName, ibDev->portNum, reasons[d], nominal, errors[d], fromCache);
+    } else {
+      INFO(NCCL_INIT|NCCL_NET, "NET/IB : %s:%d healthy : speed %d Mbps, loopback %d Mbps, %lu new errors%s",
+           ibDev->devName, ibDev->portNum, nominal, measured[d], errors[d], fromCache);
+    }
+    ANP_TELEMETRY_EXECUTE(g_anp_state.record_device_health(d, ibDev->devName, ibDev->portNum, nominal,
+                                                           measured[d], ibDev->speed, errors[d], status,
+                                                           reasons[d] ? reasons[d] : ""));
+  }
+}
+
 ncclResult_t anpNetListen(int dev, void* opaqueHandle, void** listenComm) {
   // Implement listening logic
   struct ncclIbListenComm* comm;
@@ -1431,6 +2736,20 @@ ncclResult_t anpNetListen(int dev, void* opaqueHandle, void** listenComm) {
   return ncclSuccess;
 }
 
+// Refuse new connections on a port the async thread saw go down: the QPs
+// would reach RTS but every transfer would time out after retries.
+static ncclResult_t ncclIbCheckPortsUp(int dev) {
+  struct ncclIbMergedDev* mergedDev = ncclIbMergedDevs + dev;
+  for (int i = 0; i < mergedDev->ndevs; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + mergedDev->devs[i];
+    if (ibDev->portDown) {
+      WARN("NET/IB : %s:%d is down, cannot connect over %s", ibDev->devName, ibDev->portNum, mergedDev->devName);
+      return ncclSystemError;
+    }
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t anpNetConnect(int dev, void* opaqueHandle, void** sendComm, ncclNetDeviceHandle_t** chId) {
   struct ncclIbHandle* handle = (struct ncclIbHandle*) opaqueHandle;
   struct ncclIbCommStage* stage = &handle->stage;
@@ -1448,19 +2767,17 @@ ncclResult_t anpNetConnect(int dev, void* opaqueHandle, void** sendComm, ncclNet
     WARN("Error: trying to connect already connected sendComm");
     return ncclInternalError;
   }
+  NCCLCHECK(ncclIbCheckPortsUp(dev));
 
-  NCCLCHECK(ncclIbMalloc((void**)&comm, sizeof(struct ncclIbSendComm)));
+  NCCLCHECK(ncclIbNumaAlloc((void**)&comm, sizeof(struct ncclIbSendComm), ncclIbMergedDevs[dev].devs[0], false));
   NCCLCHECK(ncclSocketInit(&comm->base.sock, &handle->connectAddr, handle->magic, ncclSocketTypeNetIb, NULL, 1));
   stage->comm = comm;
   stage->state = ncclIbCommStateConnect;
+  stage->startNs = gettime_ns();
+  stage->bytes = 0;
   NCCLCHECK(ncclSocketConnect(&comm->base.sock));
 
-ib_connect_check:
-  /* since ncclSocketConnect is async, we must check if connection is complete */
-  NCCLCHECK(ncclSocketReady(&comm->base.sock, &ready));
-  if (!ready) return ncclSuccess;
-
-  // IB Setup
+  // IB Setup, done while the socket connection is being established
   struct ncclIbMergedDev* mergedDev;
   mergedDev = ncclIbMergedDevs + dev;
   comm->base.ndevs = mergedDev->ndevs;
@@ -1474,12 +2791,19 @@ ib_connect_check:
   comm->ar = 1; // Set to 1 for logic
   for (int i = 0; i < mergedDev->ndevs; i++) {
     int ibDevN = mergedDev->devs[i];
-    NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &comm->devs[i].base));
+    NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &comm->devs[i].base, ncclIbQpPoolKind(ibDevN, channelId, true)));
+    comm->base.devBases[i] = &comm->devs[i].base;
     comm->ar = comm->ar && ncclIbDevs[dev].ar; // ADAPTIVE_ROUTING - if all merged devs have it enabled
   }
+  NCCLCHECK(ncclIbFifoAlloc(dev, &comm->fifoSlab, &comm->fifoBlock));
+  comm->fifo = comm->fifoBlock->fifo;
+  comm->remSizesFifo.elems = comm->fifoBlock->sizes;
 
   struct ncclIbConnectionMetadata meta;
+  memset(&meta, 0, sizeof(meta));
+  meta.version = NCCL_IB_META_VERSION;
   meta.ndevs = comm->base.ndevs;
+  meta.nqps = comm->base.nqps;
 
   // Alternate QPs between devices
   int devIndex;
@@ -1511,15 +2835,15 @@ ib_connect_check:
     devInfo->mtu           = ibDev->portAttr.active_mtu;
     devInfo->lid           = ibDev->portAttr.lid;
     devInfo->ibv_dev_index = commDev->base.ibDevN;
-    // Prepare my fifo
-    NCCLCHECK(wrap_ibv_reg_mr(&commDev->fifoMr, commDev->base.pd, comm->fifo, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
+    // My fifo and the staging buffer for the remote sizes fifo live in the fifo block
+    commDev->fifoMr = ncclIbFifoMr(comm->fifoSlab, comm->fifoBlock, i);
     devInfo->fifoRkey = commDev->fifoMr->rkey;
+    comm->remSizesFifo.mrs[i] = commDev->fifoMr;
 
     // Pack local GID info
     devInfo->link_layer = commDev->base.gidInfo.link_layer = ibDev->portAttr.link_layer;
     if (devInfo->link_layer == IBV_LINK_LAYER_ETHERNET) {
-      NCCLCHECK(ncclIbGetGidIndex(ibDev->context, ibDev->portNum, &ibDev->portAttr, &commDev->base.gidInfo.localGidIndex));
-      NCCLCHECK(wrap_ibv_query_gid(ibDev->context, ibDev->portNum, commDev->base.gidInfo.localGidIndex, &commDev->base.gidInfo.localGid));
+      NCCLCHECK(ncclIbDevGetGid(commDev->base.ibDevN, &commDev->base.gidInfo.localGidIndex, &commDev->base.gidInfo.localGid));
       devInfo->gid.global.subnet_prefix = commDev->base.gidInfo.localGid.global.subnet_prefix;
       devInfo->gid.global.interface_id = commDev->base.gidInfo.localGid.global.interface_id;
     }
@@ -1548,27 +2872,42 @@ ib_connect_check:
   meta.fifoAddr = (uint64_t)comm->fifo;
   strncpy(meta.devName, mergedDev->devName, MAX_MERGED_DEV_NAME);
 
-  stage->state = ncclIbCommStateSend;
   stage->offset = 0;
   NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(meta)));
 
   memcpy(stage->buffer, &meta, sizeof(meta));
 
+ib_connect_check:
+  /* since ncclSocketConnect is async, we must check if connection is complete */
+  NCCLCHECK(ncclSocketReady(&comm->base.sock, &ready));
+  if (!ready) return ncclSuccess;
+  stage->state = ncclIbCommStateSend;
+
 ib_send:
-  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &comm->base.sock, stage->buffer, sizeof(meta), &stage->offset));
-  if (stage->offset != sizeof(meta)) return ncclSuccess;
+  int metaSize;
+  metaSize = ncclIbMetaSize(((struct ncclIbConnectionMetadata*)stage->buffer)->nqps);
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &comm->base.sock, stage->buffer, metaSize, &stage->offset));
+  if (stage->offset != metaSize) return ncclSuccess;
 
+  stage->bytes += metaSize;
   stage->state = ncclIbCommStateConnecting;
   stage->offset = 0;
   // Clear the staging buffer for re-use
-  memset(stage->buffer, 0, sizeof(meta));
+  memset(stage->buffer, 0, sizeof(struct ncclIbConnectionMetadata));
 
 ib_connect:
   struct ncclIbConnectionMetadata remMeta;
-  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, &comm->base.sock, stage->buffer, sizeof(ncclIbConnectionMetadata), &stage->offset));
-  if (stage->offset != sizeof(remMeta)) return ncclSuccess;
-
-  memcpy(&remMeta, stage->buffer, sizeof(ncclIbConnectionMetadata));
+  int received;
+  NCCLCHECK(ncclIbMetaRecv(&comm->base.sock, (struct ncclIbConnectionMetadata*)stage->buffer, &stage->offset, &received));
+  if (!received) return ncclSuccess;
+
+  stage->bytes += stage->offset;
+  memcpy(&remMeta, stage->buffer, stage->offset);
+  if (remMeta.nqps != comm->base.nqps) {
+    WARN("NET/IB : Local mergedDev=%s uses %d QPs but remoteDev=%s uses %d, NCCL_IB_QPS_PER_CONNECTION must match",
+      ncclIbMergedDevs[dev].devName, comm->base.nqps, remMeta.devName, remMeta.nqps);
+    return ncclInternalError;
+  }
 
   comm->base.nRemDevs = remMeta.ndevs;
   if (comm->base.nRemDevs != comm->base.ndevs) {
@@ -1597,9 +2936,6 @@ ib_connect:
     comm->remSizesFifo.addr = remMeta.fifoAddr;
   }
 
-  for (int i=0; i < comm->base.ndevs; i++) {
-    NCCLCHECK(wrap_ibv_reg_mr(comm->remSizesFifo.mrs+i, comm->devs[i].base.pd, &comm->remSizesFifo.elems, sizeof(int)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ));
-  }
   comm->base.nRemDevs = remMeta.ndevs;
 
   for (int q = 0; q < comm->base.nqps; q++) {
@@ -1641,12 +2977,18 @@ ib_connect:
   stage->offset = 0;
 
 ib_send_ready:
+  // One way notification that our QPs are up; the receiver checks it lazily on its first irecv
   NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &comm->base.sock, &comm->base.ready, sizeof(int), &stage->offset));
   if (stage->offset != sizeof(int)) return ncclSuccess;
 
+  stage->bytes += sizeof(int);
+  INFO(NCCL_NET, "NET/IB: Connected to %s in %lu us, %d handshake bytes (%d with fixed size metadata)",
+    ncclIbMergedDevs[dev].devName, (gettime_ns() - stage->startNs)/1000, stage->bytes,
+    (int)(2*sizeof(struct ncclIbConnectionMetadata) + 2*sizeof(int)));
   free(stage->buffer);
   stage->state = ncclIbCommStateStart;
 
+  ncclIbLogCommFootprint("Send", dev, &comm->base, 0);
   *sendComm = comm;
   return ncclSuccess;
 }
@@ -1667,35 +3009,12 @@ ncclResult_t anpNetAccept(void* listenComm, void** recvComm, ncclNetDeviceHandle
   if (stage->state == ncclIbCommStateAccept) goto ib_accept_check;
   if (stage->state == ncclIbCommStateRecv) goto ib_recv;
   if (stage->state == ncclIbCommStateSend) goto ib_send;
-  if (stage->state == ncclIbCommStatePendingReady) goto ib_recv_ready;
   if (stage->state != ncclIbCommStateStart) {
     WARN("Listencomm in unknown state %d", stage->state);
     return ncclInternalError;
   }
+  NCCLCHECK(ncclIbCheckPortsUp(lComm->dev));
 
-  NCCLCHECK(ncclIbMalloc((void**)&rComm, sizeof(struct ncclIbRecvComm)));
-  stage->comm = rComm;
-  stage->state = ncclIbCommStateAccept;
-  NCCLCHECK(ncclSocketInit(&rComm->base.sock));
-  NCCLCHECK(ncclSocketAccept(&rComm->base.sock, &lComm->sock));
-
-ib_accept_check:
-  NCCLCHECK(ncclSocketReady(&rComm->base.sock, &ready));
-  if (!ready) return ncclSuccess;
-
-  struct ncclIbConnectionMetadata remMeta;
-  stage->state = ncclIbCommStateRecv;
-  stage->offset = 0;
-  NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(remMeta)));
-
-ib_recv:
-  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, &rComm->base.sock, stage->buffer, sizeof(remMeta), &stage->offset));
-  if (stage->offset != sizeof(remMeta)) return ncclSuccess;
-
-  /* copy back the received info */
-  memcpy(&remMeta, stage->buffer, sizeof(struct ncclIbConnectionMetadata));
-
-  // IB setup
   // Pre-declare variables because of goto
   struct ncclIbMergedDev* mergedDev;
   struct ncclIbDev* ibDev;
@@ -1703,87 +3022,64 @@ ib_recv:
   struct ncclIbRecvCommDev* rCommDev;
   struct ncclIbDevInfo* remDevInfo;
   struct ncclIbQp* qp;
+  struct ncclIbConnectionMetadata* meta;
+  struct ncclIbConnectionMetadata* remMeta;
+
+  NCCLCHECK(ncclIbNumaAlloc((void**)&rComm, sizeof(struct ncclIbRecvComm), ncclIbMergedDevs[lComm->dev].devs[0], false));
+  stage->comm = rComm;
+  stage->state = ncclIbCommStateAccept;
+  stage->startNs = gettime_ns();
+  stage->bytes = 0;
+  NCCLCHECK(ncclSocketInit(&rComm->base.sock));
+  NCCLCHECK(ncclSocketAccept(&rComm->base.sock, &lComm->sock));
+
+  // Everything that doesn't depend on the remote side is set up while the socket
+  // handshake is in flight. The stage buffer holds our metadata followed by the remote one.
+  NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, 2*sizeof(struct ncclIbConnectionMetadata)));
+  meta = (struct ncclIbConnectionMetadata*)stage->buffer;
 
   mergedDev = ncclIbMergedDevs + lComm->dev;
   rComm->base.ndevs = mergedDev->ndevs;
   rComm->base.nqps  = ncclParamIbQpsPerConn() * rComm->base.ndevs; // We must have at least 1 qp per-device
   rComm->base.isSend = false;
 
-  rComm->base.nRemDevs = remMeta.ndevs;
-  if (rComm->base.nRemDevs != rComm->base.ndevs) {
-    WARN("NET/IB : Local mergedDev %s has a different number of devices=%d as remote %s %d",
-      mergedDev->devName, rComm->base.ndevs, remMeta.devName, rComm->base.nRemDevs);
-  }
-
-  // Metadata to send back to requestor (sender)
-  struct ncclIbConnectionMetadata meta;
   for (int i = 0; i < rComm->base.ndevs; i++) {
     rCommDev = rComm->devs + i;
     ibDevN = mergedDev->devs[i];
-    NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &rCommDev->base));
+    NCCLCHECK(ncclIbInitCommDevBase(ibDevN, &rCommDev->base, ncclIbQpPoolKind(ibDevN, channelId, false)));
+    rComm->base.devBases[i] = &rCommDev->base;
     ibDev = ncclIbDevs + ibDevN;
-    NCCLCHECK(ncclIbGetGidIndex(ibDev->context, ibDev->portNum, &ibDev->portAttr, &rCommDev->base.gidInfo.localGidIndex));
-    NCCLCHECK(wrap_ibv_query_gid(ibDev->context, ibDev->portNum, rCommDev->base.gidInfo.localGidIndex, &rCommDev->base.gidInfo.localGid));
-  }
-
-  // Copy remDevInfo for things like remGidInfo, remFifoAddr, etc.
-  for (int i = 0; i < remMeta.ndevs; i++) {
-    rComm->base.remDevs[i] = remMeta.devs[i];
-    rComm->base.remDevs[i].remoteGid.global.interface_id  = rComm->base.remDevs[i].gid.global.interface_id;
-    rComm->base.remDevs[i].remoteGid.global.subnet_prefix = rComm->base.remDevs[i].gid.global.subnet_prefix;
+    NCCLCHECK(ncclIbDevGetGid(ibDevN, &rCommDev->base.gidInfo.localGidIndex, &rCommDev->base.gidInfo.localGid));
   }
 
   // Stripe QP creation across merged devs
-  // Make sure to get correct remote peer dev and QP info
-  int remDevIndex;
   int devIndex;
   devIndex = 0;
   for (int q = 0; q < rComm->base.nqps; q++) {
-    remDevIndex = remMeta.qpInfo[q].devIndex;
-    remDevInfo = remMeta.devs + remDevIndex;
     qp = rComm->base.qps+q;
     rCommDev = rComm->devs + devIndex;
-    qp->remDevIdx = remDevIndex;
-
-    // Local ibDevN
-    ibDevN = rComm->devs[devIndex].base.ibDevN;
-    ibDev = ncclIbDevs + ibDevN;
+    ibDev = ncclIbDevs + rCommDev->base.ibDevN;
     NCCLCHECK(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_REMOTE_WRITE, qp, channelId, false, q));
     qp->devIndex = devIndex;
+    meta->qpInfo[q].qpn      = qp->qp->qp_num;
+    meta->qpInfo[q].devIndex = devIndex;
     devIndex = (devIndex + 1) % rComm->base.ndevs;
-
-    // Set the ece (enhanced connection establishment) on this QP before RTR
-    if (remMeta.qpInfo[q].ece_supported) {
-      NCCLCHECK(wrap_ibv_set_ece(qp->qp, &remMeta.qpInfo[q].ece, &meta.qpInfo[q].ece_supported));
-
-      // Query the reduced ece for this QP (matching enhancements between the requestor and the responder)
-      // Store this in our own qpInfo for returning to the requestor
-      if (meta.qpInfo[q].ece_supported)
-        NCCLCHECK(wrap_ibv_query_ece(qp->qp, &meta.qpInfo[q].ece, &meta.qpInfo[q].ece_supported));
-    }
-
-    bool override_tc = (q == 0) ? true : false;
-    NCCLCHECK(ncclIbRtrQp(qp->qp, &rCommDev->base.gidInfo, remMeta.qpInfo[q].qpn, remDevInfo, override_tc));
-    NCCLCHECK(ncclIbRtsQp(qp->qp));
-#ifdef ANP_DEBUG_TRACE_EN
-    INFO(NCCL_NET, "[ANP_TRACE] recvcomm %p, ch %d, %s qp %d, local nic %d, peer nic %d",
-         rComm, qp->channelId, qp->data ? "data" : "cts", qp->qp->qp_num,
-         ibDevN, rComm->base.remDevs[qp->remDevIdx].ibv_dev_index);
-#endif
   }
 
   rComm->flushEnabled = ((ncclIbGdrSupport() == ncclSuccess || ncclIbDmaBufSupport(lComm->dev) == ncclSuccess)
                             && (ncclParamIbGdrFlushDisable() == 0)) ? 1 : 0;
 
+  NCCLCHECK(ncclIbFifoAlloc(lComm->dev, &rComm->fifoSlab, &rComm->fifoBlock));
+  rComm->remFifo.elems = rComm->fifoBlock->fifo;
+  rComm->sizesFifo = rComm->fifoBlock->sizes;
+
   for (int i = 0; i < mergedDev->ndevs; i++) {
     rCommDev = rComm->devs + i;
     ibDevN = rCommDev->base.ibDevN;
     ibDev = ncclIbDevs + ibDevN;
 
-    // Retain remote fifo info and prepare my RDMA ops
-    rCommDev->fifoRkey = remMeta.devs[i].fifoRkey;
-    rComm->remFifo.addr = remMeta.fifoAddr;
-    NCCLCHECK(wrap_ibv_reg_mr(&rCommDev->fifoMr, rCommDev->base.pd, &rComm->remFifo.elems, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_READ));
+    // Prepare my RDMA ops for the remote fifo
+    rCommDev->fifoMr = ncclIbFifoMr(rComm->fifoSlab, rComm->fifoBlock, i);
     rCommDev->fifoSge.lkey = rCommDev->fifoMr->lkey;
     if (ncclParamIbUseInline()) rComm->remFifo.flags = IBV_SEND_INLINE;
 
@@ -1800,8 +3096,8 @@ ib_recv:
         rCommDev->gpuFlush.gpuFlushGpuMem = nullptr;
         rCommDev->gpuFlush.gpuMr = nullptr;
       }
-      NCCLCHECK(wrap_ibv_reg_mr(&rCommDev->gpuFlush.hostMr, rCommDev->base.pd, &rComm->gpuFlushHostMem, sizeof(int), IBV_ACCESS_LOCAL_WRITE));
-      rCommDev->gpuFlush.sge.addr = (uint64_t)&rComm->gpuFlushHostMem;
+      rCommDev->gpuFlush.hostMr = rCommDev->fifoMr;
+      rCommDev->gpuFlush.sge.addr = (uint64_t)&rComm->fifoBlock->flush;
       rCommDev->gpuFlush.sge.length = 1;
       rCommDev->gpuFlush.sge.lkey = rCommDev->gpuFlush.hostMr->lkey;
       NCCLCHECK(ncclIbCreateQp(ibDev->portNum, &rCommDev->base, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE, &rCommDev->gpuFlush.qp, channelId, true, 0xFF));
@@ -1817,49 +3113,116 @@ ib_recv:
     }
 
     // Fill Handle
-    meta.devs[i].lid        = ibDev->portAttr.lid;
-    meta.devs[i].link_layer = rCommDev->base.gidInfo.link_layer = ibDev->portAttr.link_layer;
-    meta.devs[i].ib_port    = ibDev->portNum;
-    meta.devs[i].gid.global.subnet_prefix       = rCommDev->base.gidInfo.localGid.global.subnet_prefix;
-    meta.devs[i].gid.global.interface_id        = rCommDev->base.gidInfo.localGid.global.interface_id;
-    meta.devs[i].ibv_dev_index                  = rCommDev->base.ibDevN;
-
-    // Adjust the MTU
-    remMeta.devs[i].mtu    = (enum ibv_mtu) std::min(remMeta.devs[i].mtu, ibDev->portAttr.active_mtu);
-    meta.devs[i].mtu      = remMeta.devs[i].mtu;
+    meta->devs[i].lid        = ibDev->portAttr.lid;
+    meta->devs[i].link_layer = rCommDev->base.gidInfo.link_layer = ibDev->portAttr.link_layer;
+    meta->devs[i].ib_port    = ibDev->portNum;
+    meta->devs[i].gid.global.subnet_prefix       = rCommDev->base.gidInfo.localGid.global.subnet_prefix;
+    meta->devs[i].gid.global.interface_id        = rCommDev->base.gidInfo.localGid.global.interface_id;
+    meta->devs[i].ibv_dev_index                  = rCommDev->base.ibDevN;
+    meta->devs[i].mtu                            = ibDev->portAttr.active_mtu;
 
     // Prepare sizes fifo
-    NCCLCHECK(wrap_ibv_reg_mr(&rComm->devs[i].sizesFifoMr, rComm->devs[i].base.pd, rComm->sizesFifo, sizeof(int)*MAX_REQUESTS*NCCL_NET_IB_MAX_RECVS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
-    meta.devs[i].fifoRkey = rComm->devs[i].sizesFifoMr->rkey;
+    rComm->devs[i].sizesFifoMr = rCommDev->fifoMr;
+    meta->devs[i].fifoRkey = rComm->devs[i].sizesFifoMr->rkey;
   }
-  meta.fifoAddr = (uint64_t)rComm->sizesFifo;
+  meta->fifoAddr = (uint64_t)rComm->sizesFifo;
+  meta->version = NCCL_IB_META_VERSION;
+  meta->ndevs = rComm->base.ndevs;
+  meta->nqps = rComm->base.nqps;
+  strncpy(meta->devName, mergedDev->devName, MAX_MERGED_DEV_NAME);
 
-  for (int q = 0; q < rComm->base.nqps; q++) {
-    meta.qpInfo[q].qpn      = rComm->base.qps[q].qp->qp_num;
-    meta.qpInfo[q].devIndex = rComm->base.qps[q].devIndex;
+ib_accept_check:
+  NCCLCHECK(ncclSocketReady(&rComm->base.sock, &ready));
+  if (!ready) return ncclSuccess;
+
+  stage->state = ncclIbCommStateRecv;
+  stage->offset = 0;
+
+ib_recv:
+  int received;
+  meta = (struct ncclIbConnectionMetadata*)stage->buffer;
+  remMeta = meta + 1;
+  NCCLCHECK(ncclIbMetaRecv(&rComm->base.sock, remMeta, &stage->offset, &received));
+  if (!received) return ncclSuccess;
+  stage->bytes += stage->offset;
+
+  mergedDev = ncclIbMergedDevs + lComm->dev;
+  rComm->base.nRemDevs = remMeta->ndevs;
+  if (rComm->base.nRemDevs != rComm->base.ndevs) {
+    WARN("NET/IB : Local mergedDev %s has a different number of devices=%d as remote %s %d",
+      mergedDev->devName, rComm->base.ndevs, remMeta->devName, rComm->base.nRemDevs);
+  }
+  if (remMeta->nqps != rComm->base.nqps) {
+    WARN("NET/IB : Local mergedDev %s uses %d QPs but remote %s uses %d, NCCL_IB_QPS_PER_CONNECTION must match",
+      mergedDev->devName, rComm->base.nqps, remMeta->devName, remMeta->nqps);
+    return ncclInternalError;
   }
 
-  meta.ndevs = rComm->base.ndevs;
-  strncpy(meta.devName, mergedDev->devName, MAX_MERGED_DEV_NAME);
+  // Copy remDevInfo for things like remGidInfo, remFifoAddr, etc.
+  for (int i = 0; i < remMeta->ndevs; i++) {
+    rComm->base.remDevs[i] = remMeta->devs[i];
+    rComm->base.remDevs[i].remoteGid.global.interface_id  = rComm->base.remDevs[i].gid.global.interface_id;
+    rComm->base.remDevs[i].remoteGid.global.subnet_prefix = rComm->base.remDevs[i].gid.global.subnet_prefix;
+  }
 
-  stage->state = ncclIbCommStateSend;
-  stage->offset = 0;
-  if (stage->buffer) free(stage->buffer);
-  NCCLCHECK(ncclIbMalloc((void**)&stage->buffer, sizeof(struct ncclIbConnectionMetadata)));
-  memcpy(stage->buffer, &meta, sizeof(struct ncclIbConnectionMetadata));
+  for (int i = 0; i < rComm->base.ndevs; i++) {
+    // Retain remote fifo info
+    rComm->devs[i].fifoRkey = remMeta->devs[i].fifoRkey;
+    rComm->remFifo.addr = remMeta->fifoAddr;
 
-ib_send:
-  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &rComm->base.sock, stage->buffer, sizeof(struct ncclIbConnectionMetadata), &stage->offset));
-  if (stage->offset < sizeof(struct ncclIbConnectionMetadata)) return ncclSuccess;
+    // Adjust the MTU
+    remMeta->devs[i].mtu = (enum ibv_mtu) std::min(remMeta->devs[i].mtu, meta->devs[i].mtu);
+    meta->devs[i].mtu    = remMeta->devs[i].mtu;
+  }
 
-  stage->offset = 0;
-  stage->state = ncclIbCommStatePendingReady;
+  // Only the remote dependent transitions are left: ECE, RTR and RTS for each QP
+  for (int q = 0; q < rComm->base.nqps; q++) {
+    int remDevIndex = remMeta->qpInfo[q].devIndex;
+    remDevInfo = remMeta->devs + remDevIndex;
+    qp = rComm->base.qps+q;
+    rCommDev = rComm->devs + qp->devIndex;
+    qp->remDevIdx = remDevIndex;
 
-ib_recv_ready:
-  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV,  &rComm->base.sock, &rComm->base.ready, sizeof(int), &stage->offset));
-  if (stage->offset != sizeof(int)) return ncclSuccess;
+    // Set the ece (enhanced connection establishment) on this QP before RTR
+    if (remMeta->qpInfo[q].ece_supported) {
+      NCCLCHECK(wrap_ibv_set_ece(qp->qp, &remMeta->qpInfo[q].ece, &meta->qpInfo[q].ece_supported));
+
+      // Query the reduced ece for this QP (matching enhancements between the requestor and the responder)
+      // Store this in our own qpInfo for returning to the requestor
+      if (meta->qpInfo[q].ece_supported)
+        NCCLCHECK(wrap_ibv_query_ece(qp->qp, &meta->qpInfo[q].ece, &meta->qpInfo[q].ece_supported));
+    }
+
+    bool override_tc = (q == 0) ? true : false;
+    NCCLCHECK(ncclIbRtrQp(qp->qp, &rCommDev->base.gidInfo, remMeta->qpInfo[q].qpn, remDevInfo, override_tc));
+    NCCLCHECK(ncclIbRtsQp(qp->qp));
+#ifdef ANP_DEBUG_TRACE_EN
+    INFO(NCCL_NET, "[ANP_TRACE] recvcomm %p, ch %d, %s qp %d, local nic %d, peer nic %d",
+         rComm, qp->channelId, qp->data ? "data" : "cts", qp->qp->qp_num,
+         rCommDev->base.ibDevN, rComm->base.remDevs[qp->remDevIdx].ibv_dev_index);
+#endif
+  }
 
+  stage->state = ncclIbCommStateSend;
+  stage->offset = 0;
+
+ib_send:
+  int metaSize;
+  metaSize = ncclIbMetaSize(((struct ncclIbConnectionMetadata*)stage->buffer)->nqps);
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_SEND, &rComm->base.sock, stage->buffer, metaSize, &stage->offset));
+  if (stage->offset < metaSize) return ncclSuccess;
+
+  // Our QPs are already in RTS. Don't wait for the sender's ready message here,
+  // it is picked up by the first irecv (see ncclIbRecvCheck)
+  stage->bytes += metaSize;
+  INFO(NCCL_NET, "NET/IB: Accepted connection on %s in %lu us, %d handshake bytes (%d with fixed size metadata)",
+    ncclIbMergedDevs[lComm->dev].devName, (gettime_ns() - stage->startNs)/1000, stage->bytes,
+    (int)(2*sizeof(struct ncclIbConnectionMetadata) + sizeof(int)));
   free(stage->buffer);
+  int privateMrs;
+  privateMrs = 0;
+  for (int i = 0; i < rComm->base.ndevs; i++) privateMrs += (rComm->devs[i].gpuFlush.gpuMr != NULL);
+  ncclIbLogCommFootprint("Recv", lComm->dev, &rComm->base, privateMrs);
   *recvComm = rComm;
 
   /* reset lComm stage */
@@ -1876,9 +3239,8 @@ ncclResult_t ncclIbGetRequest(struct ncclIbNetCommBase* base, struct ncclIbReque
     if (r->type == NCCL_NET_IB_REQ_UNUSED) {
       r->base = base;
       r->sock = NULL;
-      r->devBases[0] = NULL;
-      r->devBases[1] = NULL;
-      r->events[0] = r->events[1] = 0;
+      memset(r->events, 0, sizeof(r->events));
+      r->devMask = 0;
       *req = r;
       return ncclSuccess;
     }
@@ -1895,14 +3257,60 @@ ncclResult_t ncclIbFreeRequest(struct ncclIbRequest* r) {
 
 ncclResult_t ncclIbTest(void* request, int* done, int* size);
 
-ncclResult_t ncclIbRegMrDmaBufInternal(ncclIbNetCommDevBase* base, void* data, size_t size, int type, uint64_t offset, int fd, ibv_mr** mhandle) {
+static uintptr_t ncclIbPageSize(void) {
   static __thread uintptr_t pageSize = 0;
   if (pageSize == 0) pageSize = sysconf(_SC_PAGESIZE);
+  return pageSize;
+}
+
+// Drop cache slot and deregister its MR. Caller must hold the device lock
+static ncclResult_t ncclIbMrCacheRemoveLocked(struct ncclIbMrCache* cache, int slot) {
+  struct ibv_mr* mr = cache->slots[slot].mr;
+  if (cache->slots[slot].refs == 0) cache->idle--;
+  // Keep slots sorted by address, lookups rely on it
+  memmove(cache->slots+slot, cache->slots+slot+1, (cache->population-slot-1)*sizeof(struct ncclIbMr));
+  if (--cache->population == 0) {
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->capacity = 0;
+  }
+  NCCLCHECK(wrap_ibv_dereg_mr(mr));
+  return ncclSuccess;
+}
+
+static void ncclIbMrCacheInvalidateRange(uintptr_t addr, size_t len, void* arg) {
+  struct ncclIbMrCache* cache = (struct ncclIbMrCache*)arg;
+  for (int slot = 0; slot < cache->population; slot++) {
+    struct ncclIbMr* entry = cache->slots+slot;
+    if (entry->addr >= addr + len) break;
+    if (entry->addr + entry->pages*ncclIbPageSize() > addr) entry->stale = 1;
+  }
+}
+
+// Apply memory releases reported since the last call, and deregister
+// unreferenced MRs which cover released memory. Caller must hold the device lock
+static ncclResult_t ncclIbMrCacheSyncLocked(struct ncclIbMrCache* cache) {
+  if (!ncclIbMrCacheLongLived) return ncclSuccess;
+  if (!anpMrNotifierDrain(&cache->notifierCursor, ncclIbMrCacheInvalidateRange, cache)) {
+    // Lost track of some releases, nothing in the cache can be trusted
+    for (int slot = 0; slot < cache->population; slot++) cache->slots[slot].stale = 1;
+  }
+  for (int slot = cache->population-1; slot >= 0; slot--) {
+    if (cache->slots[slot].stale && cache->slots[slot].refs == 0) {
+      NCCLCHECK(ncclIbMrCacheRemoveLocked(cache, slot));
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbRegMrDmaBufInternal(ncclIbNetCommDevBase* base, void* data, size_t size, int type, uint64_t offset, int fd, ibv_mr** mhandle) {
+  uintptr_t pageSize = ncclIbPageSize();
   struct ncclIbMrCache* cache = &ncclIbDevs[base->ibDevN].mrCache;
   uintptr_t addr = (uintptr_t)data & -pageSize;
   size_t pages = ((uintptr_t)data + size - addr + pageSize-1)/pageSize;
   ncclResult_t res;
   pthread_mutex_lock(&ncclIbDevs[base->ibDevN].lock);
+  NCCLCHECKGOTO(ncclIbMrCacheSyncLocked(cache), res, returning);
   for (int slot=0; /*true*/; slot++) {
     if (slot == cache->population || addr < cache->slots[slot].addr) { // didn't find in cache
       if (cache->population == cache->capacity) { // must grow cache
@@ -1930,14 +3338,15 @@ ncclResult_t ncclIbRegMrDmaBufInternal(ncclIbNetCommDevBase* base, void* data, s
       cache->slots[slot].addr = addr;
       cache->slots[slot].pages = pages;
       cache->slots[slot].refs = 1;
+      cache->slots[slot].stale = 0;
       cache->slots[slot].mr = mr;
       cache->population += 1;
       *mhandle = mr;
       res = ncclSuccess;
       goto returning;
-    } else if ((addr >= cache->slots[slot].addr) &&
+    } else if (!cache->slots[slot].stale && (addr >= cache->slots[slot].addr) &&
         ((addr-cache->slots[slot].addr)/pageSize+pages) <= cache->slots[slot].pages) {
-      cache->slots[slot].refs += 1;
+      if (cache->slots[slot].refs++ == 0) cache->idle--;
       *mhandle = cache->slots[slot].mr;
       res = ncclSuccess;
       goto returning;
@@ -1958,18 +3367,164 @@ struct ncclIbNetCommDevBase* ncclIbGetNetCommDevBase(ncclIbNetCommBase* base, in
   }
 }
 
+static inline struct ncclIbMrHandle** ncclIbMrHandleBucket(uintptr_t addr, size_t size) {
+  uint64_t h = (addr >> 12) ^ (addr >> 24) ^ (uint64_t)size;
+  return ncclIbMrHandlePool.buckets + (h % NCCL_IB_MR_HANDLE_BUCKETS);
+}
+
+static bool ncclIbMrHandleMatch(struct ncclIbMrHandle* h, struct ncclIbNetCommBase* base, uintptr_t addr, size_t size) {
+  if (h->addr != addr || h->size != size || h->ndevs != base->ndevs) return false;
+  for (int i = 0; i < base->ndevs; i++) {
+    if (h->ibDevNs[i] != ncclIbGetNetCommDevBase(base, i)->ibDevN) return false;
+  }
+  return true;
+}
+
+// Whether memory under one of the MRs of handle was released since they were
+// registered. Applies pending releases to the device caches first. Takes the
+// device locks inside ncclIbMrHandlePool.lock, never the other way around.
+static ncclResult_t ncclIbMrHandleStale(struct ncclIbMrHandle* handle, bool* stale) {
+  *stale = false;
+  if (!ncclIbMrCacheLongLived) return ncclSuccess;
+  for (int i = 0; i < handle->ndevs && !*stale; i++) {
+    struct ncclIbDev* ibDev = ncclIbDevs + handle->ibDevNs[i];
+    struct ncclIbMrCache* cache = &ibDev->mrCache;
+    pthread_mutex_lock(&ibDev->lock);
+    ncclResult_t res = ncclIbMrCacheSyncLocked(cache);
+    // The handle holds a reference, so its MR is still in the cache
+    for (int slot = 0; res == ncclSuccess && slot < cache->population; slot++) {
+      if (cache->slots[slot].mr == handle->mrs[i]) {
+        *stale = cache->slots[slot].stale;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&ibDev->lock);
+    NCCLCHECK(res);
+  }
+  return ncclSuccess;
+}
+
+static void ncclIbMrHandleUnlink(struct ncclIbMrHandle* handle);
+
+// Handle of the same buffer on the same devices, to share. A handle whose
+// buffer was freed, and the address maybe reused, leaves the hash: its
+// holders keep it until they deregister, new registrations get fresh MRs.
+// Caller must hold ncclIbMrHandlePool.lock
+static ncclResult_t ncclIbMrHandleLookup(struct ncclIbNetCommBase* base, uintptr_t addr, size_t size, struct ncclIbMrHandle** handle) {
+  *handle = NULL;
+  for (struct ncclIbMrHandle* h = *ncclIbMrHandleBucket(addr, size); h != NULL; h = h->next) {
+    if (ncclIbMrHandleMatch(h, base, addr, size)) {
+      bool stale;
+      NCCLCHECK(ncclIbMrHandleStale(h, &stale));
+      if (stale) {
+        ncclIbMrHandleUnlink(h);
+      } else {
+        *handle = h;
+      }
+      return ncclSuccess;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Caller must hold ncclIbMrHandlePool.lock
+static ncclResult_t ncclIbMrHandleAlloc(struct ncclIbMrHandle** handle) {
+  if (ncclIbMrHandlePool.freeList == NULL) {
+    struct ncclIbMrHandleSlab* slab;
+    NCCLCHECK(ncclCalloc(&slab, 1));
+    for (int i = NCCL_IB_MR_HANDLES_PER_SLAB-1; i >= 0; i--) {
+      slab->handles[i].next = ncclIbMrHandlePool.freeList;
+      ncclIbMrHandlePool.freeList = slab->handles+i;
+    }
+    slab->next = ncclIbMrHandlePool.slabs;
+    ncclIbMrHandlePool.slabs = slab;
+  }
+  *handle = ncclIbMrHandlePool.freeList;
+  ncclIbMrHandlePool.freeList = (*handle)->next;
+  memset(*handle, 0, sizeof(struct ncclIbMrHandle));
+  return ncclSuccess;
+}
+
+// Caller must hold ncclIbMrHandlePool.lock
+static void ncclIbMrHandleFree(struct ncclIbMrHandle* handle) {
+  handle->next = ncclIbMrHandlePool.freeList;
+  ncclIbMrHandlePool.freeList = handle;
+}
+
+// Caller must hold ncclIbMrHandlePool.lock
+static void ncclIbMrHandleUnlink(struct ncclIbMrHandle* handle) {
+  if (!handle->linked) return;
+  struct ncclIbMrHandle** prev = ncclIbMrHandleBucket(handle->addr, handle->size);
+  while (*prev != handle) prev = &(*prev)->next;
+  *prev = handle->next;
+  handle->linked = 0;
+}
+
+ncclResult_t ncclIbDeregMrInternal(ncclIbNetCommDevBase* base, ibv_mr* mhandle);
+
 /* DMA-BUF support */
 ncclResult_t ncclIbRegMrDmaBuf(void* comm, void* data, size_t size, int type, uint64_t offset, int fd, void** mhandle) {
   assert(size > 0);
   struct ncclIbNetCommBase* base = (struct ncclIbNetCommBase*) comm;
-  struct ncclIbMrHandle* mhandleWrapper = (struct ncclIbMrHandle*) malloc(sizeof(struct ncclIbMrHandle));
+  struct ncclIbMrHandle* mhandleWrapper;
+  struct ncclIbMrHandle* existing;
+  uintptr_t addr = (uintptr_t)data;
+  ncclResult_t res = ncclSuccess;
+  int nregs = 0;
+
+  // Fast path: the same buffer is already registered on this set of devices
+  pthread_mutex_lock(&ncclIbMrHandlePool.lock);
+  res = ncclIbMrHandleLookup(base, addr, size, &mhandleWrapper);
+  if (res == ncclSuccess && mhandleWrapper) {
+    mhandleWrapper->refs++;
+    pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+    *mhandle = (void*) mhandleWrapper;
+    return ncclSuccess;
+  }
+  if (res == ncclSuccess) res = ncclIbMrHandleAlloc(&mhandleWrapper);
+  pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+  if (res != ncclSuccess) return res;
+
+  mhandleWrapper->addr = addr;
+  mhandleWrapper->size = size;
+  mhandleWrapper->refs = 1;
+  mhandleWrapper->ndevs = base->ndevs;
   for (int i = 0; i < base->ndevs; i++) {
     // Each ncclIbNetCommDevBase is at different offset in send and recv netComms
     struct ncclIbNetCommDevBase* devComm = ncclIbGetNetCommDevBase(base, i);
-    NCCLCHECK(ncclIbRegMrDmaBufInternal(devComm, data, size, type, offset, fd, mhandleWrapper->mrs + i));
+    mhandleWrapper->ibDevNs[i] = devComm->ibDevN;
+    NCCLCHECKGOTO(ncclIbRegMrDmaBufInternal(devComm, data, size, type, offset, fd, mhandleWrapper->mrs + i), res, fail);
+    nregs++;
   }
+
+  // Another thread may have registered the same buffer meanwhile; keep a single handle
+  pthread_mutex_lock(&ncclIbMrHandlePool.lock);
+  res = ncclIbMrHandleLookup(base, addr, size, &existing);
+  if (res != ncclSuccess) {
+    pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+    goto fail;
+  }
+  if (existing) {
+    existing->refs++;
+    pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+    *mhandle = (void*) existing;
+    goto fail; // Drop our duplicate registration
+  }
+  mhandleWrapper->next = *ncclIbMrHandleBucket(addr, size);
+  *ncclIbMrHandleBucket(addr, size) = mhandleWrapper;
+  mhandleWrapper->linked = 1;
+  pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
   *mhandle = (void*) mhandleWrapper;
   return ncclSuccess;
+
+fail:
+  for (int i = 0; i < nregs; i++) {
+    ncclIbDeregMrInternal(ncclIbGetNetCommDevBase(base, i), mhandleWrapper->mrs[i]);
+  }
+  pthread_mutex_lock(&ncclIbMrHandlePool.lock);
+  ncclIbMrHandleFree(mhandleWrapper);
+  pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+  return res;
 }
 
 ncclResult_t anpNetRegMr(void* comm, void* data, size_t size, int type, void** mhandle) {
@@ -1983,13 +3538,18 @@ ncclResult_t ncclIbDeregMrInternal(ncclIbNetCommDevBase* base, ibv_mr* mhandle)
   for (int i=0; i < cache->population; i++) {
     if (mhandle == cache->slots[i].mr) {
       if (0 == --cache->slots[i].refs) {
-        memmove(&cache->slots[i], &cache->slots[--cache->population], sizeof(struct ncclIbMr));
-        if (cache->population == 0) {
-          free(cache->slots);
-          cache->slots = NULL;
-          cache->capacity = 0;
+        cache->idle++;
+        if (!ncclIbMrCacheLongLived || cache->slots[i].stale) {
+          NCCLCHECKGOTO(ncclIbMrCacheRemoveLocked(cache, i), res, returning);
+        } else if (cache->idle > ncclParamIbMrCacheMaxIdle()) {
+          // Too many idle MRs pinned, release the lowest addressed one
+          for (int slot = 0; slot < cache->population; slot++) {
+            if (cache->slots[slot].refs == 0) {
+              NCCLCHECKGOTO(ncclIbMrCacheRemoveLocked(cache, slot), res, returning);
+              break;
+            }
+          }
         }
-        NCCLCHECKGOTO(wrap_ibv_dereg_mr(mhandle), res, returning);
       }
       res = ncclSuccess;
       goto returning;
@@ -2005,13 +3565,25 @@ returning:
 ncclResult_t anpNetDeregMr(void* comm, void* mhandle) {
   struct ncclIbMrHandle* mhandleWrapper = (struct ncclIbMrHandle*) mhandle;
   struct ncclIbNetCommBase* base = (struct ncclIbNetCommBase*) comm;
+  pthread_mutex_lock(&ncclIbMrHandlePool.lock);
+  if (--mhandleWrapper->refs > 0) {
+    pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+    return ncclSuccess;
+  }
+  ncclIbMrHandleUnlink(mhandleWrapper);
+  pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+
+  ncclResult_t res = ncclSuccess;
   for (int i = 0; i < base->ndevs; i++) {
     // Each ncclIbNetCommDevBase is at different offset in send and recv netComms
     struct ncclIbNetCommDevBase* devComm = ncclIbGetNetCommDevBase(base, i);
-    NCCLCHECK(ncclIbDeregMrInternal(devComm, mhandleWrapper->mrs[i]));
+    NCCLCHECKGOTO(ncclIbDeregMrInternal(devComm, mhandleWrapper->mrs[i]), res, returning);
   }
-  free(mhandleWrapper);
-  return ncclSuccess;
+returning:
+  pthread_mutex_lock(&ncclIbMrHandlePool.lock);
+  ncclIbMrHandleFree(mhandleWrapper);
+  pthread_mutex_unlock(&ncclIbMrHandlePool.lock);
+  return res;
 }
 
 NCCL_PARAM(IbSplitDataOnQps, "IB_SPLIT_DATA_ON_QPS", 0);
@@ -2087,7 +3659,7 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot, bool use_wri
 
   // Multi-QP: make sure IB writes are multiples of 128B so that LL and LL128 protocols still work
   const int align = 128;
-  int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+  int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : 1;
   assert(nqps == 1);
   for (int i = 0; i < nqps; i++) {
     int qpIndex = comm->base.qpIndex;
@@ -2099,7 +3671,7 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot, bool use_wri
 
       // Select proper rkey (needed even for 0-size send)
 #if !defined(CTS_RCVR_OFFLOAD_ENABLED)
-      comm->wrs[r].wr.rdma.rkey = slots[r].rkeys[qp->remDevIdx];
+      comm->wrs[r].wr.rdma.rkey = slots[r].rkey;
 #else
       comm->wrs[r].wr.rdma.rkey = 0xbade;
 #endif
@@ -2112,8 +3684,8 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot, bool use_wri
         // Select proper lkey
         comm->sges[r].lkey = reqs[r]->send.lkeys[devIndex];
         comm->sges[r].length = length;
-        ANP_TELEMETRY_EXECUTE(
-            g_anp_state.update_wqe_size_metrics(length);
+        ANP_TELEMETRY_COUNT(
+            g_anp_state.update_wqe_size_metrics(qp->telemetrySlot, length);
         );
         comm->wrs[r].sg_list = comm->sges+r;
         comm->wrs[r].num_sge = 1;
@@ -2127,21 +3699,21 @@ ncclResult_t ncclIbMultiSend(struct ncclIbSendComm* comm, int slot, bool use_wri
     }
 
     struct ibv_send_wr* bad_wr;
-    uint64_t start_time;
+    uint64_t start_time = 0;
 
-    ANP_TELEMETRY_EXECUTE(
-        start_time = gettime_ns();
+    ANP_TELEMETRY_COUNT(
+        if (g_anp_state.sample_wqe(qp->telemetrySlot)) start_time = anpTimestampNs();
     );
     NCCLCHECK(wrap_ibv_post_send(qp->qp, comm->wrs, &bad_wr));
-    ANP_TELEMETRY_EXECUTE(
+    ANP_TELEMETRY_COUNT(
         if (use_write_op) {
-          g_debug_stats.num_wr_wqe++;
+          ANP_DEBUG_STATS_INC(num_wr_wqe);
         } else {
-          g_debug_stats.num_wi_wqe++;
+          ANP_DEBUG_STATS_INC(num_wi_wqe);
         }
-        g_anp_state.increment_num_write_wqe(qp->qp->qp_num, num_write);
-        g_anp_state.increment_num_write_imm_wqe(qp->qp->qp_num);
-        g_anp_state.update_wqe_send_metrics(qp->qp->qp_num, wr_id, start_time);
+        g_anp_state.increment_num_write_wqe(qp->telemetrySlot, num_write);
+        g_anp_state.increment_num_write_imm_wqe(qp->telemetrySlot);
+        g_anp_state.update_wqe_send_metrics(qp->telemetrySlot, wr_id, start_time);
     );
     for (int r=0; r<nreqs; r++) {
       int chunkSize = DIVUP(DIVUP(reqs[r]->send.size, nqps), align) * align;
@@ -2193,8 +3765,8 @@ ncclResult_t anpNetIsend(void* sendComm, void* data, size_t size, int tag, void*
   uint64_t idx = comm->fifoHead+1;
   if (slots[0].idx != idx) {
       *request = NULL;
-      ANP_TELEMETRY_EXECUTE(
-          g_anp_state.update_slot_miss_metrics(comm->base.qpIndex);
+      ANP_TELEMETRY_COUNT(
+          g_anp_state.update_slot_miss_metrics(comm->base.qps[comm->base.qpIndex].telemetrySlot);
       );
       return ncclSuccess;
   }
@@ -2209,12 +3781,12 @@ ncclResult_t anpNetIsend(void* sendComm, void* data, size_t size, int tag, void*
 
     if (size > slots[r].size) size = slots[r].size;
     // Sanity checks
-    if (slots[r].size < 0 || slots[r].addr == 0 || slots[r].rkeys[0] == 0) {
+    if (slots[r].size < 0 || slots[r].addr == 0 || slots[r].rkey == 0) {
       char line[SOCKET_NAME_MAXLEN + 1];
       union ncclSocketAddress addr;
       ncclSocketGetAddr(&comm->base.sock, &addr);
-      WARN("NET/IB : req %d/%d tag %x peer %s posted incorrect receive info: size %d addr %lx rkeys[0]=%x",
-        r, nreqs, tag, ncclSocketToString(&addr, line), slots[r].size, slots[r].addr, slots[r].rkeys[0]);
+      WARN("NET/IB : req %d/%d tag %x peer %s posted incorrect receive info: size %d addr %lx rkey=%x",
+        r, nreqs, tag, ncclSocketToString(&addr, line), slots[r].size, slots[r].addr, slots[r].rkey);
       return ncclInternalError;
     }
 #else
@@ -2232,13 +3804,13 @@ ncclResult_t anpNetIsend(void* sendComm, void* data, size_t size, int tag, void*
     req->send.offset = 0;
 
     // Populate events
-    int nEvents = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+    int nEvents = ncclParamIbSplitDataOnQps() ? comm->base.nqps : 1;
     int qpIndex = comm->base.qpIndex;
     // Count down
     while (nEvents > 0) {
       ncclIbQp* qp = comm->base.qps + qpIndex;
       int devIndex = qp->devIndex;
-      ncclIbAddEvent(req, devIndex, &comm->devs[devIndex].base);
+      ncclIbAddEvent(req, devIndex);
       // Track the valid lkey for this RDMA_Write
       req->send.lkeys[devIndex] = mhandleWrapper->mrs[devIndex]->lkey;
       nEvents--;
@@ -2296,9 +3868,8 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, siz
     localElem[i].addr = (uint64_t)data[i];
     struct ncclIbMrHandle* mhandleWrapper = (struct ncclIbMrHandle*) mhandles[i];
 
-    // Send all applicable rkeys
-    for (int j = 0; j < comm->base.ndevs; j++)
-      localElem[i].rkeys[j] = mhandleWrapper->mrs[j]->rkey;
+    // The sender writes the data on the peer of ctsQp, i.e. into our port ctsQp->devIndex
+    localElem[i].rkey = mhandleWrapper->mrs[ctsQp->devIndex]->rkey;
 
     localElem[i].nreqs = n;
     localElem[i].size = sizes[i]; // Sanity/Debugging
@@ -2351,7 +3922,7 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, siz
     signalled = true;
     wr.send_flags |= IBV_SEND_SIGNALED;
     wr.wr_id = req - comm->base.reqs;
-    ncclIbAddEvent(req, ctsQp->devIndex, &comm->devs[ctsQp->devIndex].base);
+    ncclIbAddEvent(req, ctsQp->devIndex);
   }
 
   struct ibv_send_wr* bad_wr;
@@ -2371,18 +3942,18 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, siz
         wr.opcode, wr.send_flags, wr.imm_data, wr.wr.rdma.remote_addr, wr.wr.rdma.rkey, wr.sg_list ? wr.sg_list->length : 0, wr.sg_list ? wr.sg_list->lkey : 0);
 #endif
 
-  ANP_TELEMETRY_EXECUTE(
-    g_anp_state.update_cts_send_metrics(ctsQp->qp->qp_num);
-    g_debug_stats.num_cts_sent++;
+  ANP_TELEMETRY_COUNT(
+    g_anp_state.update_cts_send_metrics(ctsQp->telemetrySlot);
+    ANP_DEBUG_STATS_INC(num_cts_sent);
     if (signalled) {
-        g_debug_stats.num_signalled_cts_sent++;
+        ANP_DEBUG_STATS_INC(num_signalled_cts_sent);
     }
   );
-  ANP_TELEMETRY_EXECUTE(
+  ANP_TELEMETRY_COUNT(
       if (signalled) {
-          g_anp_state.increment_num_cts_sent_signalled(ctsQp->qp->qp_num);
+          g_anp_state.increment_num_cts_sent_signalled(ctsQp->telemetrySlot);
       } else {
-          g_anp_state.increment_num_cts_sent_unsignalled(ctsQp->qp->qp_num);
+          g_anp_state.increment_num_cts_sent_unsignalled(ctsQp->telemetrySlot);
       }
   );
   comm->remFifo.fifoTail++;
@@ -2392,10 +3963,20 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, int n, void** data, siz
   return ncclSuccess;
 }
 
+// The sender tells us once its QPs are ready, after accept() already returned.
+// Do not block on this receive, return if not ready.
+static ncclResult_t ncclIbRecvCheck(struct ncclIbRecvComm* comm) {
+  int bytes = 0;
+  NCCLCHECK(ncclSocketProgress(NCCL_SOCKET_RECV, &comm->base.sock, &comm->base.ready, sizeof(int), &bytes));
+  if (bytes == 0) return ncclSuccess;
+  NCCLCHECK(ncclSocketWait(NCCL_SOCKET_RECV, &comm->base.sock, &comm->base.ready, sizeof(int), &bytes));
+  return ncclSuccess;
+}
+
 ncclResult_t anpNetIrecvDefault(void* recvComm, int n, void** data, size_t* sizes, int* tags, void** mhandles, void** request) {
   ncclResult_t res = ncclSuccess;
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
-  if (comm->base.ready == 0) { WARN("NET/IB: ncclIbIrecv() called when comm->base.ready == 0"); return ncclInternalError; }
+  if (comm->base.ready == 0) NCCLCHECK(ncclIbRecvCheck(comm));
   if (comm->base.ready == 0) { *request = NULL; return ncclSuccess; }
   if (n > NCCL_NET_IB_MAX_RECVS) return ncclInternalError;
 
@@ -2405,10 +3986,6 @@ ncclResult_t anpNetIrecvDefault(void* recvComm, int n, void** data, size_t* size
   req->sock = &comm->base.sock;
   req->nreqs = n;
 
-  for (int i = 0; i < comm->base.ndevs; i++) {
-    req->devBases[i] = &comm->devs[i].base;
-  }
-
   struct ibv_recv_wr wr;
   memset(&wr, 0, sizeof(wr));
   wr.wr_id = req - comm->base.reqs;
@@ -2416,15 +3993,15 @@ ncclResult_t anpNetIrecvDefault(void* recvComm, int n, void** data, size_t* size
   wr.num_sge = 0;
 
   TIME_START(1);
-  // Select either all QPs, or one qp per-device
-  const int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : comm->base.ndevs;
+  // Select either all QPs, or the one QP the CTS and the data of this message go on
+  const int nqps = ncclParamIbSplitDataOnQps() ? comm->base.nqps : 1;
 
   // Post recvs
   struct ibv_recv_wr* bad_wr;
   int qpIndex = comm->base.qpIndex;
   for (int i = 0; i < nqps; i++) {
     struct ncclIbQp* qp = comm->base.qps + comm->base.qpIndex;
-    ncclIbAddEvent(req, qp->devIndex, &comm->devs[qp->devIndex].base);
+    ncclIbAddEvent(req, qp->devIndex);
     if (wrap_ibv_post_recv(qp->qp, &wr, &bad_wr) != ncclSuccess)  {
         goto err;
     }
@@ -2432,9 +4009,9 @@ ncclResult_t anpNetIrecvDefault(void* recvComm, int n, void** data, size_t* size
     INFO(NCCL_NET, "Posted RECV WQE, ch %d, qp %d, nic %d, dev index %d",
          qp->channelId, qp->qp->qp_num, comm->devs[qp->devIndex].base.ibDevN, qp->devIndex);
 #endif
-    ANP_TELEMETRY_EXECUTE(
-        g_debug_stats.num_recv_wqe++;
-        g_anp_state.increment_num_recv_wqe(qp->qp->qp_num);
+    ANP_TELEMETRY_COUNT(
+        ANP_DEBUG_STATS_INC(num_recv_wqe);
+        g_anp_state.increment_num_recv_wqe(qp->telemetrySlot);
     );
     // Don't update comm->base.qpIndex yet, we need to run through this same set of QPs
     // inside ncclIbPostFifo()
@@ -2460,7 +4037,7 @@ err:
 
 static ncclResult_t anpNetIrecvPostCTS(void* recvComm, int n, void** data, size_t* sizes, int* tags, void** mhandles, void** request) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
-  if (comm->base.ready == 0) { WARN("NET/IB: ncclIbIrecv() called when comm->base.ready == 0"); return ncclInternalError; }
+  if (comm->base.ready == 0) NCCLCHECK(ncclIbRecvCheck(comm));
   if (comm->base.ready == 0) { *request = NULL; return ncclSuccess; }
   if (n > NCCL_NET_IB_MAX_RECVS) return ncclInternalError;
 
@@ -2470,10 +4047,6 @@ static ncclResult_t anpNetIrecvPostCTS(void* recvComm, int n, void** data, size_
   req->sock = &comm->base.sock;
   req->nreqs = n;
 
-  for (int i = 0; i < comm->base.ndevs; i++) {
-    req->devBases[i] = &comm->devs[i].base;
-  }
-
   // Post to FIFO to notify sender
   TIME_START(2);
   NCCLCHECK(ncclIbPostFifo(comm, n, data, sizes, tags, mhandles, req));
@@ -2543,19 +4116,18 @@ ncclResult_t anpNetFlush(void* recvComm, int n, void** data, int* sizes, void**
     NCCLCHECK(wrap_ibv_post_send(comm->devs[i].gpuFlush.qp.qp, &wr, &bad_wr));
     TIME_STOP(4);
 
-    ncclIbAddEvent(req, i, &comm->devs[i].base);
+    ncclIbAddEvent(req, i);
   }
 
   *request = req;
   return ncclSuccess;
 }
 
-#define ANP_CQ_POLL_MAX_EVENT        16
 ncclResult_t anpNetTest(void* request, int* done, int* sizes) {
   struct ncclIbRequest *r = (struct ncclIbRequest*)request;
   *done = 0;
   while (1) {
-    if (r->events[0] == 0 && r->events[1] == 0) {
+    if (r->devMask == 0) {
       TRACE(NCCL_NET, "r=%p done", r);
       *done = 1;
       if (sizes && r->type == NCCL_NET_IB_REQ_RECV) {
@@ -2572,83 +4144,84 @@ ncclResult_t anpNetTest(void* request, int* done, int* sizes) {
     int wrDone = 0;
     struct ibv_wc wcs[ANP_CQ_POLL_MAX_EVENT];
 
-    for (int i = 0; i < NCCL_IB_MAX_DEVS_PER_NIC; i++) {
+    // Only poll the CQs of devices we expect completions from
+    for (uint32_t mask = r->devMask; mask; mask &= mask-1) {
+      int i = __builtin_ctz(mask);
+      struct ncclIbNetCommDevBase* devBase = r->base->devBases[i];
       TIME_START(3);
-      // If we expect any completions from this device's CQ
-      if (r->events[i]) {
-        NCCLCHECK(wrap_ibv_poll_cq(r->devBases[i]->cq, ANP_CQ_POLL_MAX_EVENT,
-                                   wcs, &wrDone));
-        totalWrDone += wrDone;
-        ANP_TELEMETRY_EXECUTE(
-            g_anp_state.update_cq_poll_metrics();
-        );
-        if (wrDone == 0) { TIME_CANCEL(3); } else { TIME_STOP(3); }
-        if (wrDone == 0) continue;
-        for (int w=0; w<wrDone; w++) {
-          struct ibv_wc *wc = wcs+w;
-          if (wc->status != IBV_WC_SUCCESS) {
-            union ncclSocketAddress addr;
-            ncclSocketGetAddr(r->sock, &addr);
-            char localGidString[INET6_ADDRSTRLEN] = "";
-            char remoteGidString[INET6_ADDRSTRLEN] = "";
-            const char* localGidStr = NULL, *remoteGidStr = NULL;
-            if (r->devBases[i]->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) {
-              localGidStr = inet_ntop(AF_INET6, &r->devBases[i]->gidInfo.localGid, localGidString, sizeof(localGidString));
-              remoteGidStr = inet_ntop(AF_INET6, &r->base->remDevs[i].remoteGid, remoteGidString, sizeof(remoteGidString));
-            }
-
-            char line[SOCKET_NAME_MAXLEN+1];
-            char *hcaName = r->devBases[i]->pd->context->device->name;
-            WARN("NET/IB: Got completion from peer %s with status=%d opcode=%d len=%d vendor err %d (%s)%s%s%s%s hca %s",
-                ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
-                localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGids":"", remoteGidString, hcaName);
-            return ncclRemoteError;
-          }
-
+      NCCLCHECK(wrap_ibv_poll_cq(devBase->cq, ANP_CQ_POLL_MAX_EVENT,
+                                 wcs, &wrDone));
+      totalWrDone += wrDone;
+      ANP_TELEMETRY_COUNT(
+          g_anp_state.update_cq_poll_metrics(devBase->telemetryCqSlot, wrDone, anpTimestampNs);
+      );
+      if (wrDone == 0) { TIME_CANCEL(3); } else { TIME_STOP(3); }
+      if (wrDone == 0) continue;
+      for (int w=0; w<wrDone; w++) {
+        struct ibv_wc *wc = wcs+w;
+        if (wc->status != IBV_WC_SUCCESS) {
           union ncclSocketAddress addr;
           ncclSocketGetAddr(r->sock, &addr);
-          struct ncclIbRequest* req = r->base->reqs+(wc->wr_id & 0xff);
+          char localGidString[INET6_ADDRSTRLEN] = "";
+          char remoteGidString[INET6_ADDRSTRLEN] = "";
+          const char* localGidStr = NULL, *remoteGidStr = NULL;
+          if (devBase->gidInfo.link_layer == IBV_LINK_LAYER_ETHERNET) {
+            localGidStr = inet_ntop(AF_INET6, &devBase->gidInfo.localGid, localGidString, sizeof(localGidString));
+            remoteGidStr = inet_ntop(AF_INET6, &r->base->remDevs[i].remoteGid, remoteGidString, sizeof(remoteGidString));
+          }
 
-          #ifdef ENABLE_TRACE
           char line[SOCKET_NAME_MAXLEN+1];
-          TRACE(NCCL_NET, "Got completion from peer %s with status=%d opcode=%d len=%d wr_id=%ld r=%p type=%d events={%d,%d}, i=%d",
-              ncclSocketToString(&addr, line), wc->status, wc->opcode,wc->byte_len, wc->wr_id, req, req->type, req->events[0], req->events[1], i);
-          #endif
-          if (req->type == NCCL_NET_IB_REQ_SEND) {
-            ANP_TELEMETRY_EXECUTE(
-                g_debug_stats.num_send_completion++;
-                g_anp_state.update_wqe_rcvd_metrics(wc->qp_num, wc->wr_id, gettime_ns());
-            );
-            for (int j = 0; j < req->nreqs; j++) {
-              struct ncclIbRequest* sendReq = r->base->reqs+((wc->wr_id >> (j*8)) & 0xff);
-              if ((sendReq->events[i] <= 0)) {
-                WARN("NET/IB: sendReq(%p)->events={%d,%d}, i=%d, j=%d <= 0", sendReq, sendReq->events[0], sendReq->events[1], i, j);
-                return ncclInternalError;
-              }
-              sendReq->events[i]--;
-              ANP_TELEMETRY_EXECUTE(
-                  g_debug_stats.num_send_completion_ok++;
-              );
+          char *hcaName = devBase->pd->context->device->name;
+          WARN("NET/IB: Got completion from peer %s with status=%d opcode=%d len=%d vendor err %d (%s)%s%s%s%s hca %s%s",
+              ncclSocketToString(&addr, line), wc->status, wc->opcode, wc->byte_len, wc->vendor_err, reqTypeStr[r->type],
+              localGidStr ?  " localGid ":"", localGidString, remoteGidStr ? " remoteGids":"", remoteGidString, hcaName,
+              ncclIbDevs[devBase->ibDevN].portDown ? " (port down)" : "");
+          return ncclRemoteError;
+        }
+
+        union ncclSocketAddress addr;
+        ncclSocketGetAddr(r->sock, &addr);
+        struct ncclIbRequest* req = r->base->reqs+(wc->wr_id & 0xff);
+
+        #ifdef ENABLE_TRACE
+        char line[SOCKET_NAME_MAXLEN+1];
+        TRACE(NCCL_NET, "Got completion from peer %s with status=%d opcode=%d len=%d wr_id=%ld r=%p type=%d events[%d]=%d devMask=0x%x",
+            ncclSocketToString(&addr, line), wc->status, wc->opcode,wc->byte_len, wc->wr_id, req, req->type, i, req->events[i], req->devMask);
+        #endif
+        if (req->type == NCCL_NET_IB_REQ_SEND) {
+          ANP_TELEMETRY_COUNT(
+              ANP_DEBUG_STATS_INC(num_send_completion);
+              g_anp_state.update_wqe_rcvd_metrics(ncclIbQpSlotFind(devBase, wc->qp_num), wc->wr_id, anpTimestampNs);
+          );
+          for (int j = 0; j < req->nreqs; j++) {
+            struct ncclIbRequest* sendReq = r->base->reqs+((wc->wr_id >> (j*8)) & 0xff);
+            if (sendReq->events[i] == 0) {
+              WARN("NET/IB: sendReq(%p)->events[%d]=0 devMask=0x%x, j=%d", sendReq, i, sendReq->devMask, j);
+              return ncclInternalError;
             }
-          } else {
-            ANP_TELEMETRY_EXECUTE(
-                g_anp_state.update_wqe_rcvd_metrics(wc->qp_num, wc->wr_id, gettime_ns());
-                g_debug_stats.num_recv_completion++;
+            ncclIbDoneEvent(sendReq, i);
+            ANP_TELEMETRY_COUNT(
+                ANP_DEBUG_STATS_INC(num_send_completion_ok);
             );
-            if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-              if (req->type != NCCL_NET_IB_REQ_RECV) {
-                WARN("NET/IB: wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM and req->type=%d", req->type);
-                return ncclInternalError;
-              }
-              if (req->nreqs == 1) {
-                req->recv.sizes[0] = wc->imm_data;
-              }
+          }
+        } else {
+          ANP_TELEMETRY_COUNT(
+              g_anp_state.update_wqe_rcvd_metrics(ncclIbQpSlotFind(devBase, wc->qp_num), wc->wr_id, anpTimestampNs);
+              ANP_DEBUG_STATS_INC(num_recv_completion);
+          );
+          if (req && wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+            if (req->type != NCCL_NET_IB_REQ_RECV) {
+              WARN("NET/IB: wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM and req->type=%d", req->type);
+              return ncclInternalError;
+            }
+            if (req->nreqs == 1) {
+              req->recv.sizes[0] = wc->imm_data;
             }
-            ANP_TELEMETRY_EXECUTE(
-                g_debug_stats.num_recv_completion_ok++;
-            );
-            req->events[i]--;
           }
+          ANP_TELEMETRY_COUNT(
+              ANP_DEBUG_STATS_INC(num_recv_completion_ok);
+          );
+          ncclIbDoneEvent(req, i);
         }
       }
     }
@@ -2663,16 +4236,19 @@ ncclResult_t anpNetCloseSend(void* sendComm) {
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
+    for (int q = 0; q < comm->base.nqps; q++) ncclIbReleaseQpTelemetry(comm->base.qps+q);
+    for (int i = 0; i < comm->base.ndevs; i++)
+      NCCLCHECK(ncclIbQpPoolPut(&comm->base, i, &comm->devs[i].base));
+
     for (int q = 0; q < comm->base.nqps; q++)
       if (comm->base.qps[q].qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->base.qps[q].qp));
 
     for (int i = 0; i < comm->base.ndevs; i++) {
       struct ncclIbSendCommDev* commDev = comm->devs + i;
-      if (commDev->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->fifoMr));
-      if (comm->remSizesFifo.mrs[i] != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->remSizesFifo.mrs[i]));
       NCCLCHECK(ncclIbDestroyBase(&commDev->base));
     }
-    free(comm);
+    ncclIbFifoFree(comm->fifoSlab, comm->fifoBlock);
+    ncclIbNumaFree(comm, sizeof(struct ncclIbSendComm));
   }
   TIME_PRINT("IB");
 #if 0
@@ -2691,6 +4267,18 @@ ncclResult_t anpNetCloseRecv(void* recvComm) {
   if (comm) {
     NCCLCHECK(ncclSocketClose(&comm->base.sock));
 
+    for (int q = 0; q < comm->base.nqps; q++) ncclIbReleaseQpTelemetry(comm->base.qps+q);
+    // The flush QP shares the CQ, get rid of it before the CQ can be pooled
+    for (int i = 0; i < comm->base.ndevs; i++) {
+      struct ncclIbRecvCommDev* commDev = comm->devs + i;
+      if (comm->flushEnabled) ncclIbReleaseQpTelemetry(&commDev->gpuFlush.qp);
+      if (comm->flushEnabled && commDev->gpuFlush.qp.qp != NULL) {
+        NCCLCHECK(wrap_ibv_destroy_qp(commDev->gpuFlush.qp.qp));
+        commDev->gpuFlush.qp.qp = NULL;
+      }
+      NCCLCHECK(ncclIbQpPoolPut(&comm->base, i, &commDev->base));
+    }
+
     for (int q = 0; q < comm->base.nqps; q++)
       if (comm->base.qps[q].qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->base.qps[q].qp));
 
@@ -2706,13 +4294,11 @@ ncclResult_t anpNetCloseRecv(void* recvComm) {
         }
 #endif
         if (commDev->gpuFlush.qp.qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(commDev->gpuFlush.qp.qp));
-        if (commDev->gpuFlush.hostMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->gpuFlush.hostMr));
       }
-      if (commDev->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->fifoMr));
-      if (commDev->sizesFifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(commDev->sizesFifoMr));
       NCCLCHECK(ncclIbDestroyBase(&commDev->base));
     }
-    free(comm);
+    ncclIbFifoFree(comm->fifoSlab, comm->fifoBlock);
+    ncclIbNumaFree(comm, sizeof(struct ncclIbRecvComm));
   }
   return ncclSuccess;
 }
@@ -0,0 +1,130 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+
+// Times the per-message telemetry updates of the data path at each level.
+//
+//   anp_datapath_bench [qps [messages [iterations]]]
+//
+// Each message makes the updates net_ib.cc makes for a single-WQE send: the
+// WQE size, the post, a CTS on a separate QP, one CQ poll reaping the
+// completion and the completion itself. Messages round-robin over qps data
+// QPs, 64 by default. The level is switched through the shared memory
+// control block like anp_telemetry -L does, and every update is guarded by
+// the same level check as ANP_TELEMETRY_COUNT. Timestamps use
+// CLOCK_MONOTONIC, the plugin's fallback when the TSC is not calibrated.
+// Prints the best ns/message of the iterations for each level. The figure
+// at off is mostly the loop itself.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "anp_metrics.h"
+#include "anp_state.h"
+#include "anp_telemetry_reader.h"
+
+anp_log_level_e anp_logger::log_level = LOG_ERROR;
+
+#define BENCH_COUNT(state, stmt) \
+    do { if ((state).level() != ANP_TELEMETRY_OFF) { stmt; } } while (0)
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+// keeps the compiler from dropping the start time of untimed posts
+static volatile uint64_t sink;
+
+static double run(anp_state& state, const std::vector<int>& slots, const std::vector<int>& cts_slots,
+                  int cq_slot, long messages) {
+    int num_qps = slots.size();
+    auto start = std::chrono::steady_clock::now();
+    for (long m = 0; m < messages; m++) {
+        int slot = slots[m % num_qps];
+        int cts_slot = cts_slots[m % num_qps];
+        uint64_t wr_id = m & 0xff;
+        uint64_t start_time = 0;
+        BENCH_COUNT(state, state.update_wqe_size_metrics(slot, 65536));
+        BENCH_COUNT(state, if (state.sample_wqe(slot)) start_time = now_ns());
+        BENCH_COUNT(state,
+            state.increment_num_write_wqe(slot, 1);
+            state.increment_num_write_imm_wqe(slot);
+            state.update_wqe_send_metrics(slot, wr_id, start_time);
+        );
+        BENCH_COUNT(state,
+            state.update_cts_send_metrics(cts_slot);
+            state.increment_num_cts_sent_unsignalled(cts_slot);
+        );
+        BENCH_COUNT(state, state.update_cq_poll_metrics(cq_slot, 1, now_ns));
+        BENCH_COUNT(state, state.update_wqe_rcvd_metrics(slot, wr_id, now_ns));
+        sink = start_time;
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / messages;
+}
+
+int main(int argc, char* argv[]) {
+    int num_qps = 64;
+    long messages = 2000000;
+    int iterations = 5;
+    if (argc >= 2) num_qps = atoi(argv[1]);
+    if (argc >= 3) messages = atol(argv[2]);
+    if (argc >= 4) iterations = atoi(argv[3]);
+    if (argc > 4 || num_qps < 1 || messages < 1 || iterations < 1) {
+        fprintf(stderr, "usage: %s [qps [messages [iterations]]]\n", argv[0]);
+        return 1;
+    }
+
+    static anp_state state;
+    std::vector<int> slots, cts_slots;
+    for (int q = 0; q < num_qps; q++) {
+        slots.push_back(state.add_queue_pair(0, q, 0x100 + 2 * q + 1, true));
+        cts_slots.push_back(state.add_queue_pair(0, q, 0x100 + 2 * q, false));
+        if (slots.back() < 0 || cts_slots.back() < 0) {
+            fprintf(stderr, "only %d QPs could be tracked\n", 2 * q);
+            return 1;
+        }
+    }
+    int cq_slot = state.add_completion_queue(0, 0, 4);
+    if (cq_slot < 0) {
+        fprintf(stderr, "the CQ could not be tracked\n");
+        return 1;
+    }
+
+    static const char* level_names[] = {"off", "counters", "sampled", "full"};
+    for (uint32_t level = ANP_TELEMETRY_OFF; level <= ANP_TELEMETRY_FULL; level++) {
+        if (!anp_telemetry_reader::set_level(getpid(), level, 64)) {
+            fprintf(stderr, "unable to set the telemetry level, is shared_memory disabled?\n");
+            return 1;
+        }
+        double best = 0;
+        for (int i = 0; i < iterations; i++) {
+            double ns = run(state, slots, cts_slots, cq_slot, messages);
+            best = i ? std::min(best, ns) : ns;
+        }
+        printf("%-8s %6.1f ns/message (%d QPs, %ld messages, best of %d)\n",
+               level_names[level], best, num_qps, messages, iterations);
+    }
+    return 0;
+}
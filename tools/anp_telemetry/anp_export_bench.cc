@@ -0,0 +1,98 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+
+// Times the device_status JSON export of a populated telemetry state.
+//
+//   anp_export_bench [devices channels qps_per_channel [iterations]]
+//
+// Defaults to 8 devices of 50 channels with 25 QPs each, i.e. 10k QPs, with
+// completion histograms and WQE size tables filled. Prints the best export
+// time and the peak RSS growth across the exports. The document is written
+// to the output_dir of RCCL_ANP_CONFIG_FILE, /tmp by default.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+
+#include "anp_metrics.h"
+#include "anp_state.h"
+
+anp_log_level_e anp_logger::log_level = LOG_ERROR;
+
+static long peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+int main(int argc, char* argv[]) {
+    int num_devices = 8;
+    int num_channels = 50;
+    int qps_per_channel = 25;
+    int iterations = 5;
+    if (argc >= 4) {
+        num_devices = atoi(argv[1]);
+        num_channels = atoi(argv[2]);
+        qps_per_channel = atoi(argv[3]);
+    }
+    if (argc >= 5) {
+        iterations = atoi(argv[4]);
+    }
+    if (argc == 2 || argc == 3 || argc > 5 || num_devices < 1 || num_channels < 1 ||
+        qps_per_channel < 1 || iterations < 1) {
+        fprintf(stderr, "usage: %s [devices channels qps_per_channel [iterations]]\n", argv[0]);
+        return 1;
+    }
+
+    static anp_state state;
+    int num_qps = 0;
+    for (int device = 0; device < num_devices; device++) {
+        for (int channel = 0; channel < num_channels; channel++) {
+            for (int q = 0; q < qps_per_channel; q++) {
+                // QP numbers as an HCA hands them out, the first QP of a channel carries CTS
+                int slot = state.add_queue_pair(device, channel, 0x100 + channel * qps_per_channel + q, q != 0);
+                if (slot < 0) {
+                    fprintf(stderr, "only %d QPs could be tracked\n", num_qps);
+                    return 1;
+                }
+                num_qps++;
+                for (uint64_t wqe = 0; wqe < 64; wqe++) {
+                    uint64_t completion_ns = 100 + (wqe * 997) % 6000;
+                    state.update_wqe_size_metrics(slot, 4096 << (wqe % 4));
+                    state.update_wqe_send_metrics(slot, wqe, 100);
+                    state.update_wqe_rcvd_metrics(slot, wqe, [&] { return 100 + completion_ns; });
+                }
+            }
+        }
+    }
+
+    long rss_before = peak_rss_kb();
+    double best_ms = 0;
+    for (int i = 0; i < iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        state.export_json();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best_ms = i ? std::min(best_ms, ms) : ms;
+    }
+    printf("%d QPs: best export of %d %.1f ms, peak RSS growth %ld KB\n",
+           num_qps, iterations, best_ms, peak_rss_kb() - rss_before);
+    return 0;
+}
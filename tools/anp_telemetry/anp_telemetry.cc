@@ -0,0 +1,323 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+// Prints the live telemetry of a process running the plugin, read from its
+// shared memory region without signalling it.
+//
+//   anp_telemetry -l                 list processes publishing telemetry
+//   anp_telemetry [-j] [-i sec] pid  print the counters of pid, as JSON with -j,
+//                                    every sec seconds with -i
+//   anp_telemetry -L level [-r n] pid
+//                                    switch the telemetry level of pid to off,
+//                                    counters, sampled (1 in n WQEs timed) or full
+//
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <getopt.h>
+#include <map>
+#include <unistd.h>
+
+#include "anp_json_writer.h"
+#include "anp_telemetry_reader.h"
+
+static const char* level_names[] = {"off", "counters", "sampled", "full"};
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s -l\n"
+            "       %s [-j] [-i interval_sec] pid\n"
+            "       %s -L off|counters|sampled|full [-r sample_rate] pid\n"
+            "  -l  list processes publishing telemetry\n"
+            "  -j  print JSON instead of a table\n"
+            "  -i  repeat every interval_sec seconds\n"
+            "  -L  switch the telemetry level of a running process\n"
+            "  -r  time 1 in sample_rate WQEs at the sampled level\n",
+            prog, prog, prog);
+}
+
+static const char* level_name(uint32_t level) {
+    return level <= ANP_TELEMETRY_FULL ? level_names[level] : "unknown";
+}
+
+static int list_processes() {
+    for (int pid : anp_telemetry_reader::list_pids()) {
+        anp_telemetry_reader reader;
+        anp_process_snapshot_s process;
+        if (!reader.open(pid) || !reader.read_process(process)) {
+            continue;
+        }
+        printf("%-8d %-16s %s\n", pid, process.host_name.c_str(), process.process_name.c_str());
+    }
+    return 0;
+}
+
+static counter_t num_polls(const cq_stats_s& stats) {
+    counter_t polls = 0;
+    for (counter_t count : stats.poll_batch) {
+        polls += count;
+    }
+    return polls;
+}
+
+static void print_table(const anp_process_snapshot_s& process, const std::vector<anp_qp_snapshot_s>& qps,
+                        const std::vector<anp_cq_snapshot_s>& cqs) {
+    anp_latency_histogram histogram(process.histogram_precision);
+    printf("process %s (%d) on %s, %u queue pairs, telemetry %s", process.process_name.c_str(),
+           process.pid, process.host_name.c_str(), (unsigned)qps.size(), level_name(process.level));
+    if (process.level == ANP_TELEMETRY_SAMPLED) {
+        printf(" 1/%u", process.sample_rate);
+    }
+    printf("\n");
+    for (const auto& dev : process.devices) {
+        printf("device %d %s/%s qp pool hits %" PRIu64 " misses %" PRIu64 "\n", dev.device_id,
+               dev.roce_device.c_str(), dev.eth_device.c_str(), dev.qp_pool_hits, dev.qp_pool_misses);
+    }
+    printf("%6s %7s %8s %4s %12s %12s %12s %8s %10s %10s %10s %10s\n", "device", "channel", "qp", "type",
+           "wqe_sent", "wqe_rcvd", "completed", "errors", "min_ns", "p50_ns", "p99_ns", "max_ns");
+    for (const auto& qp : qps) {
+        const qp_stats_s& stats = qp.stats;
+        printf("%6d %7d %8d %4s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %8" PRIu64
+               " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+               qp.device_id, qp.channel_id, qp.qp_id, (qp.flags & ANP_SHM_QP_DATA_QP) ? "data" : "cts",
+               stats.num_wqe_sent, stats.num_wqe_rcvd, stats.num_wqe_completed, stats.num_wqe_errors,
+               stats.wqe_completion_time_min,
+               histogram.percentile(qp.completion_buckets, 0.5, stats.wqe_completion_time_max),
+               histogram.percentile(qp.completion_buckets, 0.99, stats.wqe_completion_time_max),
+               stats.wqe_completion_time_max);
+    }
+    printf("%6s %7s %8s %12s %7s %12s %9s %12s %12s %12s\n", "device", "channel", "cq", "polls", "empty%",
+           "completions", "per_poll", "interval_p50", "interval_p99", "interval_max");
+    for (const auto& cq : cqs) {
+        const cq_stats_s& stats = cq.stats;
+        counter_t polls = num_polls(stats);
+        counter_t busy = polls - stats.poll_batch[0];
+        printf("%6d %7d %8u %12" PRIu64 " %7.1f %12" PRIu64 " %9.2f %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+               cq.device_id, cq.channel_id, cq.index, polls,
+               polls ? 100.0 * stats.poll_batch[0] / polls : 0.0, stats.num_completion,
+               busy ? (double)stats.num_completion / busy : 0.0,
+               histogram.percentile(stats.poll_interval_buckets, 0.5, stats.poll_interval_max),
+               histogram.percentile(stats.poll_interval_buckets, 0.99, stats.poll_interval_max),
+               stats.poll_interval_max);
+    }
+}
+
+static bool print_json(const anp_process_snapshot_s& process, const std::vector<anp_qp_snapshot_s>& qps,
+                       const std::vector<anp_cq_snapshot_s>& cqs) {
+    char buffer[1 << 16];
+    anp_json_writer out(STDOUT_FILENO, buffer, sizeof(buffer));
+    anp_latency_histogram histogram(process.histogram_precision);
+    out.begin_object();
+    out.field("process_id", process.pid);
+    out.field("host_name", process.host_name);
+    out.field("process_name", process.process_name);
+    out.field("start_time", process.start_time);
+    out.field("telemetry_level", level_name(process.level));
+    out.field("sample_rate", process.sample_rate);
+    out.begin_array("devices");
+    for (const auto& dev : process.devices) {
+        out.begin_object();
+        out.field("device_id", dev.device_id);
+        out.field("roce_device", dev.roce_device);
+        out.field("eth_device", dev.eth_device);
+        out.field("qp_pool_hits", dev.qp_pool_hits);
+        out.field("qp_pool_misses", dev.qp_pool_misses);
+        out.end_object();
+    }
+    out.end_array();
+    out.begin_array("queue_pairs");
+    for (const auto& qp : qps) {
+        const qp_stats_s& stats = qp.stats;
+        out.begin_object();
+        out.field("id", qp.qp_id);
+        out.field("device_id", qp.device_id);
+        out.field("channel_id", qp.channel_id);
+        out.field("data_qp", (qp.flags & ANP_SHM_QP_DATA_QP) != 0);
+        out.begin_object("stats");
+        out.field("num_wqe_sent", stats.num_wqe_sent);
+        out.field("num_wqe_rcvd", stats.num_wqe_rcvd);
+        out.field("num_wqe_completed", stats.num_wqe_completed);
+        out.field("num_wqe_errors", stats.num_wqe_errors);
+        out.field("num_slot_miss", stats.num_slot_miss);
+        out.field("num_cts_sent", stats.num_cts_sent);
+        out.field("num_cts_sent_unsignalled", stats.num_cts_sent_unsignalled);
+        out.field("num_cts_sent_signalled", stats.num_cts_sent_signalled);
+        out.field("num_recv_wqe", stats.num_recv_wqe);
+        out.field("num_write_wqe", stats.num_write_wqe);
+        out.field("num_write_imm_wqe", stats.num_write_imm_wqe);
+        out.field("wqe_completion_ns_min", stats.wqe_completion_time_min);
+        out.field("wqe_completion_ns_max", stats.wqe_completion_time_max);
+        out.field("wqe_completion_ns_p50", histogram.percentile(qp.completion_buckets, 0.5, stats.wqe_completion_time_max));
+        out.field("wqe_completion_ns_p90", histogram.percentile(qp.completion_buckets, 0.9, stats.wqe_completion_time_max));
+        out.field("wqe_completion_ns_p99", histogram.percentile(qp.completion_buckets, 0.99, stats.wqe_completion_time_max));
+        out.field("wqe_completion_ns_p999", histogram.percentile(qp.completion_buckets, 0.999, stats.wqe_completion_time_max));
+        out.begin_array("wqe_completion_metrics");
+        for (uint32_t bucket = 0; bucket < histogram.num_buckets(); bucket++) {
+            if (!qp.completion_buckets[bucket]) {
+                continue;
+            }
+            out.begin_object();
+            out.field("latency_in_ns", std::min(histogram.upper(bucket), stats.wqe_completion_time_max));
+            out.field("num_wqe", qp.completion_buckets[bucket]);
+            out.end_object();
+        }
+        out.end_array();
+        out.begin_array("wqe_size_stats");
+        for (const auto& wqe_size : qp.wqe_sizes) {
+            if (!wqe_size.key) {
+                continue;
+            }
+            out.begin_object();
+            out.field("wqe_size", wqe_size.key - 1);
+            out.field("num_wqe", wqe_size.count);
+            out.end_object();
+        }
+        out.end_array();
+        out.end_object();
+        out.end_object();
+    }
+    out.end_array();
+    out.begin_array("completion_queues");
+    for (const auto& cq : cqs) {
+        const cq_stats_s& stats = cq.stats;
+        counter_t polls = num_polls(stats);
+        out.begin_object();
+        out.field("id", cq.index);
+        out.field("device_id", cq.device_id);
+        out.field("channel_id", cq.channel_id);
+        out.field("max_batch", cq.max_batch);
+        out.begin_object("stats");
+        out.field("num_poll", polls);
+        out.field("num_empty_poll", stats.poll_batch[0]);
+        out.field("num_completion", stats.num_completion);
+        out.field("num_poll_interval", stats.num_poll_interval);
+        out.field("poll_interval_ns_p50", histogram.percentile(stats.poll_interval_buckets, 0.5, stats.poll_interval_max));
+        out.field("poll_interval_ns_p90", histogram.percentile(stats.poll_interval_buckets, 0.9, stats.poll_interval_max));
+        out.field("poll_interval_ns_p99", histogram.percentile(stats.poll_interval_buckets, 0.99, stats.poll_interval_max));
+        out.field("poll_interval_ns_max", stats.poll_interval_max);
+        out.begin_array("poll_batch_stats");
+        for (uint32_t batch = 1; batch <= ANP_MAX_CQ_POLL_BATCH; batch++) {
+            if (!stats.poll_batch[batch]) {
+                continue;
+            }
+            out.begin_object();
+            out.field("num_completion", batch);
+            out.field("num_poll", stats.poll_batch[batch]);
+            out.end_object();
+        }
+        out.end_array();
+        out.end_object();
+        out.end_object();
+    }
+    out.end_array();
+    out.end_object();
+    return out.flush();
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    int interval = 0;
+    int level = -1;
+    uint32_t sample_rate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "lji:L:r:h")) != -1) {
+        switch (opt) {
+        case 'l':
+            return list_processes();
+        case 'j':
+            json = true;
+            break;
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        case 'L':
+            for (int i = 0; i <= ANP_TELEMETRY_FULL; i++) {
+                if (!strcmp(optarg, level_names[i])) {
+                    level = i;
+                }
+            }
+            if (level < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            sample_rate = strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    int pid = atoi(argv[optind]);
+
+    if (level >= 0) {
+        if (!anp_telemetry_reader::set_level(pid, level, sample_rate)) {
+            fprintf(stderr, "failed to switch telemetry of pid %d: %s\n", pid, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    anp_telemetry_reader reader;
+    if (!reader.open(pid)) {
+        fprintf(stderr, "no telemetry published by pid %d\n", pid);
+        return 1;
+    }
+    std::vector<anp_qp_snapshot_s> qps;
+    std::vector<anp_cq_snapshot_s> cqs;
+    for (;;) {
+        anp_process_snapshot_s process;
+        if (!reader.read_process(process)) {
+            fprintf(stderr, "telemetry of pid %d is not readable\n", pid);
+            return 1;
+        }
+        qps.clear();
+        anp_qp_snapshot_s qp;
+        for (uint32_t i = 0; i < process.num_qps; i++) {
+            if (reader.read_qp(i, qp) && (qp.flags & ANP_SHM_QP_IN_USE)) {
+                qps.push_back(qp);
+            }
+        }
+        cqs.clear();
+        anp_cq_snapshot_s cq;
+        for (uint32_t i = 0; i < process.num_cqs; i++) {
+            if (reader.read_cq(i, cq) && (cq.flags & ANP_SHM_CQ_IN_USE)) {
+                cqs.push_back(cq);
+            }
+        }
+        if (json) {
+            if (!print_json(process, qps, cqs)) {
+                return 1;
+            }
+        } else {
+            print_table(process, qps, cqs);
+            fflush(stdout);
+        }
+        if (interval <= 0) {
+            return 0;
+        }
+        sleep(interval);
+    }
+}
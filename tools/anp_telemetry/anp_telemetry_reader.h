@@ -0,0 +1,334 @@
+//
+// Copyright(C) Advanced Micro Devices, Inc. All rights reserved.
+//
+// You may not use this software and documentation (if any) (collectively,
+// the "Materials") except in compliance with the terms and conditions of
+// the Software License Agreement included with the Materials or otherwise as
+// set forth in writing and signed by you and an authorized signatory of AMD.
+// If you do not have a copy of the Software License Agreement, contact your
+// AMD representative for a copy.
+//
+// You agree that you will not reverse engineer or decompile the Materials,
+// in whole or in part, except as allowed by applicable law.
+//
+// THE MATERIALS ARE DISTRIBUTED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OR
+// REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+//
+
+#ifndef ANP_TELEMETRY_READER_H_
+#define ANP_TELEMETRY_READER_H_
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "anp_shm.h"
+
+// Reader of the live telemetry region published by the plugin, see anp_shm.h.
+//
+// The region is mapped read-only and entries are copied out under their
+// sequence counters, so the monitored process is never signalled, paused or
+// written to.
+//
+
+struct anp_device_snapshot_s {
+    int32_t     device_id;
+    std::string roce_device;
+    std::string eth_device;
+    counter_t   qp_pool_hits;
+    counter_t   qp_pool_misses;
+};
+
+struct anp_process_snapshot_s {
+    int32_t     pid;
+    std::string host_name;
+    std::string process_name;
+    uint64_t    start_time;
+    uint32_t    histogram_precision;
+    uint32_t    level;       // anp_telemetry_level_e
+    uint32_t    sample_rate;
+    uint32_t    num_qps;
+    uint32_t    num_cqs;
+    std::vector<anp_device_snapshot_s> devices;
+};
+
+struct anp_qp_snapshot_s {
+    uint32_t         flags;
+    int32_t          qp_id;
+    int32_t          device_id;
+    int32_t          channel_id;
+    qp_stats_s       stats;
+    counter_t        completion_buckets[ANP_HISTOGRAM_BUCKETS];
+    wqe_size_count_s wqe_sizes[ANP_MAX_WQE_SIZES];
+};
+
+struct anp_cq_snapshot_s {
+    uint32_t   index;
+    uint32_t   flags;
+    int32_t    device_id;
+    int32_t    channel_id;
+    uint32_t   max_batch;
+    cq_stats_s stats;
+};
+
+class anp_telemetry_reader {
+public:
+    // a writer stuck mid-update, e.g. killed, is given up on after this many tries
+    static constexpr int max_retries = 1000;
+
+    anp_telemetry_reader() = default;
+    anp_telemetry_reader(const anp_telemetry_reader&) = delete;
+    anp_telemetry_reader& operator=(const anp_telemetry_reader&) = delete;
+
+    ~anp_telemetry_reader() {
+        close();
+    }
+
+    // maps the region of pid, false if there is none or its layout is unknown
+    bool open(int pid) {
+        close();
+        char name[64];
+        snprintf(name, sizeof(name), ANP_SHM_NAME_FMT, pid);
+        int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(anp_shm_header_s)) {
+            ::close(fd);
+            return false;
+        }
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        region = static_cast<const char*>(addr);
+        region_size = st.st_size;
+
+        const anp_shm_header_s* header = shm();
+        if (header->magic.load(std::memory_order_acquire) != ANP_SHM_MAGIC ||
+            header->version != ANP_SHM_VERSION ||
+            header->qp_size != sizeof(qp_shard_s) ||
+            header->max_devices > ANP_SHM_MAX_DEVICES ||
+            header->cq_size != sizeof(cq_shard_s) ||
+            cq_table_offset() + (size_t)header->max_cqs * header->cq_size > region_size) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (region) {
+            munmap(const_cast<char*>(region), region_size);
+            region = nullptr;
+            region_size = 0;
+        }
+    }
+
+    bool read_process(anp_process_snapshot_s& out) const {
+        const anp_shm_header_s* header = shm();
+        for (int tries = 0; tries < max_retries; tries++) {
+            uint32_t seq = header->seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                sched_yield();
+                continue;
+            }
+            out.pid = load(header->pid);
+            out.host_name = load_str(header->host_name, sizeof(header->host_name));
+            out.process_name = load_str(header->process_name, sizeof(header->process_name));
+            out.start_time = load(header->start_time);
+            out.histogram_precision = load(header->histogram_precision);
+            out.num_qps = load(header->num_qps);
+            out.num_cqs = load(header->num_cqs);
+            uint32_t num_devices = load(header->num_devices);
+            out.devices.resize(num_devices < ANP_SHM_MAX_DEVICES ? num_devices : ANP_SHM_MAX_DEVICES);
+            for (size_t i = 0; i < out.devices.size(); i++) {
+                const anp_shm_device_s& dev = header->devices[i];
+                out.devices[i].device_id = load(dev.device_id);
+                out.devices[i].roce_device = load_str(dev.roce_device, sizeof(dev.roce_device));
+                out.devices[i].eth_device = load_str(dev.eth_device, sizeof(dev.eth_device));
+                out.devices[i].qp_pool_hits = load(dev.qp_pool_hits);
+                out.devices[i].qp_pool_misses = load(dev.qp_pool_misses);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (header->seq.load(std::memory_order_relaxed) == seq) {
+                out.level = header->control.level.load(std::memory_order_relaxed);
+                out.sample_rate = header->control.sample_rate.load(std::memory_order_relaxed);
+                if (out.num_qps > header->max_qps) {
+                    out.num_qps = header->max_qps;
+                }
+                if (out.num_cqs > header->max_cqs) {
+                    out.num_cqs = header->max_cqs;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // copies QP table entry index, below num_qps. Entries without
+    // ANP_SHM_QP_IN_USE belong to QPs that were destroyed.
+    bool read_qp(uint32_t index, anp_qp_snapshot_s& out) const {
+        const qp_shard_s& qp = *reinterpret_cast<const qp_shard_s*>(
+            region + shm()->header_size + (size_t)index * sizeof(qp_shard_s));
+        for (int tries = 0; tries < max_retries; tries++) {
+            uint32_t seq = qp.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                sched_yield();
+                continue;
+            }
+            out.flags = load(qp.flags);
+            out.qp_id = load(qp.qp_id);
+            out.device_id = load(qp.device_id);
+            out.channel_id = load(qp.channel_id);
+            load_words(&qp.stats, &out.stats, sizeof(out.stats));
+            load_words(qp.completion_buckets, out.completion_buckets, sizeof(out.completion_buckets));
+            load_words(qp.wqe_sizes, out.wqe_sizes, sizeof(out.wqe_sizes));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (qp.seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // copies CQ table entry index, below num_cqs. Entries without
+    // ANP_SHM_CQ_IN_USE are free.
+    bool read_cq(uint32_t index, anp_cq_snapshot_s& out) const {
+        const cq_shard_s& cq = *reinterpret_cast<const cq_shard_s*>(
+            region + cq_table_offset() + (size_t)index * sizeof(cq_shard_s));
+        for (int tries = 0; tries < max_retries; tries++) {
+            uint32_t seq = cq.seq.load(std::memory_order_acquire);
+            if (seq & 1) {
+                sched_yield();
+                continue;
+            }
+            out.index = index;
+            out.flags = load(cq.flags);
+            out.device_id = load(cq.device_id);
+            out.channel_id = load(cq.channel_id);
+            out.max_batch = load(cq.max_batch);
+            load_words(&cq.stats, &out.stats, sizeof(out.stats));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (cq.seq.load(std::memory_order_relaxed) == seq) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Switches the telemetry level of pid while it runs, sample_rate 0 keeps
+    // the current rate. Needs write access to the region, i.e. the same user.
+    static bool set_level(int pid, uint32_t level, uint32_t sample_rate) {
+        if (level > ANP_TELEMETRY_FULL || sample_rate > ANP_TELEMETRY_MAX_SAMPLE_RATE) {
+            errno = EINVAL;
+            return false;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), ANP_SHM_NAME_FMT, pid);
+        int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(anp_shm_header_s)) {
+            ::close(fd);
+            errno = EINVAL;
+            return false;
+        }
+        void* addr = mmap(nullptr, sizeof(anp_shm_header_s), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+        anp_shm_header_s* header = static_cast<anp_shm_header_s*>(addr);
+        bool valid = header->magic.load(std::memory_order_acquire) == ANP_SHM_MAGIC &&
+                     header->version == ANP_SHM_VERSION;
+        if (valid) {
+            anp_shm_set_level(header->control, level, sample_rate);
+        } else {
+            errno = EINVAL;
+        }
+        munmap(addr, sizeof(anp_shm_header_s));
+        return valid;
+    }
+
+    // pids of live processes publishing a region
+    static std::vector<int> list_pids() {
+        std::vector<int> pids;
+        DIR* dir = opendir("/dev/shm");
+        if (!dir) {
+            return pids;
+        }
+        const char* prefix = ANP_SHM_NAME_FMT + 1; // without the leading '/'
+        size_t prefix_len = strchr(prefix, '%') - prefix;
+        while (struct dirent* entry = readdir(dir)) {
+            if (strncmp(entry->d_name, prefix, prefix_len) != 0) {
+                continue;
+            }
+            char* end;
+            long pid = strtol(entry->d_name + prefix_len, &end, 10);
+            if (*end || pid <= 0) {
+                continue;
+            }
+            // left behind by a process that crashed
+            if (kill(pid, 0) != 0 && errno == ESRCH) {
+                continue;
+            }
+            pids.push_back(pid);
+        }
+        closedir(dir);
+        return pids;
+    }
+
+private:
+    const anp_shm_header_s* shm() const {
+        return reinterpret_cast<const anp_shm_header_s*>(region);
+    }
+
+    size_t cq_table_offset() const {
+        return shm()->header_size + (size_t)shm()->max_qps * shm()->qp_size;
+    }
+
+    template <typename T>
+    static T load(const T& value) {
+        return __atomic_load_n(&value, __ATOMIC_RELAXED);
+    }
+
+    static std::string load_str(const char* str, size_t size) {
+        std::string out;
+        for (size_t i = 0; i < size; i++) {
+            char c = load(str[i]);
+            if (!c) {
+                break;
+            }
+            out += c;
+        }
+        return out;
+    }
+
+    static void load_words(const void* src, void* dst, size_t size) {
+        const counter_t* from = static_cast<const counter_t*>(src);
+        counter_t* to = static_cast<counter_t*>(dst);
+        for (size_t i = 0; i < size / sizeof(counter_t); i++) {
+            to[i] = load(from[i]);
+        }
+    }
+
+    const char* region = nullptr;
+    size_t      region_size = 0;
+};
+
+#endif
@@ -1,22 +1,201 @@
-import json
+import mmap
 import os
+import struct
 import time
 import threading
 import curses
-import subprocess
 
-FILES = [f"/tmp/device_status_{i}.json" for i in range(8)]
+# Live telemetry is read from the shared memory regions the plugin publishes,
+# /dev/shm/anp_telemetry.<pid>. The layout is defined in include/anp_shm.h.
+SHM_DIR = "/dev/shm"
+SHM_PREFIX = "anp_telemetry."
+SHM_MAGIC = 0x54504e41
+SHM_VERSION = 5
+HEADER = struct.Struct("=IIIIIIIIIiIIQ64s256s")
+DEVICE = struct.Struct("=iI64s64sQQ")
+DEVICE_OFFSET = 384
+DEVICE_SIZE = 192
+QP_IDENTITY = struct.Struct("=IIiii")
+QP_STATS = struct.Struct("=14Q")
+QP_STATS_OFFSET = 24
+QP_BUCKETS_OFFSET = 136
+QP_WQE_SIZES_OFFSET = 2312
+CQ_TABLE = struct.Struct("=III")
+CQ_TABLE_OFFSET = 12736
+CQ_IDENTITY = struct.Struct("=IIiiI")
+CQ_STATS_OFFSET = 24
+MAX_CQ_POLL_BATCH = 32
+CQ_STATS = struct.Struct(f"=3Q{MAX_CQ_POLL_BATCH + 1}Q")
+CQ_IN_USE = 0x1
+HISTOGRAM_MAX_PRECISION = 3
+HISTOGRAM_RANGE_LOG2 = 36
+HISTOGRAM_BUCKETS = (HISTOGRAM_RANGE_LOG2 - HISTOGRAM_MAX_PRECISION + 1) << HISTOGRAM_MAX_PRECISION
+MAX_WQE_SIZES = 16
+QP_IN_USE = 0x1
+QP_DATA_QP = 0x2
 UPDATE_INTERVAL = 1
 
 device_index = 0
 
-def load_json_file(filename):
+def seq_read(buf, offset, size):
+    """Copy size bytes guarded by the sequence counter at offset."""
+    for _ in range(1000):
+        seq = struct.unpack_from("=I", buf, offset)[0]
+        if seq & 1:
+            time.sleep(0)
+            continue
+        data = buf[offset:offset + size]
+        if struct.unpack_from("=I", buf, offset)[0] == seq:
+            return data
+    return None
+
+def bucket_upper(bucket, precision):
+    """Largest latency counted in a log-linear histogram bucket, see include/anp_histogram.h."""
+    bucket += 1
+    if bucket < (1 << precision):
+        return bucket - 1
+    group = bucket >> precision
+    sub = bucket & ((1 << precision) - 1)
+    return (((1 << precision) + sub) << (group - 1)) - 1
+
+def read_region(pid):
+    """Snapshot of the region of pid, one entry per device in the device_status JSON shape."""
+    try:
+        with open(os.path.join(SHM_DIR, f"{SHM_PREFIX}{pid}"), "rb") as f:
+            buf = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+    except (OSError, ValueError):
+        return []
     try:
-        with open(filename, 'r') as file:
-            return json.load(file)
-    except Exception as e:
-        print(f"Error reading {filename}: {e}")
-        return None
+        (magic, version, header_size, qp_size, max_qps, max_devices, _seq, _num_qps,
+         _num_devices, _pid, _precision, _reserved, _start_time, _host_name,
+         _process_name) = HEADER.unpack_from(buf, 0)
+        if magic != SHM_MAGIC or version != SHM_VERSION:
+            return []
+        header = seq_read(buf, 24, header_size - 24)
+        if header is None:
+            return []
+        header = bytes(24) + header
+        fields = HEADER.unpack_from(header, 0)
+        num_qps, num_devices, process_id = fields[7], fields[8], fields[9]
+        precision = min(fields[10], HISTOGRAM_MAX_PRECISION)
+        num_buckets = (HISTOGRAM_RANGE_LOG2 - precision + 1) << precision
+        process_name = fields[14].split(b"\0", 1)[0].decode(errors="replace")
+        cq_size, max_cqs, num_cqs = CQ_TABLE.unpack_from(header, CQ_TABLE_OFFSET)
+
+        devices = {}
+        for i in range(min(num_devices, max_devices)):
+            device_id, _in_use, roce, eth, hits, misses = DEVICE.unpack_from(header, DEVICE_OFFSET + i * DEVICE_SIZE)
+            devices[device_id] = {
+                "status": {
+                    "process_name": process_name,
+                    "process_id": str(process_id),
+                    "device_id": str(device_id),
+                    "roce_device": roce.split(b"\0", 1)[0].decode(errors="replace"),
+                    "eth_device": eth.split(b"\0", 1)[0].decode(errors="replace"),
+                },
+                "channels": {},
+                "stats": {"qp_pool_hits": str(hits), "qp_pool_misses": str(misses)},
+                "wqe_sizes": {},
+                "cq_polls": [0, 0, 0, 0],
+            }
+
+        for i in range(min(num_qps, max_qps)):
+            qp = seq_read(buf, header_size + i * qp_size, qp_size)
+            if qp is None:
+                continue
+            _, flags, qp_id, device_id, channel_id = QP_IDENTITY.unpack_from(qp, 0)
+            if not flags & QP_IN_USE or device_id not in devices:
+                continue
+            stats = QP_STATS.unpack_from(qp, QP_STATS_OFFSET)
+            buckets = struct.unpack_from(f"={HISTOGRAM_BUCKETS}Q", qp, QP_BUCKETS_OFFSET)
+            sizes = struct.unpack_from(f"={2 * MAX_WQE_SIZES}Q", qp, QP_WQE_SIZES_OFFSET)
+            device = devices[device_id]
+            completion_metrics = []
+            for bucket in range(num_buckets):
+                if not buckets[bucket]:
+                    continue
+                latency = stats[13] if bucket == num_buckets - 1 else min(bucket_upper(bucket, precision), stats[13])
+                completion_metrics.append({"latency_in_ns": str(latency), "num_wqe": str(buckets[bucket])})
+            for key, count in zip(sizes[0::2], sizes[1::2]):
+                if key:
+                    device["wqe_sizes"][key - 1] = device["wqe_sizes"].get(key - 1, 0) + count
+            device["channels"].setdefault(channel_id, []).append({
+                "id": str(qp_id),
+                "status": {"data_qp": "true" if flags & QP_DATA_QP else "false"},
+                "stats": {
+                    "num_wqe_sent": str(stats[0]),
+                    "num_wqe_rcvd": str(stats[1]),
+                    "num_cts_sent": str(stats[5]),
+                    "wqe_completion_metrics": completion_metrics,
+                },
+            })
+
+        # the CQ table follows the QP table
+        cq_table = header_size + max_qps * qp_size
+        for i in range(min(num_cqs, max_cqs)):
+            cq = seq_read(buf, cq_table + i * cq_size, cq_size)
+            if cq is None:
+                continue
+            _, flags, device_id, _channel_id, _max_batch = CQ_IDENTITY.unpack_from(cq, 0)
+            if not flags & CQ_IN_USE or device_id not in devices:
+                continue
+            stats = CQ_STATS.unpack_from(cq, CQ_STATS_OFFSET)
+            batches = stats[3:]
+            polls = devices[device_id]["cq_polls"]
+            polls[0] += sum(batches)
+            polls[1] += batches[0]
+            polls[2] += stats[0]
+            polls[3] = max(polls[3], stats[2])
+    finally:
+        buf.close()
+
+    result = []
+    for device in devices.values():
+        sent = rcvd = cts = 0
+        channels = []
+        for channel_id in sorted(device["channels"]):
+            queue_pairs = device["channels"][channel_id]
+            for qp in queue_pairs:
+                rcvd += int(qp["stats"]["num_wqe_rcvd"])
+                if qp["status"]["data_qp"] == "true":
+                    sent += int(qp["stats"]["num_wqe_sent"])
+                else:
+                    cts += int(qp["stats"]["num_wqe_sent"])
+            channels.append({"id": str(channel_id), "queue_pairs": queue_pairs})
+        device["channels"] = channels
+        device["status"]["num_channels"] = str(len(channels))
+        polls, empty_polls, completions, poll_interval_max = device.pop("cq_polls")
+        device["stats"].update({
+            "wqe_size_stats": [{"wqe_size": str(size), "num_wqe": str(count)}
+                               for size, count in sorted(device.pop("wqe_sizes").items())],
+            "num_wqe_sent": str(sent),
+            "num_wqe_rcvd": str(rcvd),
+            "num_cts_sent": str(cts),
+            "cq_poll_count": str(polls),
+            "cq_stats": {
+                "num_poll": str(polls),
+                "num_empty_poll": str(empty_polls),
+                "num_completion": str(completions),
+                "poll_interval_ns_max": str(poll_interval_max),
+            },
+        })
+        result.append(device)
+    return result
+
+def load_devices():
+    """Devices of all live processes publishing telemetry."""
+    devices = []
+    try:
+        names = sorted(os.listdir(SHM_DIR))
+    except OSError:
+        return devices
+    for name in names:
+        if not name.startswith(SHM_PREFIX):
+            continue
+        pid = name[len(SHM_PREFIX):]
+        if pid.isdigit() and os.path.exists(f"/proc/{pid}"):
+            devices.extend(read_region(pid))
+    return devices
 
 def plot_device_status(stdscr):
     global device_index
@@ -28,8 +207,9 @@ def plot_device_status(stdscr):
 
     while True:
         key = stdscr.getch()
+        devices = load_devices()
         if key == ord('d'):
-            device_index = (device_index + 1) % len(FILES)
+            device_index += 1
         elif key == ord(' '):
             page += 1
         elif key == ord('s'):
@@ -45,25 +225,15 @@ def plot_device_status(stdscr):
             viewing_latency_stats = False
             page = 0
 
-        device = load_json_file(FILES[device_index])
-        if device:
-            process_id = device["devices"][0]["status"]["process_id"]
-            if os.path.exists(f"/proc/{process_id}"):
-                subprocess.run(["kill", "-USR1", str(process_id)], check=True)
-                subprocess.run(["sync"], check=True)
-                subprocess.run(["sync"], check=True)
-                subprocess.run(["sync"], check=True)
-                time.sleep(1)
-
-
-
         stdscr.erase()
-        data = load_json_file(FILES[device_index])
-        if not data:
+        if not devices:
+            stdscr.addstr(0, 0, "No process publishing ANP telemetry")
+            stdscr.refresh()
             time.sleep(UPDATE_INTERVAL)
             continue
 
-        device = data["devices"][0]
+        device_index %= len(devices)
+        device = devices[device_index]
         status = device["status"]
         channels = device["channels"]
         stats = device["stats"]
@@ -107,12 +277,16 @@ def plot_device_status(stdscr):
 
             device_start_line = wqe_end_line + 3
 
-            if device_start_line + 5 < max_y - 1:
+            if device_start_line + 6 < max_y - 1:
                 stdscr.addstr(device_start_line, 0, "Device Stats Summary:")
                 num_wqe_sent = int(stats.get("num_wqe_sent", 0))
                 num_wqe_rcvd = int(stats.get("num_wqe_rcvd", 0))
                 num_cts_sent = int(stats.get("num_cts_sent", 0))
                 cq_poll_count = int(stats.get("cq_poll_count", 0))
+                cq_stats = stats.get("cq_stats", {})
+                cq_empty_polls = int(cq_stats.get("num_empty_poll", 0))
+                cq_completions = int(cq_stats.get("num_completion", 0))
+                cq_poll_interval_max = int(cq_stats.get("poll_interval_ns_max", 0))
 
                 label_length = len(f"num_wqe_sent:  ({num_wqe_sent}) ")
                 available_space = min(5, (max_x - label_length - 1))
@@ -134,6 +308,13 @@ def plot_device_status(stdscr):
                 stats_line = f"cq_poll_count:: " + ('-' * available_space) + f" ({cq_poll_count})"
                 stdscr.addstr(device_start_line + 4, 0, stats_line[:max_x - 1])
 
+                empty_pct = 100.0 * cq_empty_polls / cq_poll_count if cq_poll_count else 0.0
+                busy_polls = cq_poll_count - cq_empty_polls
+                per_poll = cq_completions / busy_polls if busy_polls else 0.0
+                stats_line = (f"cq_empty_polls: {empty_pct:.1f}% ({cq_empty_polls}), completions/poll: {per_poll:.2f}, "
+                              f"poll_interval_ns_max: {cq_poll_interval_max}")
+                stdscr.addstr(device_start_line + 5, 0, stats_line[:max_x - 1])
+
             stdscr.refresh()
             time.sleep(UPDATE_INTERVAL)
             continue